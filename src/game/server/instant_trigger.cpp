@@ -6,6 +6,7 @@
 
 #include "cbase.h"
 #include "filters.h"
+#include "collisionutils.h"
 #include "maphack_manager.h"
 #include "instant_trigger.h"
 
@@ -40,6 +41,8 @@ END_DATADESC()
 //-----------------------------------------------------------------------------
 LINK_ENTITY_TO_CLASS( instant_trigger, CInstantTrigger );
 
+static CInstantTriggerSystem g_InstantTriggerSystem( "CInstantTriggerSystem" );
+
 //-----------------------------------------------------------------------------
 CInstantTrigger::CInstantTrigger()
 {
@@ -82,45 +85,50 @@ void CInstantTrigger::Activate()
 }
 
 //-----------------------------------------------------------------------------
-void CInstantTrigger::TriggerThink()
+void CInstantTrigger::OnRestore()
 {
-	const Vector &vecSrc = GetAbsOrigin();
+	BaseClass::OnRestore();
 
-	if ( show_instant_triggers.GetBool() )
-	{
-		NDebugOverlay::Sphere( vecSrc, vec3_angle, m_flRadius, 0, 255, 0, 0, false, 0.15f );
-	}
+	SetActive( !m_bDisabled );
+}
 
-	CBaseEntity *pEnt;
-	for ( CEntitySphereQuery sphere( vecSrc, m_flRadius ); ( pEnt = sphere.GetCurrentEntity() ) != NULL; sphere.NextEntity() )
-	{
-		if ( !CanTrigger( pEnt ) )
-			continue;
+//-----------------------------------------------------------------------------
+void CInstantTrigger::UpdateOnRemove()
+{
+	g_InstantTriggerSystem.RemoveTrigger( this );
+	m_bActive = false;
 
-		CBaseFilter *pFilter = m_hFilter.Get();
-		const bool bPassesFilter = ( !pFilter ) ? true : pFilter->PassesFilter( this, pEnt );
+	BaseClass::UpdateOnRemove();
+}
 
-		if ( bPassesFilter )
-		{
-			m_OnTrigger.FireOutput( pEnt, this );
+//-----------------------------------------------------------------------------
+bool CInstantTrigger::TryTrigger( CBaseEntity *pEnt )
+{
+	if ( !CanTrigger( pEnt ) )
+		return true;
 
-			// Trigger MapHack event
-			const char *pszEventName = STRING( m_iszMapHackEvent );
-			if ( GetMapHackManager()->HasMapHack() && pszEventName[0] != '\0' )
-			{
-				GetMapHackManager()->TriggerEventByName( pszEventName );
-			}
+	CBaseFilter *pFilter = m_hFilter.Get();
+	const bool bPassesFilter = ( !pFilter ) ? true : pFilter->PassesFilter( this, pEnt );
+	if ( !bPassesFilter )
+		return true;
 
-			// Kill trigger on use
-			if ( !m_bNoClear )
-			{
-				UTIL_Remove( this );
-				return;
-			}
-		}
+	m_OnTrigger.FireOutput( pEnt, this );
+
+	// Trigger MapHack event
+	const char *pszEventName = STRING( m_iszMapHackEvent );
+	if ( GetMapHackManager()->HasMapHack() && pszEventName[0] != '\0' )
+	{
+		GetMapHackManager()->TriggerEventByName( pszEventName );
+	}
+
+	// Kill trigger on use
+	if ( !m_bNoClear )
+	{
+		UTIL_Remove( this );
+		return false;
 	}
 
-	SetNextThink( gpGlobals->curtime + 0.1f );
+	return true;
 }
 
 //------------------------------------------------------------------------------
@@ -169,20 +177,287 @@ void CInstantTrigger::InputToggle( inputdata_t &inputdata )
 //------------------------------------------------------------------------------
 void CInstantTrigger::SetActive( const bool bActive )
 {
-	// Toggles think func for entity query
+	// The trigger system only tests active triggers
 	if ( bActive )
+		g_InstantTriggerSystem.AddTrigger( this );
+	else
+		g_InstantTriggerSystem.RemoveTrigger( this );
+
+	m_bActive = bActive;
+
+	// Backward compatibility
+	m_bDisabled = !bActive;
+}
+
+//-----------------------------------------------------------------------------
+// CInstantTriggerSystem
+//-----------------------------------------------------------------------------
+CInstantTriggerSystem::CInstantTriggerSystem( const char *name ) : CAutoGameSystemPerFrame( name )
+{
+	m_flNextUpdate = 0.0f;
+}
+
+//-----------------------------------------------------------------------------
+void CInstantTriggerSystem::LevelInitPreEntity()
+{
+	m_flNextUpdate = 0.0f;
+}
+
+//-----------------------------------------------------------------------------
+void CInstantTriggerSystem::LevelShutdownPostEntity()
+{
+	m_vecTriggers.Purge();
+	m_vecUpdateTriggers.Purge();
+	m_vecMovers.Purge();
+}
+
+//-----------------------------------------------------------------------------
+void CInstantTriggerSystem::FrameUpdatePostEntityThink()
+{
+	if ( gpGlobals->curtime < m_flNextUpdate )
+		return;
+
+	m_flNextUpdate = gpGlobals->curtime + INSTANT_TRIGGER_INTERVAL;
+
+	UpdateTriggers();
+}
+
+//-----------------------------------------------------------------------------
+void CInstantTriggerSystem::AddTrigger( CInstantTrigger *pTrigger )
+{
+	if ( !m_vecTriggers.HasElement( pTrigger ) )
+		m_vecTriggers.AddToTail( pTrigger );
+}
+
+//-----------------------------------------------------------------------------
+void CInstantTriggerSystem::RemoveTrigger( CInstantTrigger *pTrigger )
+{
+	m_vecTriggers.FindAndRemove( pTrigger );
+}
+
+//-----------------------------------------------------------------------------
+void CInstantTriggerSystem::UpdateTriggers()
+{
+	if ( m_vecTriggers.Count() == 0 )
+		return;
+
+	BuildSpatialHash();
+	GatherMovers();
+	FindHits();
+
+	// Outputs fire per trigger, in the order the movers were gathered
+	FOR_EACH_VEC( m_vecUpdateTriggers, iTrigger )
 	{
-		SetThink( &CInstantTrigger::TriggerThink );
-		SetNextThink( gpGlobals->curtime + 0.1f );
+		for ( int iHit = m_vecFirstHit[iTrigger]; iHit != -1; iHit = m_vecHitNext[iHit] )
+		{
+			// Earlier outputs may have turned it off
+			CInstantTrigger *pTrigger = m_vecUpdateTriggers[iTrigger].Get();
+			if ( !pTrigger || !pTrigger->IsActive() )
+				break;
+
+			CBaseEntity *pMover = m_vecMovers[m_vecHitMover[iHit]].Get();
+			if ( !pMover || pMover->IsMarkedForDeletion() )
+				continue;
+
+			if ( !pTrigger->TryTrigger( pMover ) )
+				break;
+		}
 	}
+}
+
+//-----------------------------------------------------------------------------
+// Trigger spheres by the cells they touch, counted first and then filled
+//-----------------------------------------------------------------------------
+void CInstantTriggerSystem::BuildSpatialHash()
+{
+	const int count = m_vecTriggers.Count();
+	m_vecUpdateTriggers.SetCount( count );
+	m_vecTriggerOrigins.SetCount( count );
+	m_vecTriggerRadii.SetCount( count );
+	m_vecLargeTriggers.RemoveAll();
+
+	m_vecBucketStart.SetCount( INSTANT_TRIGGER_BUCKETS + 1 );
+	V_memset( m_vecBucketStart.Base(), 0, m_vecBucketStart.Count() * sizeof( int ) );
+
+	int cellMins[3], cellMaxs[3];
+
+	for ( int i = 0; i < count; ++i )
+	{
+		CInstantTrigger *pTrigger = m_vecTriggers[i];
+		m_vecUpdateTriggers[i] = pTrigger;
+		m_vecTriggerOrigins[i] = pTrigger->GetAbsOrigin();
+		m_vecTriggerRadii[i] = pTrigger->GetRadius();
+
+		if ( show_instant_triggers.GetBool() )
+			NDebugOverlay::Sphere( m_vecTriggerOrigins[i], vec3_angle, m_vecTriggerRadii[i], 0, 255, 0, 0, false, 0.15f );
+
+		const Vector vecRadius( m_vecTriggerRadii[i], m_vecTriggerRadii[i], m_vecTriggerRadii[i] );
+		if ( !GetCellRange( m_vecTriggerOrigins[i] - vecRadius, m_vecTriggerOrigins[i] + vecRadius, cellMins, cellMaxs ) )
+		{
+			m_vecLargeTriggers.AddToTail( i );
+			continue;
+		}
+
+		for ( int x = cellMins[0]; x <= cellMaxs[0]; ++x )
+			for ( int y = cellMins[1]; y <= cellMaxs[1]; ++y )
+				for ( int z = cellMins[2]; z <= cellMaxs[2]; ++z )
+					++m_vecBucketStart[GetBucket( x, y, z )];
+	}
+
+	// Ends of the buckets, the fill below walks them back to the starts
+	for ( int i = 1; i <= INSTANT_TRIGGER_BUCKETS; ++i )
+		m_vecBucketStart[i] += m_vecBucketStart[i - 1];
+
+	m_vecBucketTriggers.SetCount( m_vecBucketStart[INSTANT_TRIGGER_BUCKETS - 1] );
+	m_vecBucketStart[INSTANT_TRIGGER_BUCKETS] = m_vecBucketTriggers.Count();
+
+	// Backwards, so every bucket ends up in trigger order
+	for ( int i = count - 1; i >= 0; --i )
+	{
+		const Vector vecRadius( m_vecTriggerRadii[i], m_vecTriggerRadii[i], m_vecTriggerRadii[i] );
+		if ( !GetCellRange( m_vecTriggerOrigins[i] - vecRadius, m_vecTriggerOrigins[i] + vecRadius, cellMins, cellMaxs ) )
+			continue;
+
+		for ( int x = cellMaxs[0]; x >= cellMins[0]; --x )
+			for ( int y = cellMaxs[1]; y >= cellMins[1]; --y )
+				for ( int z = cellMaxs[2]; z >= cellMins[2]; --z )
+					m_vecBucketTriggers[--m_vecBucketStart[GetBucket( x, y, z )]] = i;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Everything any active trigger could accept, in entity list order
+//-----------------------------------------------------------------------------
+void CInstantTriggerSystem::GatherMovers()
+{
+	bool bPlayers = false;
+	bool bNPCs = false;
+	bool bPhysics = false;
+	bool bAll = false;
+
+	FOR_EACH_VEC( m_vecTriggers, i )
+	{
+		bPlayers |= m_vecTriggers[i]->AllowsPlayers();
+		bNPCs |= m_vecTriggers[i]->AllowsNPCs();
+		bPhysics |= m_vecTriggers[i]->AllowsPhysics();
+		bAll |= m_vecTriggers[i]->AllowsAll();
+	}
+
+	m_vecMovers.RemoveAll();
+
+	for ( CBaseEntity *pEnt = gEntList.FirstEnt(); pEnt; pEnt = gEntList.NextEnt( pEnt ) )
+	{
+		// Sphere queries only ever saw networked entities
+		if ( !pEnt->edict() || pEnt->IsWorld() || pEnt->IsMarkedForDeletion() )
+			continue;
+
+		const bool bCandidate = bAll ||
+			( bPlayers && ( pEnt->GetFlags() & FL_CLIENT ) ) ||
+			( bNPCs && ( pEnt->GetFlags() & FL_NPC ) ) ||
+			( bPhysics && pEnt->GetMoveType() == MOVETYPE_VPHYSICS );
+
+		if ( bCandidate )
+			m_vecMovers.AddToTail( pEnt );
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CInstantTriggerSystem::FindHits()
+{
+	const int triggerCount = m_vecUpdateTriggers.Count();
+
+	m_vecFirstHit.SetCount( triggerCount );
+	m_vecLastHit.SetCount( triggerCount );
+	m_vecTriggerStamps.SetCount( triggerCount );
+	for ( int i = 0; i < triggerCount; ++i )
+	{
+		m_vecFirstHit[i] = -1;
+		m_vecLastHit[i] = -1;
+		m_vecTriggerStamps[i] = -1;
+	}
+
+	m_vecHitMover.RemoveAll();
+	m_vecHitNext.RemoveAll();
+
+	int cellMins[3], cellMaxs[3];
+
+	FOR_EACH_VEC( m_vecMovers, iMover )
+	{
+		// Same bounds the spatial partition uses
+		Vector vecMins, vecMaxs;
+		m_vecMovers[iMover]->CollisionProp()->WorldSpaceSurroundingBounds( &vecMins, &vecMaxs );
+
+		if ( !GetCellRange( vecMins, vecMaxs, cellMins, cellMaxs ) )
+		{
+			for ( int iTrigger = 0; iTrigger < triggerCount; ++iTrigger )
+				TestHit( iTrigger, iMover, vecMins, vecMaxs );
+
+			continue;
+		}
+
+		for ( int x = cellMins[0]; x <= cellMaxs[0]; ++x )
+		{
+			for ( int y = cellMins[1]; y <= cellMaxs[1]; ++y )
+			{
+				for ( int z = cellMins[2]; z <= cellMaxs[2]; ++z )
+				{
+					const int bucket = GetBucket( x, y, z );
+					for ( int i = m_vecBucketStart[bucket]; i < m_vecBucketStart[bucket + 1]; ++i )
+						TestHit( m_vecBucketTriggers[i], iMover, vecMins, vecMaxs );
+				}
+			}
+		}
+
+		FOR_EACH_VEC( m_vecLargeTriggers, i )
+			TestHit( m_vecLargeTriggers[i], iMover, vecMins, vecMaxs );
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CInstantTriggerSystem::TestHit( const int iTrigger, const int iMover, const Vector &vecMins, const Vector &vecMaxs )
+{
+	// Shared cells and hash collisions bring the same trigger up again
+	if ( m_vecTriggerStamps[iTrigger] == iMover )
+		return;
+
+	m_vecTriggerStamps[iTrigger] = iMover;
+
+	if ( !IsBoxIntersectingSphere( vecMins, vecMaxs, m_vecTriggerOrigins[iTrigger], m_vecTriggerRadii[iTrigger] ) )
+		return;
+
+	const int iHit = m_vecHitMover.AddToTail( iMover );
+	m_vecHitNext.AddToTail( -1 );
+
+	if ( m_vecLastHit[iTrigger] == -1 )
+		m_vecFirstHit[iTrigger] = iHit;
 	else
+		m_vecHitNext[m_vecLastHit[iTrigger]] = iHit;
+
+	m_vecLastHit[iTrigger] = iHit;
+}
+
+//-----------------------------------------------------------------------------
+bool CInstantTriggerSystem::GetCellRange( const Vector &vecMins, const Vector &vecMaxs, int *pMins, int *pMaxs )
+{
+	int cells = 1;
+	for ( int i = 0; i < 3; ++i )
 	{
-		SetThink( NULL );
-		SetNextThink( TICK_NEVER_THINK );
+		pMins[i] = (int)floorf( vecMins[i] / INSTANT_TRIGGER_CELL_SIZE );
+		pMaxs[i] = (int)floorf( vecMaxs[i] / INSTANT_TRIGGER_CELL_SIZE );
+
+		const int axisCells = pMaxs[i] - pMins[i] + 1;
+		if ( axisCells > INSTANT_TRIGGER_MAX_CELLS )
+			return false;
+
+		cells *= axisCells;
 	}
 
-	m_bActive = bActive;
+	return ( cells <= INSTANT_TRIGGER_MAX_CELLS );
+}
 
-	// Backward compatibility
-	m_bDisabled = !bActive;
+//-----------------------------------------------------------------------------
+int CInstantTriggerSystem::GetBucket( const int x, const int y, const int z )
+{
+	const unsigned int hash = ( (unsigned int)x * 73856093u ) ^ ( (unsigned int)y * 19349663u ) ^ ( (unsigned int)z * 83492791u );
+	return hash & ( INSTANT_TRIGGER_BUCKETS - 1 );
 }
@@ -7,6 +7,16 @@
 #ifndef INSTANT_TRIGGER_H
 #define INSTANT_TRIGGER_H
 
+#include "igamesystem.h"
+
+//-----------------------------------------------------------------------------
+#define INSTANT_TRIGGER_INTERVAL 0.1f
+
+// Spatial hash
+#define INSTANT_TRIGGER_CELL_SIZE 256.0f
+#define INSTANT_TRIGGER_BUCKETS 1024 // Power of two
+#define INSTANT_TRIGGER_MAX_CELLS 64 // Spheres and movers bigger than this skip the hash
+
 //-----------------------------------------------------------------------------
 class CInstantTrigger : public CPointEntity
 {
@@ -18,8 +28,11 @@ public:
 
 	void Spawn() OVERRIDE;
 	void Activate() OVERRIDE;
+	void OnRestore() OVERRIDE;
+	void UpdateOnRemove() OVERRIDE;
 
-	void TriggerThink();
+	// From the trigger system, false once the trigger has removed itself
+	bool TryTrigger( CBaseEntity *pEnt );
 
 	bool CanTrigger( CBaseEntity *pEnt ) const;
 
@@ -28,6 +41,15 @@ public:
 	void InputToggle( inputdata_t &inputdata );
 
 	void SetActive( bool bActive );
+	bool IsActive() const { return m_bActive; }
+
+	float GetRadius() const { return m_flRadius; }
+
+	// What the trigger system gathers movers for
+	bool AllowsPlayers() const { return m_bAllowPlayers || m_bAllowAll; }
+	bool AllowsNPCs() const { return m_bAllowNPCs || m_bAllowAll; }
+	bool AllowsPhysics() const { return m_bAllowPhysics || m_bAllowAll; }
+	bool AllowsAll() const { return m_bAllowAll; }
 
 protected:
 	string_t m_iszFilterName;
@@ -52,4 +74,55 @@ private:
 	bool m_bActive;
 };
 
+//-----------------------------------------------------------------------------
+// Owns the active triggers. Movers are gathered once per update and tested
+// against every trigger sphere through a spatial hash, instead of a sphere
+// query per trigger.
+//-----------------------------------------------------------------------------
+class CInstantTriggerSystem : public CAutoGameSystemPerFrame
+{
+public:
+	CInstantTriggerSystem( const char *name );
+
+	void LevelInitPreEntity() OVERRIDE;
+	void LevelShutdownPostEntity() OVERRIDE;
+	void FrameUpdatePostEntityThink() OVERRIDE;
+
+	void AddTrigger( CInstantTrigger *pTrigger );
+	void RemoveTrigger( CInstantTrigger *pTrigger );
+
+private:
+	void UpdateTriggers();
+	void BuildSpatialHash();
+	void GatherMovers();
+	void FindHits();
+	void TestHit( int iTrigger, int iMover, const Vector &vecMins, const Vector &vecMaxs );
+
+	static bool GetCellRange( const Vector &vecMins, const Vector &vecMaxs, int *pMins, int *pMaxs );
+	static int GetBucket( int x, int y, int z );
+
+	float m_flNextUpdate;
+
+	CUtlVector<CInstantTrigger*> m_vecTriggers;
+
+	// Copied for the update, outputs may enable, disable or remove triggers
+	CUtlVector<CHandle<CInstantTrigger> > m_vecUpdateTriggers;
+	CUtlVector<Vector> m_vecTriggerOrigins;
+	CUtlVector<float> m_vecTriggerRadii;
+	CUtlVector<int> m_vecTriggerStamps; // Last mover tested against
+
+	// Trigger indices by bucket, bucket i is [ m_vecBucketStart[i], m_vecBucketStart[i + 1] )
+	CUtlVector<int> m_vecBucketStart;
+	CUtlVector<int> m_vecBucketTriggers;
+	CUtlVector<int> m_vecLargeTriggers; // Tested against every mover
+
+	CUtlVector<EHANDLE> m_vecMovers;
+
+	// Hits chained per trigger, in mover order
+	CUtlVector<int> m_vecFirstHit;
+	CUtlVector<int> m_vecLastHit;
+	CUtlVector<int> m_vecHitMover;
+	CUtlVector<int> m_vecHitNext;
+};
+
 #endif
@@ -0,0 +1,481 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Precompiled maphacks. A .mhc file is the parsed keyvalues tree
+//			as a flat node table with interned strings, plus the precache
+//			manifest, laid out to be used straight from a file mapping.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "maphack_manager.h"
+#include "maphack_compiled.h"
+#include "maphack_parser.h"
+#include "maphack_shared.h"
+#include "filesystem.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/utldict.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+//-----------------------------------------------------------------------------
+// Same limit as the text parser
+#define MAPHACK_COMPILED_MAX_DEPTH 256
+
+extern ConVar sv_maphack_compiled;
+
+//-----------------------------------------------------------------------------
+// Flattens a keyvalues tree, strings are stored once
+//-----------------------------------------------------------------------------
+class CMapHackCompiledWriter
+{
+public:
+	CMapHackCompiledWriter() : m_dictStrings( k_eDictCompareTypeCaseSensitive ) {}
+
+	int AddString( const char *pszString );
+	int AddNode( KeyValues *pKV );
+
+	CUtlVector<MapHackCompiledNode_t> m_vecNodes;
+
+	// Dict indices in the order the strings were added
+	CUtlDict<int> m_dictStrings;
+	CUtlVector<int> m_vecStrings;
+};
+
+//-----------------------------------------------------------------------------
+int CMapHackCompiledWriter::AddString( const char *pszString )
+{
+	const int index = m_dictStrings.Find( pszString );
+	if ( m_dictStrings.IsValidIndex( index ) )
+		return m_dictStrings[index];
+
+	const int iString = m_vecStrings.Count();
+	m_vecStrings.AddToTail( m_dictStrings.Insert( pszString, iString ) );
+	return iString;
+}
+
+//-----------------------------------------------------------------------------
+int CMapHackCompiledWriter::AddNode( KeyValues *pKV )
+{
+	// Nodes can move while the children are added, only hold on to indices
+	const int index = m_vecNodes.AddToTail();
+	V_memset( &m_vecNodes[index], 0, sizeof( MapHackCompiledNode_t ) );
+	m_vecNodes[index].m_iName = AddString( pKV->GetName() );
+	m_vecNodes[index].m_iType = KeyValues::TYPE_NONE;
+	m_vecNodes[index].m_iFirstChild = -1;
+	m_vecNodes[index].m_iNext = -1;
+
+	int iPrev = -1;
+	for ( KeyValues *pSub = pKV->GetFirstSubKey(); pSub; pSub = pSub->GetNextKey() )
+	{
+		const int iChild = AddNode( pSub );
+		if ( iPrev == -1 )
+			m_vecNodes[index].m_iFirstChild = iChild;
+		else
+			m_vecNodes[iPrev].m_iNext = iChild;
+
+		iPrev = iChild;
+	}
+
+	if ( iPrev != -1 )
+		return index;
+
+	switch ( pKV->GetDataType() )
+	{
+	case KeyValues::TYPE_NONE:
+		break;
+
+	case KeyValues::TYPE_INT:
+		m_vecNodes[index].m_iType = KeyValues::TYPE_INT;
+		m_vecNodes[index].m_iValue = pKV->GetInt();
+		break;
+
+	case KeyValues::TYPE_FLOAT:
+		m_vecNodes[index].m_iType = KeyValues::TYPE_FLOAT;
+		m_vecNodes[index].m_flValue = pKV->GetFloat();
+		break;
+
+	case KeyValues::TYPE_UINT64:
+	{
+		const uint64 value = pKV->GetUint64();
+		m_vecNodes[index].m_iType = KeyValues::TYPE_UINT64;
+		m_vecNodes[index].m_nValue64[0] = (unsigned int)( value & 0xFFFFFFFF );
+		m_vecNodes[index].m_nValue64[1] = (unsigned int)( value >> 32 );
+		break;
+	}
+
+	default:
+	{
+		// Strings, and the rare types the text format can't produce as strings too
+		const int iString = AddString( pKV->GetString() );
+		m_vecNodes[index].m_iType = KeyValues::TYPE_STRING;
+		m_vecNodes[index].m_iString = iString;
+		break;
+	}
+	}
+
+	return index;
+}
+
+//-----------------------------------------------------------------------------
+// Rebuilds the tree, every index is checked since the file can be anything
+//-----------------------------------------------------------------------------
+class CMapHackCompiledReader
+{
+public:
+	const char *GetString( int iString ) const;
+	KeyValues *BuildNode( int index, int depth ) const;
+
+	const MapHackCompiledNode_t *m_pNodes;
+	int m_iNodeCount;
+
+	const int *m_pStringOffsets;
+	int m_iStringCount;
+
+	const char *m_pStringData;
+	int m_iStringDataSize;
+
+	bool m_bEscapeSequences;
+};
+
+//-----------------------------------------------------------------------------
+const char *CMapHackCompiledReader::GetString( int iString ) const
+{
+	if ( iString < 0 || iString >= m_iStringCount )
+		return NULL;
+
+	// The string data is known to end with a NUL
+	const int offset = m_pStringOffsets[iString];
+	if ( offset < 0 || offset >= m_iStringDataSize )
+		return NULL;
+
+	return m_pStringData + offset;
+}
+
+//-----------------------------------------------------------------------------
+KeyValues *CMapHackCompiledReader::BuildNode( int index, int depth ) const
+{
+	const MapHackCompiledNode_t &node = m_pNodes[index];
+
+	const char *pszName = GetString( node.m_iName );
+	if ( !pszName )
+		return NULL;
+
+	KeyValues *pKV = new KeyValues( pszName );
+	pKV->UsesEscapeSequences( m_bEscapeSequences );
+
+	if ( node.m_iFirstChild != -1 )
+	{
+		if ( depth >= MAPHACK_COMPILED_MAX_DEPTH )
+		{
+			pKV->deleteThis();
+			return NULL;
+		}
+
+		// Links only ever point forward, a broken file can't make this loop
+		KeyValues *pLast = NULL;
+		int iPrev = index;
+		for ( int iChild = node.m_iFirstChild; iChild != -1; iChild = m_pNodes[iChild].m_iNext )
+		{
+			if ( iChild <= iPrev || iChild >= m_iNodeCount )
+			{
+				pKV->deleteThis();
+				return NULL;
+			}
+
+			KeyValues *pChild = BuildNode( iChild, depth + 1 );
+			if ( !pChild )
+			{
+				pKV->deleteThis();
+				return NULL;
+			}
+
+			if ( pLast )
+				pLast->SetNextKey( pChild );
+			else
+				pKV->AddSubKey( pChild );
+
+			pLast = pChild;
+			iPrev = iChild;
+		}
+
+		return pKV;
+	}
+
+	switch ( node.m_iType )
+	{
+	case KeyValues::TYPE_NONE:
+		break;
+
+	case KeyValues::TYPE_STRING:
+	{
+		const char *pszValue = GetString( node.m_iString );
+		if ( !pszValue )
+		{
+			pKV->deleteThis();
+			return NULL;
+		}
+
+		pKV->SetStringValue( pszValue );
+		break;
+	}
+
+	case KeyValues::TYPE_INT:
+		pKV->SetInt( NULL, node.m_iValue );
+		break;
+
+	case KeyValues::TYPE_FLOAT:
+		pKV->SetFloat( NULL, node.m_flValue );
+		break;
+
+	case KeyValues::TYPE_UINT64:
+		pKV->SetUint64( NULL, ( (uint64)node.m_nValue64[1] << 32 ) | node.m_nValue64[0] );
+		break;
+
+	default:
+		pKV->deleteThis();
+		return NULL;
+	}
+
+	return pKV;
+}
+
+//-----------------------------------------------------------------------------
+static bool MapHack_IsValidSection( int offset, int count, int elementSize, int fileSize )
+{
+	if ( count < 0 || offset < (int)sizeof( MapHackCompiledHeader_t ) || ( offset % 4 ) != 0 )
+		return false;
+
+	return (int64)offset + (int64)count * elementSize <= fileSize;
+}
+
+//-----------------------------------------------------------------------------
+void MapHack_GetCompiledFileName( const char *pszFilename, char *pszOut, int outSize )
+{
+	V_StripExtension( pszFilename, pszOut, outSize );
+	V_strncat( pszOut, MAPHACK_COMPILED_EXTENSION, outSize );
+}
+
+//-----------------------------------------------------------------------------
+void MapHack_BuildCompiledFile( CUtlBuffer &buf, KeyValues *pKV, const CUtlVector<MapHackPrecacheEntry_t> *pManifest,
+	const MapHackFileStamp_t &sourceStamp, bool bEscapeSequences )
+{
+	CMapHackCompiledWriter writer;
+	writer.AddNode( pKV );
+
+	CUtlVector<MapHackCompiledPrecache_t> vecPrecache;
+	if ( pManifest )
+	{
+		vecPrecache.EnsureCapacity( pManifest->Count() );
+		FOR_EACH_VEC( *pManifest, i )
+		{
+			MapHackCompiledPrecache_t &precache = vecPrecache[vecPrecache.AddToTail()];
+			precache.m_iType = pManifest->Element( i ).m_Type;
+			precache.m_iName = writer.AddString( pManifest->Element( i ).m_Name.Get() );
+		}
+	}
+
+	CUtlVector<int> vecStringOffsets;
+	vecStringOffsets.EnsureCapacity( writer.m_vecStrings.Count() );
+	CUtlBuffer stringData;
+	FOR_EACH_VEC( writer.m_vecStrings, i )
+	{
+		const char *pszString = writer.m_dictStrings.GetElementName( writer.m_vecStrings[i] );
+		vecStringOffsets.AddToTail( stringData.TellPut() );
+		stringData.Put( pszString, V_strlen( pszString ) + 1 );
+	}
+
+	// Keep whatever follows aligned
+	while ( stringData.TellPut() % 4 )
+		stringData.PutChar( '\0' );
+
+	MapHackCompiledHeader_t header;
+	V_memset( &header, 0, sizeof( header ) );
+	header.m_nMagic = MAPHACK_COMPILED_MAGIC;
+	header.m_nVersion = MAPHACK_COMPILED_VERSION;
+	header.m_nFlags = bEscapeSequences ? MAPHACK_COMPILED_ESCAPE_SEQUENCES : 0;
+	if ( pManifest )
+		header.m_nFlags |= MAPHACK_COMPILED_PRECACHE_MANIFEST;
+	header.m_nSourceTime = (unsigned int)sourceStamp.m_Time;
+	header.m_nSourceSize = sourceStamp.m_Size;
+
+	int offset = sizeof( header );
+	header.m_iNodeCount = writer.m_vecNodes.Count();
+	header.m_iNodesOffset = offset;
+	offset += writer.m_vecNodes.Count() * sizeof( MapHackCompiledNode_t );
+
+	header.m_iPrecacheCount = vecPrecache.Count();
+	header.m_iPrecacheOffset = offset;
+	offset += vecPrecache.Count() * sizeof( MapHackCompiledPrecache_t );
+
+	header.m_iStringCount = vecStringOffsets.Count();
+	header.m_iStringOffsetsOffset = offset;
+	offset += vecStringOffsets.Count() * sizeof( int );
+
+	header.m_iStringDataOffset = offset;
+	header.m_iStringDataSize = stringData.TellPut();
+
+	buf.Purge();
+	buf.EnsureCapacity( offset + stringData.TellPut() );
+	buf.Put( &header, sizeof( header ) );
+	if ( writer.m_vecNodes.Count() )
+		buf.Put( writer.m_vecNodes.Base(), writer.m_vecNodes.Count() * sizeof( MapHackCompiledNode_t ) );
+	if ( vecPrecache.Count() )
+		buf.Put( vecPrecache.Base(), vecPrecache.Count() * sizeof( MapHackCompiledPrecache_t ) );
+	if ( vecStringOffsets.Count() )
+		buf.Put( vecStringOffsets.Base(), vecStringOffsets.Count() * sizeof( int ) );
+	buf.Put( stringData.Base(), stringData.TellPut() );
+}
+
+//-----------------------------------------------------------------------------
+// Written next to the text file, wherever on disk that is
+//-----------------------------------------------------------------------------
+bool MapHack_WriteCompiledFile( const char *pszFilename, KeyValues *pKV, const CUtlVector<MapHackPrecacheEntry_t> &vecManifest,
+	const MapHackFileStamp_t &sourceStamp, bool bEscapeSequences, int *pSize )
+{
+	CUtlBuffer buf;
+	MapHack_BuildCompiledFile( buf, pKV, &vecManifest, sourceStamp, bEscapeSequences );
+
+	if ( pSize )
+		*pSize = buf.TellPut();
+
+	char szCompiled[MAX_PATH];
+	MapHack_GetCompiledFileName( pszFilename, szCompiled, sizeof( szCompiled ) );
+
+	char szFullPath[MAX_PATH];
+	if ( filesystem->RelativePathToFullPath( pszFilename, NULL, szFullPath, sizeof( szFullPath ), FILTER_CULLPACK ) )
+	{
+		char szFullCompiled[MAX_PATH];
+		MapHack_GetCompiledFileName( szFullPath, szFullCompiled, sizeof( szFullCompiled ) );
+		if ( filesystem->WriteFile( szFullCompiled, NULL, buf ) )
+			return true;
+	}
+
+	// Packed text files get theirs in the mod directory
+	return filesystem->WriteFile( szCompiled, "MOD", buf );
+}
+
+//-----------------------------------------------------------------------------
+KeyValues *MapHack_LoadCompiledFile( const char *pszFilename, bool bEscapeSequences, CUtlVector<MapHackPrecacheEntry_t> *pManifest )
+{
+	if ( !sv_maphack_compiled.GetBool() )
+		return NULL;
+
+	char szCompiled[MAX_PATH];
+	MapHack_GetCompiledFileName( pszFilename, szCompiled, sizeof( szCompiled ) );
+	if ( !filesystem->FileExists( szCompiled ) )
+		return NULL;
+
+	// Edited since it was compiled, the text wins
+	MapHackFileStamp_t stamp;
+	if ( !MapHack_GetFileStamp( pszFilename, stamp ) )
+		return NULL;
+
+	CMapHackFileView file;
+	if ( !file.Open( szCompiled ) )
+		return NULL;
+
+	KeyValues *pKV = MapHack_ReadCompiledFile( file, szCompiled, bEscapeSequences, &stamp, pManifest );
+	if ( pKV )
+		MapHack_DebugMsg( "Loaded compiled \"%s\"\n", szCompiled );
+
+	return pKV;
+}
+
+//-----------------------------------------------------------------------------
+KeyValues *MapHack_ReadCompiledFile( const CMapHackFileView &file, const char *pszName, bool bEscapeSequences,
+	const MapHackFileStamp_t *pSourceStamp, CUtlVector<MapHackPrecacheEntry_t> *pManifest )
+{
+	if ( file.Size() < (int)sizeof( MapHackCompiledHeader_t ) )
+		return NULL;
+
+	const MapHackCompiledHeader_t *pHeader = (const MapHackCompiledHeader_t *)file.Base();
+	if ( pHeader->m_nMagic != MAPHACK_COMPILED_MAGIC || pHeader->m_nVersion != MAPHACK_COMPILED_VERSION )
+	{
+		Warning( "MapHack WARNING: \"%s\" is not a compiled maphack of this version, recompile it!\n", pszName );
+		return NULL;
+	}
+
+	if ( pSourceStamp && ( pHeader->m_nSourceTime != (unsigned int)pSourceStamp->m_Time || pHeader->m_nSourceSize != pSourceStamp->m_Size ) )
+	{
+		MapHack_DebugMsg( "\"%s\" is out of date, using the text file\n", pszName );
+		return NULL;
+	}
+
+	if ( ( ( pHeader->m_nFlags & MAPHACK_COMPILED_ESCAPE_SEQUENCES ) != 0 ) != bEscapeSequences )
+		return NULL;
+
+	// Written without one, the caller would miss precaches
+	if ( pManifest && !( pHeader->m_nFlags & MAPHACK_COMPILED_PRECACHE_MANIFEST ) )
+		return NULL;
+
+	const int fileSize = file.Size();
+	if ( pHeader->m_iNodeCount < 1
+		|| !MapHack_IsValidSection( pHeader->m_iNodesOffset, pHeader->m_iNodeCount, sizeof( MapHackCompiledNode_t ), fileSize )
+		|| !MapHack_IsValidSection( pHeader->m_iPrecacheOffset, pHeader->m_iPrecacheCount, sizeof( MapHackCompiledPrecache_t ), fileSize )
+		|| !MapHack_IsValidSection( pHeader->m_iStringOffsetsOffset, pHeader->m_iStringCount, sizeof( int ), fileSize )
+		|| !MapHack_IsValidSection( pHeader->m_iStringDataOffset, pHeader->m_iStringDataSize, 1, fileSize )
+		|| pHeader->m_iStringDataSize < 1
+		|| file.Base()[pHeader->m_iStringDataOffset + pHeader->m_iStringDataSize - 1] != '\0' )
+	{
+		Warning( "MapHack WARNING: \"%s\" is corrupt, using the text file!\n", pszName );
+		return NULL;
+	}
+
+	CMapHackCompiledReader reader;
+	reader.m_pNodes = (const MapHackCompiledNode_t *)( file.Base() + pHeader->m_iNodesOffset );
+	reader.m_iNodeCount = pHeader->m_iNodeCount;
+	reader.m_pStringOffsets = (const int *)( file.Base() + pHeader->m_iStringOffsetsOffset );
+	reader.m_iStringCount = pHeader->m_iStringCount;
+	reader.m_pStringData = file.Base() + pHeader->m_iStringDataOffset;
+	reader.m_iStringDataSize = pHeader->m_iStringDataSize;
+	reader.m_bEscapeSequences = bEscapeSequences;
+
+	KeyValues *pKV = reader.BuildNode( 0, 0 );
+	if ( !pKV )
+	{
+		Warning( "MapHack WARNING: \"%s\" is corrupt, using the text file!\n", pszName );
+		return NULL;
+	}
+
+	if ( pManifest )
+	{
+		const MapHackCompiledPrecache_t *pPrecache = (const MapHackCompiledPrecache_t *)( file.Base() + pHeader->m_iPrecacheOffset );
+		for ( int i = 0; i < pHeader->m_iPrecacheCount; ++i )
+		{
+			const char *pszName = reader.GetString( pPrecache[i].m_iName );
+			if ( !pszName || pPrecache[i].m_iType < 0 || pPrecache[i].m_iType >= MAPHACK_PRECACHE_COUNT )
+				continue;
+
+			MapHackPrecacheEntry_t &entry = pManifest->Element( pManifest->AddToTail() );
+			entry.m_Type = (MapHackPrecacheType_t)pPrecache[i].m_iType;
+			entry.m_Name = pszName;
+		}
+	}
+
+	return pKV;
+}
+
+//-----------------------------------------------------------------------------
+KeyValues *MapHack_LoadFile( const char *pszFilename, bool bEscapeSequences )
+{
+	KeyValues *pKV = MapHack_LoadCompiledFile( pszFilename, bEscapeSequences );
+	if ( pKV )
+		return pKV;
+
+	MapHackContentKey_t key;
+	if ( !MapHack_IsSharedCacheEnabled() || !MapHack_GetContentKey( pszFilename, key ) )
+		return MapHack_ParseFile( pszFilename, bEscapeSequences );
+
+	pKV = MapHack_LoadSharedFile( key, bEscapeSequences );
+	if ( pKV )
+		return pKV;
+
+	// First server on the host to read it, compiled without a manifest since
+	// the precache pass only trusts the ones of root files
+	pKV = MapHack_ParseFile( pszFilename, bEscapeSequences );
+	if ( pKV )
+		MapHack_StoreSharedFile( key, pKV, NULL, bEscapeSequences );
+
+	return pKV;
+}
@@ -0,0 +1,104 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Precompiled maphacks. A .mhc file is the parsed keyvalues tree
+//			as a flat node table with interned strings, plus the precache
+//			manifest, laid out to be used straight from a file mapping.
+//
+//=============================================================================//
+
+#ifndef MAPHACK_COMPILED_H
+#define MAPHACK_COMPILED_H
+
+#include "tier1/utlvector.h"
+
+class KeyValues;
+class CUtlBuffer;
+class CMapHackFileView;
+struct MapHackPrecacheEntry_t;
+struct MapHackFileStamp_t;
+
+//-----------------------------------------------------------------------------
+#define MAPHACK_COMPILED_MAGIC ( ( 'M' << 0 ) | ( 'H' << 8 ) | ( 'C' << 16 ) | ( '1' << 24 ) )
+#define MAPHACK_COMPILED_VERSION 1
+#define MAPHACK_COMPILED_EXTENSION ".mhc"
+
+enum
+{
+	MAPHACK_COMPILED_ESCAPE_SEQUENCES = 1 << 0, // Parsed like a root file, not an include
+	MAPHACK_COMPILED_PRECACHE_MANIFEST = 1 << 1, // Written with what it precaches, even if that's nothing
+};
+
+//-----------------------------------------------------------------------------
+// All offsets are from the start of the file, indices start from 0
+//-----------------------------------------------------------------------------
+struct MapHackCompiledHeader_t
+{
+	unsigned int m_nMagic;
+	unsigned int m_nVersion;
+	unsigned int m_nFlags;
+
+	// The text it was compiled from, anything else makes the file stale
+	unsigned int m_nSourceTime;
+	unsigned int m_nSourceSize;
+
+	int m_iNodeCount;
+	int m_iNodesOffset;
+
+	int m_iPrecacheCount;
+	int m_iPrecacheOffset;
+
+	int m_iStringCount;
+	int m_iStringOffsetsOffset; // int per string, from the start of the string data
+	int m_iStringDataOffset;
+	int m_iStringDataSize;
+};
+
+//-----------------------------------------------------------------------------
+// Keys in depth-first order, children and peers always come after the key
+//-----------------------------------------------------------------------------
+struct MapHackCompiledNode_t
+{
+	int m_iName; // String
+	int m_iType; // KeyValues::types_t, TYPE_NONE for blocks
+	int m_iFirstChild; // Node, -1 for none
+	int m_iNext; // Node, -1 for none
+
+	union
+	{
+		int m_iValue;
+		float m_flValue;
+		int m_iString; // String
+		unsigned int m_nValue64[2];
+	};
+};
+
+//-----------------------------------------------------------------------------
+struct MapHackCompiledPrecache_t
+{
+	int m_iType; // MapHackPrecacheType_t
+	int m_iName; // String
+};
+
+//-----------------------------------------------------------------------------
+void MapHack_GetCompiledFileName( const char *pszFilename, char *pszOut, int outSize );
+
+// Serializes the tree, the manifest is what it precaches
+bool MapHack_WriteCompiledFile( const char *pszFilename, KeyValues *pKV, const CUtlVector<MapHackPrecacheEntry_t> &vecManifest,
+	const MapHackFileStamp_t &sourceStamp, bool bEscapeSequences, int *pSize = NULL );
+
+// Tree of the .mhc next to the text file, NULL if there is none or it is stale
+KeyValues *MapHack_LoadCompiledFile( const char *pszFilename, bool bEscapeSequences, CUtlVector<MapHackPrecacheEntry_t> *pManifest = NULL );
+
+// Same as a .mhc file, a NULL manifest leaves it out
+void MapHack_BuildCompiledFile( CUtlBuffer &buf, KeyValues *pKV, const CUtlVector<MapHackPrecacheEntry_t> *pManifest,
+	const MapHackFileStamp_t &sourceStamp, bool bEscapeSequences );
+
+// Tree of a .mhc in memory, NULL stamp skips the staleness check. Asking for
+// the manifest of a file written without one fails.
+KeyValues *MapHack_ReadCompiledFile( const CMapHackFileView &file, const char *pszName, bool bEscapeSequences,
+	const MapHackFileStamp_t *pSourceStamp, CUtlVector<MapHackPrecacheEntry_t> *pManifest = NULL );
+
+// Compiled version if there is an up to date one, the text otherwise
+KeyValues *MapHack_LoadFile( const char *pszFilename, bool bEscapeSequences );
+
+#endif
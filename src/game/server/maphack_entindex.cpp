@@ -0,0 +1,468 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Entity lump index. The lump is tokenized once per level, after
+//			that every entity is found by its offset, so round restarts and
+//			respawns don't scan the whole string again. The lump can be kept
+//			compressed in chunks that end on entity boundaries.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "maphack_entindex.h"
+#include "mapentities.h"
+#include "mapentities_shared.h"
+#include "world.h"
+#include "templates.h"
+#include "point_template.h"
+#include "ai_initutils.h"
+#include "lights.h"
+#include "tier1/lzss.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+//-----------------------------------------------------------------------------
+CMapHackEntityIndex::CMapHackEntityIndex() : m_ClassNames( 0, 32, false ), m_mapHammerIDs( DefLessFunc( int ) )
+{
+	m_bBuilt = false;
+	m_pszEntData = NULL;
+	m_iLumpSize = 0;
+
+	m_iChunkTextChunk = -1;
+	m_iDecompressions = 0;
+	m_flDecompressTime = 0.0;
+}
+
+//-----------------------------------------------------------------------------
+CMapHackEntityIndex::~CMapHackEntityIndex()
+{
+	Purge();
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackEntityIndex::Build( const char *pszEntData )
+{
+	Purge();
+
+	if ( !pszEntData )
+		return;
+
+	m_bBuilt = true;
+	m_pszEntData = pszEntData;
+	m_iLumpSize = V_strlen( pszEntData ) + 1;
+
+	char szKeyName[MAPKEY_MAXLENGTH];
+	char szValue[MAPKEY_MAXLENGTH];
+
+	const char *psz = pszEntData;
+	while ( true )
+	{
+		// Opening brace
+		psz = MapEntity_ParseToken( psz, szKeyName );
+		if ( !psz )
+			break;
+
+		if ( szKeyName[0] != '{' )
+		{
+			Warning( "MapHack WARNING: Found \"%s\" when expecting {, indexed %d entities\n", szKeyName, m_vecEntities.Count() );
+			break;
+		}
+
+		MapHackIndexedEntity_t entity;
+		entity.m_iOffset = psz - pszEntData;
+		entity.m_iHammerID = -1;
+		entity.m_ClassName = UTL_INVAL_SYMBOL;
+		entity.m_iChunk = -1;
+		entity.m_iRespawns = 0;
+		entity.m_pParsed = NULL;
+
+		// Keys up to the closing brace
+		while ( true )
+		{
+			psz = MapEntity_ParseToken( psz, szKeyName );
+			if ( !psz || szKeyName[0] == '}' )
+				break;
+
+			psz = MapEntity_ParseToken( psz, szValue );
+			if ( !psz )
+				break;
+
+			// First one wins, like CEntityMapData::ExtractValue()
+			if ( V_stricmp( szKeyName, "classname" ) == 0 && !entity.m_ClassName.IsValid() )
+				entity.m_ClassName = m_ClassNames.AddString( szValue );
+			else if ( V_stricmp( szKeyName, "hammerid" ) == 0 )
+				entity.m_iHammerID = V_atoi( szValue );
+		}
+
+		if ( !psz )
+		{
+			Warning( "MapHack WARNING: Unterminated entity in the entity lump, indexed %d entities\n", m_vecEntities.Count() );
+			break;
+		}
+
+		entity.m_iLength = ( psz - pszEntData ) - entity.m_iOffset;
+		const int idx = m_vecEntities.AddToTail( entity );
+
+		// Duplicates keep the first one, like a scan from the start would
+		if ( entity.m_iHammerID != -1 && !m_mapHammerIDs.IsValidIndex( m_mapHammerIDs.Find( entity.m_iHammerID ) ) )
+			m_mapHammerIDs.Insert( entity.m_iHammerID, idx );
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackEntityIndex::Purge()
+{
+	FOR_EACH_VEC( m_vecEntities, i )
+		delete m_vecEntities[i].m_pParsed;
+
+	m_bBuilt = false;
+	m_pszEntData = NULL;
+	m_iLumpSize = 0;
+	m_vecEntities.Purge();
+	m_ClassNames.RemoveAll();
+	m_mapHammerIDs.Purge();
+
+	PurgeChunks();
+	m_iDecompressions = 0;
+	m_flDecompressTime = 0.0;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackEntityIndex::PurgeChunks()
+{
+	FOR_EACH_VEC( m_vecChunks, i )
+		delete[] m_vecChunks[i].m_pData;
+
+	m_vecChunks.Purge();
+	m_vecChunkText.Purge();
+	m_iChunkTextChunk = -1;
+}
+
+//-----------------------------------------------------------------------------
+// Chunks start where an entity's keys do, so no entity is split. The first
+// one also has what comes before the first entity, the last one the NUL.
+//-----------------------------------------------------------------------------
+void CMapHackEntityIndex::Compress( const int chunkSize )
+{
+	if ( !m_pszEntData || m_vecEntities.Count() == 0 )
+		return;
+
+	CLZSS lzss;
+	CUtlVector<unsigned char> vecCompressed;
+
+	int iFirst = 0;
+	while ( iFirst < m_vecEntities.Count() )
+	{
+		const int start = ( iFirst == 0 ) ? 0 : m_vecEntities[iFirst].m_iOffset;
+
+		// At least one entity, big ones get a chunk of their own
+		int iNext = iFirst + 1;
+		while ( iNext < m_vecEntities.Count() && m_vecEntities[iNext].m_iOffset - start < chunkSize )
+			++iNext;
+
+		const int end = ( iNext < m_vecEntities.Count() ) ? m_vecEntities[iNext].m_iOffset : m_iLumpSize;
+
+		const int iChunk = m_vecChunks.AddToTail();
+		MapHackLumpChunk_t &chunk = m_vecChunks[iChunk];
+		chunk.m_iStart = start;
+		chunk.m_iSize = end - start;
+
+		const unsigned char *pInput = (const unsigned char *)m_pszEntData + start;
+		vecCompressed.SetCount( chunk.m_iSize );
+
+		unsigned int compressedSize = 0;
+		chunk.m_bCompressed = ( lzss.CompressNoAlloc( pInput, chunk.m_iSize, vecCompressed.Base(), &compressedSize ) != NULL );
+		if ( chunk.m_bCompressed )
+			pInput = vecCompressed.Base();
+		else
+			compressedSize = chunk.m_iSize;
+
+		chunk.m_iDataSize = compressedSize;
+		chunk.m_pData = new unsigned char[chunk.m_iDataSize];
+		V_memcpy( chunk.m_pData, pInput, chunk.m_iDataSize );
+
+		for ( int i = iFirst; i < iNext; ++i )
+			m_vecEntities[i].m_iChunk = iChunk;
+
+		iFirst = iNext;
+	}
+
+	m_pszEntData = NULL;
+}
+
+//-----------------------------------------------------------------------------
+char *CMapHackEntityIndex::Decompress()
+{
+	if ( !IsCompressed() )
+		return NULL;
+
+	char *pszEntData = new char[m_iLumpSize];
+	FOR_EACH_VEC( m_vecChunks, i )
+	{
+		LoadChunk( i );
+		V_memcpy( pszEntData + m_vecChunks[i].m_iStart, m_vecChunkText.Base(), m_vecChunks[i].m_iSize );
+	}
+
+	PurgeChunks();
+
+	FOR_EACH_VEC( m_vecEntities, i )
+		m_vecEntities[i].m_iChunk = -1;
+
+	m_pszEntData = pszEntData;
+	return pszEntData;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackEntityIndex::LoadChunk( const int iChunk ) const
+{
+	if ( m_iChunkTextChunk == iChunk )
+		return;
+
+	const double flStart = Plat_FloatTime();
+
+	// Room for the NULs readers may look past the closing brace for
+	const MapHackLumpChunk_t &chunk = m_vecChunks[iChunk];
+	m_vecChunkText.SetCount( chunk.m_iSize + 3 );
+	V_memset( m_vecChunkText.Base() + chunk.m_iSize, 0, 3 );
+
+	if ( chunk.m_bCompressed )
+	{
+		CLZSS lzss;
+		lzss.Uncompress( chunk.m_pData, (unsigned char *)m_vecChunkText.Base() );
+	}
+	else
+	{
+		V_memcpy( m_vecChunkText.Base(), chunk.m_pData, chunk.m_iSize );
+	}
+
+	m_iChunkTextChunk = iChunk;
+
+	++m_iDecompressions;
+	m_flDecompressTime += Plat_FloatTime() - flStart;
+}
+
+//-----------------------------------------------------------------------------
+const char *CMapHackEntityIndex::GetEntityData( const int i ) const
+{
+	const MapHackIndexedEntity_t &entity = m_vecEntities[i];
+	if ( entity.m_iChunk == -1 )
+		return m_pszEntData + entity.m_iOffset;
+
+	LoadChunk( entity.m_iChunk );
+	return m_vecChunkText.Base() + ( entity.m_iOffset - m_vecChunks[entity.m_iChunk].m_iStart );
+}
+
+//-----------------------------------------------------------------------------
+int CMapHackEntityIndex::GetCompressedSize() const
+{
+	int size = 0;
+	FOR_EACH_VEC( m_vecChunks, i )
+		size += m_vecChunks[i].m_iDataSize;
+
+	return size;
+}
+
+//-----------------------------------------------------------------------------
+const char *CMapHackEntityIndex::GetClassName( const int i ) const
+{
+	const CUtlSymbol &sym = m_vecEntities[i].m_ClassName;
+	return sym.IsValid() ? m_ClassNames.String( sym ) : "";
+}
+
+//-----------------------------------------------------------------------------
+int CMapHackEntityIndex::FindByHammerID( const int hammerID ) const
+{
+	const unsigned short idx = m_mapHammerIDs.Find( hammerID );
+	return m_mapHammerIDs.IsValidIndex( idx ) ? m_mapHammerIDs[idx] : -1;
+}
+
+//-----------------------------------------------------------------------------
+// Parsed keys skip the tokenizer, but go straight to KeyValue() instead of
+// through ParseMapData()
+//-----------------------------------------------------------------------------
+CBaseEntity *CMapHackEntityIndex::RespawnEntity( const int i, const int cacheAfter, bool *pCached )
+{
+	MapHackIndexedEntity_t &entity = m_vecEntities[i];
+	++entity.m_iRespawns;
+
+	if ( !entity.m_pParsed && cacheAfter > 0 && entity.m_iRespawns > cacheAfter && entity.m_ClassName.IsValid() )
+	{
+		entity.m_pParsed = new MapHackParsedEntity_t();
+		entity.m_pParsed->m_iKeys = 0;
+
+		CEntityMapData entData( const_cast<char *>( GetEntityData( i ) ) );
+
+		char szKeyName[MAPKEY_MAXLENGTH];
+		char szValue[MAPKEY_MAXLENGTH];
+		if ( entData.GetFirstKey( szKeyName, szValue ) )
+		{
+			do
+			{
+				entity.m_pParsed->m_vecText.AddMultipleToTail( V_strlen( szKeyName ) + 1, szKeyName );
+				entity.m_pParsed->m_vecText.AddMultipleToTail( V_strlen( szValue ) + 1, szValue );
+				++entity.m_pParsed->m_iKeys;
+			}
+			while ( entData.GetNextKey( szKeyName, szValue ) );
+		}
+	}
+
+	if ( pCached )
+		*pCached = ( entity.m_pParsed != NULL );
+
+	if ( !entity.m_pParsed )
+	{
+		CBaseEntity *pEntity = NULL;
+		MapEntity_ParseEntity( pEntity, GetEntityData( i ), NULL );
+		return pEntity;
+	}
+
+	CBaseEntity *pEntity = CreateEntityByName( GetClassName( i ) );
+	if ( !pEntity )
+		return NULL;
+
+	const char *psz = entity.m_pParsed->m_vecText.Base();
+	for ( int iKey = 0; iKey < entity.m_pParsed->m_iKeys; ++iKey )
+	{
+		const char *pszKeyName = psz;
+		const char *pszValue = pszKeyName + V_strlen( pszKeyName ) + 1;
+		psz = pszValue + V_strlen( pszValue ) + 1;
+
+		pEntity->KeyValue( pszKeyName, pszValue );
+	}
+
+	return pEntity;
+}
+
+//-----------------------------------------------------------------------------
+void MapHack_ParseAllEntities( const CMapHackEntityIndex &index, IMapEntityFilter *pFilter, const bool bActivateEntities )
+{
+	CUtlVector<HierarchicalSpawn_t> vecSpawnList;
+	vecSpawnList.EnsureCapacity( index.Count() );
+
+	// Entity of each spawn list entry, point_templates keep the text. Only
+	// asked for again later, compressed text doesn't stay around.
+	CUtlVector<int> vecSpawnEntity;
+	CUtlVector<int> vecSpawnDataLength;
+	vecSpawnEntity.EnsureCapacity( index.Count() );
+	vecSpawnDataLength.EnsureCapacity( index.Count() );
+
+	CUtlVector<CPointTemplate*> vecPointTemplates;
+
+	for ( int i = 0; i < index.Count(); ++i )
+	{
+		// Same as MapEntity_ParseEntity(), but the class name comes from the
+		// index and entities the filter rejects aren't tokenized at all
+		if ( !index.Element( i ).m_ClassName.IsValid() )
+		{
+			Warning( "MapHack WARNING: Entity %d has no classname, skipping it\n", i );
+			continue;
+		}
+
+		// The filter sees every entity, some count them
+		const char *pszClassName = index.GetClassName( i );
+		if ( pFilter && !pFilter->ShouldCreateEntity( pszClassName ) )
+			continue;
+
+		CBaseEntity *pEntity = pFilter ? pFilter->CreateNextEntity( pszClassName ) : CreateEntityByName( pszClassName );
+		if ( !pEntity )
+		{
+			Warning( "Can't init %s\n", pszClassName );
+			continue;
+		}
+
+		const char *pszCurEntData = index.GetEntityData( i );
+		CEntityMapData entData( const_cast<char *>( pszCurEntData ) );
+		pEntity->ParseMapData( &entData );
+
+		if ( pEntity->IsTemplate() )
+		{
+			// Recreated later from the text, which ends with the closing brace
+			Templates_Add( pEntity, pszCurEntData, index.Element( i ).m_iLength );
+
+			UTIL_Remove( pEntity );
+			gEntList.CleanupDeleteList();
+			continue;
+		}
+
+		if ( dynamic_cast<CWorld *>( pEntity ) )
+		{
+			pEntity->m_iParent = NULL_STRING;
+			DispatchSpawn( pEntity );
+			continue;
+		}
+
+		// Nodes and lights remove themselves on spawn, free their slots right away
+		CNodeEnt *pNode = dynamic_cast<CNodeEnt *>( pEntity );
+		if ( pNode )
+		{
+			if ( pNode->Spawn( pszCurEntData ) < 0 )
+				gEntList.CleanupDeleteList();
+
+			continue;
+		}
+
+		if ( dynamic_cast<CLight *>( pEntity ) )
+		{
+			if ( DispatchSpawn( pEntity ) < 0 )
+				gEntList.CleanupDeleteList();
+
+			continue;
+		}
+
+		// point_templates spawn before everything else
+		CPointTemplate *pPointTemplate = dynamic_cast<CPointTemplate *>( pEntity );
+		if ( pPointTemplate )
+		{
+			vecPointTemplates.AddToTail( pPointTemplate );
+			continue;
+		}
+
+		HierarchicalSpawn_t &spawn = vecSpawnList[vecSpawnList.AddToTail()];
+		spawn.m_pEntity = pEntity;
+		spawn.m_nDepth = 0;
+		spawn.m_pDeferredParent = NULL;
+		spawn.m_pDeferredParentAttachment = NULL;
+
+		vecSpawnEntity.AddToTail( i );
+		vecSpawnDataLength.AddToTail( dataLength );
+	}
+
+	FOR_EACH_VEC( vecPointTemplates, i )
+	{
+		CPointTemplate *pPointTemplate = vecPointTemplates[i];
+		if ( DispatchSpawn( pPointTemplate ) < 0 )
+		{
+			UTIL_Remove( pPointTemplate );
+			gEntList.CleanupDeleteList();
+			continue;
+		}
+
+		pPointTemplate->StartBuildingTemplates();
+
+		// Turn the entities it points to into templates
+		for ( int iTemplate = 0; iTemplate < pPointTemplate->GetNumTemplateEntities(); ++iTemplate )
+		{
+			CBaseEntity *pTemplateEntity = pPointTemplate->GetTemplateEntity( iTemplate );
+			FOR_EACH_VEC( vecSpawnList, iSpawn )
+			{
+				if ( vecSpawnList[iSpawn].m_pEntity != pTemplateEntity )
+					continue;
+
+				pPointTemplate->AddTemplate( pTemplateEntity, index.GetEntityData( vecSpawnEntity[iSpawn] ), vecSpawnDataLength[iSpawn] );
+
+				if ( pPointTemplate->ShouldRemoveTemplateEntities() )
+				{
+					UTIL_Remove( pTemplateEntity );
+					gEntList.CleanupDeleteList();
+					vecSpawnList[iSpawn].m_pEntity = NULL;
+				}
+
+				break;
+			}
+		}
+
+		pPointTemplate->FinishBuildingTemplates();
+	}
+
+	SpawnHierarchicalList( vecSpawnList.Count(), vecSpawnList.Base(), bActivateEntities );
+}
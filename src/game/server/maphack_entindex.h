@@ -0,0 +1,123 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Entity lump index. The lump is tokenized once per level, after
+//			that every entity is found by its offset, so round restarts and
+//			respawns don't scan the whole string again. The lump can be kept
+//			compressed in chunks that end on entity boundaries.
+//
+//=============================================================================//
+
+#ifndef MAPHACK_ENTINDEX_H
+#define MAPHACK_ENTINDEX_H
+
+#include "tier1/utlvector.h"
+#include "tier1/utlsymbol.h"
+#include "tier1/utlmap.h"
+
+class CBaseEntity;
+class IMapEntityFilter;
+
+//-----------------------------------------------------------------------------
+// Keys of an entity in the order ParseMapData() hands them to KeyValue()
+//-----------------------------------------------------------------------------
+struct MapHackParsedEntity_t
+{
+	CUtlVector<char> m_vecText; // Name and value of each key, NUL terminated
+	int m_iKeys;
+};
+
+//-----------------------------------------------------------------------------
+struct MapHackIndexedEntity_t
+{
+	int m_iOffset; // Past the opening brace, where MapEntity_ParseEntity starts
+	int m_iLength; // Up to and including the closing brace
+	int m_iHammerID; // -1 if it has none
+	CUtlSymbol m_ClassName;
+	int m_iChunk; // -1 while the lump isn't compressed
+
+	int m_iRespawns;
+	MapHackParsedEntity_t *m_pParsed; // Set once it respawns often enough
+};
+
+//-----------------------------------------------------------------------------
+// Decompresses on its own, the chunks put back together are the lump
+//-----------------------------------------------------------------------------
+struct MapHackLumpChunk_t
+{
+	int m_iStart; // In the lump
+	int m_iSize;
+
+	unsigned char *m_pData;
+	int m_iDataSize;
+	bool m_bCompressed; // Stored as is if LZSS didn't make it smaller
+};
+
+//-----------------------------------------------------------------------------
+class CMapHackEntityIndex
+{
+public:
+	CMapHackEntityIndex();
+	~CMapHackEntityIndex();
+
+	// The lump isn't copied, it has to outlive the index until Compress()
+	void Build( const char *pszEntData );
+	void Purge();
+
+	bool IsBuilt() const { return m_bBuilt; }
+
+	// After this the index no longer points to the lump, it can be freed
+	void Compress( int chunkSize );
+	bool IsCompressed() const { return ( m_vecChunks.Count() > 0 ); }
+
+	// The whole lump again, new[]'d. The index points into it from now on.
+	char *Decompress();
+
+	int Count() const { return m_vecEntities.Count(); }
+	const MapHackIndexedEntity_t &Element( int i ) const { return m_vecEntities[i]; }
+
+	// Compressed lumps decompress the chunk, the text is valid until an
+	// entity of another chunk is asked for
+	const char *GetEntityData( int i ) const;
+	const char *GetClassName( int i ) const;
+
+	// First entity with the hammerid, -1 if there is none
+	int FindByHammerID( int hammerID ) const;
+
+	// Creates the entity like MapEntity_ParseEntity() without a filter, an
+	// entity that has respawned cacheAfter times keeps its keys parsed.
+	// 0 never caches.
+	CBaseEntity *RespawnEntity( int i, int cacheAfter, bool *pCached = NULL );
+
+	int GetChunkCount() const { return m_vecChunks.Count(); }
+	int GetLumpSize() const { return m_iLumpSize; }
+	int GetCompressedSize() const;
+	int GetDecompressions() const { return m_iDecompressions; }
+	double GetDecompressTime() const { return m_flDecompressTime; }
+
+private:
+	void LoadChunk( int iChunk ) const;
+	void PurgeChunks();
+
+	bool m_bBuilt;
+	const char *m_pszEntData; // NULL once compressed
+	int m_iLumpSize; // With the NUL
+	CUtlVector<MapHackIndexedEntity_t> m_vecEntities;
+	CUtlSymbolTable m_ClassNames;
+	CUtlMap<int, int> m_mapHammerIDs;
+
+	CUtlVector<MapHackLumpChunk_t> m_vecChunks;
+
+	// Last chunk decompressed
+	mutable CUtlVector<char> m_vecChunkText;
+	mutable int m_iChunkTextChunk;
+	mutable int m_iDecompressions;
+	mutable double m_flDecompressTime;
+};
+
+//-----------------------------------------------------------------------------
+// MapEntity_ParseAllEntities over an index, same order and same handling of
+// templates, nodes and lights. Only entities the filter accepts are parsed.
+//-----------------------------------------------------------------------------
+void MapHack_ParseAllEntities( const CMapHackEntityIndex &index, IMapEntityFilter *pFilter, bool bActivateEntities );
+
+#endif
@@ -0,0 +1,842 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Compiled MapHack expressions. Conditions and assignments are
+//			parsed once into a flat node tree and evaluated without touching
+//			the heap.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "maphack_manager.h"
+#include "maphack_expression.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+//-----------------------------------------------------------------------------
+#define MAPHACK_EXPR_MAX_TOKEN 128
+
+//-----------------------------------------------------------------------------
+static inline bool MapHack_IsIdentChar( const char c )
+{
+	return ( isalnum( (unsigned char)c ) || c == '_' || c == '.' || c == ':' || c == '#' || c == '@' || (unsigned char)c >= 0x80 );
+}
+
+//-----------------------------------------------------------------------------
+static inline void MapHack_ClearValue( MapHackExprValue_t &value )
+{
+	value.m_Type = MapHackType_t::TYPE_NONE;
+	value.m_iValue = 0;
+	value.m_flValue = 0.0f;
+	value.m_pszValue = "";
+	value.m_vecValue[0] = value.m_vecValue[1] = value.m_vecValue[2] = 0.0f;
+}
+
+//-----------------------------------------------------------------------------
+bool MapHackExprValue_t::IsVector() const
+{
+	return m_Type == MAPHACK_TYPE_VECTOR;
+}
+
+//-----------------------------------------------------------------------------
+bool MapHackExprValue_t::IsTrue() const
+{
+	switch ( m_Type )
+	{
+		case MapHackType_t::TYPE_INT:
+			return m_iValue != 0;
+		case MapHackType_t::TYPE_FLOAT:
+			return m_flValue != 0.0f;
+		case MapHackType_t::TYPE_STRING:
+			return m_pszValue && m_pszValue[0] != '\0';
+		case MAPHACK_TYPE_VECTOR:
+			return m_vecValue[0] != 0.0f || m_vecValue[1] != 0.0f || m_vecValue[2] != 0.0f;
+		default:
+			return false;
+	}
+}
+
+//-----------------------------------------------------------------------------
+CMapHackExpression::CMapHackExpression()
+{
+	m_iRoot = -1;
+
+	m_pszSource = NULL;
+	m_pszCursor = NULL;
+	m_fnLookup = NULL;
+	m_bError = false;
+}
+
+//-----------------------------------------------------------------------------
+bool CMapHackExpression::Compile( const char *pszExpression, const FnMapHackVariableLookup_t fnLookup )
+{
+	m_vecNodes.RemoveAll();
+	m_StringPool.RemoveAll();
+	m_iRoot = -1;
+
+	if ( !pszExpression )
+		return false;
+
+	m_pszSource = pszExpression;
+	m_pszCursor = pszExpression;
+	m_fnLookup = fnLookup;
+	m_bError = false;
+
+	int iRoot = ParseOr();
+
+	// Everything must be consumed
+	SkipWhitespace();
+	if ( !m_bError && *m_pszCursor != '\0' )
+	{
+		Error( "unexpected trailing characters" );
+	}
+
+	if ( m_bError )
+		iRoot = -1;
+
+	m_iRoot = iRoot;
+
+	m_pszSource = NULL;
+	m_pszCursor = NULL;
+	m_fnLookup = NULL;
+
+	return IsValid();
+}
+
+//-----------------------------------------------------------------------------
+bool CMapHackExpression::EvaluateBool() const
+{
+	MapHackExprValue_t result;
+	Evaluate( result );
+
+	return result.IsTrue();
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackExpression::Evaluate( MapHackExprValue_t &result ) const
+{
+	if ( !IsValid() )
+	{
+		MapHack_ClearValue( result );
+		return;
+	}
+
+	EvaluateNode( m_iRoot, result );
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackExpression::EvaluateNode( const int iNode, MapHackExprValue_t &result ) const
+{
+	const MapHackExprNode_t &node = m_vecNodes[iNode];
+
+	MapHack_ClearValue( result );
+
+	switch ( node.m_Op )
+	{
+		case MAPHACK_EXPR_CONST:
+		{
+			result.m_Type = node.m_ConstType;
+			result.m_iValue = node.m_iConst;
+			result.m_flValue = node.m_flConst;
+
+			if ( node.m_ConstType == MapHackType_t::TYPE_STRING )
+				result.m_pszValue = m_StringPool.Base() + node.m_iStringOffset;
+
+			return;
+		}
+
+		case MAPHACK_EXPR_VARIABLE:
+		{
+			const MapHackVariable_t *pVar = node.m_pVar;
+			switch ( pVar->m_Type )
+			{
+				case MapHackType_t::TYPE_INT:
+					result.m_Type = MapHackType_t::TYPE_INT;
+					result.m_iValue = pVar->GetInt();
+					break;
+				case MapHackType_t::TYPE_FLOAT:
+					result.m_Type = MapHackType_t::TYPE_FLOAT;
+					result.m_flValue = pVar->GetFloat();
+					break;
+				case MapHackType_t::TYPE_STRING:
+					result.m_Type = MapHackType_t::TYPE_STRING;
+					result.m_pszValue = pVar->GetString();
+					break;
+				case MAPHACK_TYPE_VECTOR:
+					result.m_Type = MAPHACK_TYPE_VECTOR;
+					V_memcpy( result.m_vecValue, pVar->m_vecValue, sizeof( result.m_vecValue ) );
+					break;
+				default:
+					// Colors can't be compared
+					break;
+			}
+
+			return;
+		}
+
+		case MAPHACK_EXPR_COMPONENT:
+		{
+			result.m_Type = MapHackType_t::TYPE_FLOAT;
+			result.m_flValue = node.m_pVar->m_vecValue[node.m_iConst];
+			return;
+		}
+
+		case MAPHACK_EXPR_VECTOR:
+		{
+			const int children[3] = { node.m_iLeft, node.m_iRight, node.m_iThird };
+
+			for ( int i = 0; i < 3; ++i )
+			{
+				MapHackExprValue_t component;
+				EvaluateNode( children[i], component );
+
+				if ( !component.IsNumber() )
+				{
+					MapHack_ClearValue( result );
+					return;
+				}
+
+				result.m_vecValue[i] = component.AsFloat();
+			}
+
+			result.m_Type = MAPHACK_TYPE_VECTOR;
+			return;
+		}
+
+		case MAPHACK_EXPR_NOT:
+		{
+			MapHackExprValue_t operand;
+			EvaluateNode( node.m_iLeft, operand );
+
+			result.m_Type = MapHackType_t::TYPE_INT;
+			result.m_iValue = !operand.IsTrue();
+			return;
+		}
+
+		case MAPHACK_EXPR_NEGATE:
+		{
+			EvaluateNode( node.m_iLeft, result );
+
+			if ( result.m_Type == MapHackType_t::TYPE_INT )
+			{
+				result.m_iValue = -result.m_iValue;
+			}
+			else if ( result.m_Type == MapHackType_t::TYPE_FLOAT )
+			{
+				result.m_flValue = -result.m_flValue;
+			}
+			else if ( result.m_Type == MAPHACK_TYPE_VECTOR )
+			{
+				for ( int i = 0; i < 3; ++i )
+					result.m_vecValue[i] = -result.m_vecValue[i];
+			}
+			else
+			{
+				result.m_Type = MapHackType_t::TYPE_NONE;
+			}
+
+			return;
+		}
+
+		case MAPHACK_EXPR_AND:
+		case MAPHACK_EXPR_OR:
+		{
+			// Short-circuit like C does
+			MapHackExprValue_t operand;
+			EvaluateNode( node.m_iLeft, operand );
+
+			bool bValue = operand.IsTrue();
+			if ( bValue == ( node.m_Op == MAPHACK_EXPR_AND ) )
+			{
+				EvaluateNode( node.m_iRight, operand );
+				bValue = operand.IsTrue();
+			}
+
+			result.m_Type = MapHackType_t::TYPE_INT;
+			result.m_iValue = bValue;
+			return;
+		}
+
+		default:
+			break;
+	}
+
+	// Binary operators from here on
+	MapHackExprValue_t l, r;
+	EvaluateNode( node.m_iLeft, l );
+	EvaluateNode( node.m_iRight, r );
+
+	switch ( node.m_Op )
+	{
+		case MAPHACK_EXPR_EQ:
+		case MAPHACK_EXPR_NE:
+		case MAPHACK_EXPR_GE:
+		case MAPHACK_EXPR_GT:
+		case MAPHACK_EXPR_LE:
+		case MAPHACK_EXPR_LT:
+		{
+			result.m_Type = MapHackType_t::TYPE_INT;
+
+			if ( l.IsNumber() && r.IsNumber() )
+			{
+				if ( l.m_Type == MapHackType_t::TYPE_INT && r.m_Type == MapHackType_t::TYPE_INT )
+				{
+					switch ( node.m_Op )
+					{
+						case MAPHACK_EXPR_EQ: result.m_iValue = ( l.m_iValue == r.m_iValue ); break;
+						case MAPHACK_EXPR_NE: result.m_iValue = ( l.m_iValue != r.m_iValue ); break;
+						case MAPHACK_EXPR_GE: result.m_iValue = ( l.m_iValue >= r.m_iValue ); break;
+						case MAPHACK_EXPR_GT: result.m_iValue = ( l.m_iValue > r.m_iValue ); break;
+						case MAPHACK_EXPR_LE: result.m_iValue = ( l.m_iValue <= r.m_iValue ); break;
+						case MAPHACK_EXPR_LT: result.m_iValue = ( l.m_iValue < r.m_iValue ); break;
+						default:
+							break;
+					}
+				}
+				else
+				{
+					const float flL = l.AsFloat();
+					const float flR = r.AsFloat();
+
+					switch ( node.m_Op )
+					{
+						case MAPHACK_EXPR_EQ: result.m_iValue = ( flL == flR ); break;
+						case MAPHACK_EXPR_NE: result.m_iValue = ( flL != flR ); break;
+						case MAPHACK_EXPR_GE: result.m_iValue = ( flL >= flR ); break;
+						case MAPHACK_EXPR_GT: result.m_iValue = ( flL > flR ); break;
+						case MAPHACK_EXPR_LE: result.m_iValue = ( flL <= flR ); break;
+						case MAPHACK_EXPR_LT: result.m_iValue = ( flL < flR ); break;
+						default:
+							break;
+					}
+				}
+			}
+			else if ( l.IsVector() && r.IsVector() )
+			{
+				// Vectors only support equality
+				const bool bEqual = ( l.m_vecValue[0] == r.m_vecValue[0] && l.m_vecValue[1] == r.m_vecValue[1] && l.m_vecValue[2] == r.m_vecValue[2] );
+
+				if ( node.m_Op == MAPHACK_EXPR_EQ )
+					result.m_iValue = bEqual;
+				else if ( node.m_Op == MAPHACK_EXPR_NE )
+					result.m_iValue = !bEqual;
+			}
+			else if ( l.m_Type == MapHackType_t::TYPE_STRING && r.m_Type == MapHackType_t::TYPE_STRING )
+			{
+				// Strings only support equality
+				if ( node.m_Op == MAPHACK_EXPR_EQ )
+					result.m_iValue = FStrEq( l.m_pszValue, r.m_pszValue );
+				else if ( node.m_Op == MAPHACK_EXPR_NE )
+					result.m_iValue = !FStrEq( l.m_pszValue, r.m_pszValue );
+			}
+
+			return;
+		}
+
+		case MAPHACK_EXPR_ADD:
+		case MAPHACK_EXPR_SUB:
+		case MAPHACK_EXPR_MUL:
+		case MAPHACK_EXPR_DIV:
+		case MAPHACK_EXPR_MOD:
+		{
+			if ( l.IsVector() || r.IsVector() )
+			{
+				EvaluateVectorArithmetic( node.m_Op, l, r, result );
+				return;
+			}
+
+			if ( !l.IsNumber() || !r.IsNumber() )
+				return;
+
+			if ( l.m_Type == MapHackType_t::TYPE_INT && r.m_Type == MapHackType_t::TYPE_INT )
+			{
+				result.m_Type = MapHackType_t::TYPE_INT;
+
+				switch ( node.m_Op )
+				{
+					case MAPHACK_EXPR_ADD: result.m_iValue = l.m_iValue + r.m_iValue; break;
+					case MAPHACK_EXPR_SUB: result.m_iValue = l.m_iValue - r.m_iValue; break;
+					case MAPHACK_EXPR_MUL: result.m_iValue = l.m_iValue * r.m_iValue; break;
+					case MAPHACK_EXPR_DIV: result.m_iValue = ( r.m_iValue != 0 ) ? l.m_iValue / r.m_iValue : 0; break;
+					case MAPHACK_EXPR_MOD: result.m_iValue = ( r.m_iValue != 0 ) ? l.m_iValue % r.m_iValue : 0; break;
+					default:
+						break;
+				}
+			}
+			else
+			{
+				const float flL = l.AsFloat();
+				const float flR = r.AsFloat();
+
+				result.m_Type = MapHackType_t::TYPE_FLOAT;
+
+				switch ( node.m_Op )
+				{
+					case MAPHACK_EXPR_ADD: result.m_flValue = flL + flR; break;
+					case MAPHACK_EXPR_SUB: result.m_flValue = flL - flR; break;
+					case MAPHACK_EXPR_MUL: result.m_flValue = flL * flR; break;
+					case MAPHACK_EXPR_DIV: result.m_flValue = ( flR != 0.0f ) ? flL / flR : 0.0f; break;
+					case MAPHACK_EXPR_MOD: result.m_flValue = ( flR != 0.0f ) ? fmodf( flL, flR ) : 0.0f; break;
+					default:
+						break;
+				}
+			}
+
+			return;
+		}
+
+		default:
+			Assert( 0 );
+			return;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// vector +/- vector, vector * scalar, scalar * vector, vector / scalar
+//-----------------------------------------------------------------------------
+void CMapHackExpression::EvaluateVectorArithmetic( const MapHackExprOp_t op,
+	const MapHackExprValue_t &l, const MapHackExprValue_t &r, MapHackExprValue_t &result )
+{
+	MapHack_ClearValue( result );
+
+	if ( l.IsVector() && r.IsVector() )
+	{
+		if ( op != MAPHACK_EXPR_ADD && op != MAPHACK_EXPR_SUB )
+			return;
+
+		const float flSign = ( op == MAPHACK_EXPR_ADD ) ? 1.0f : -1.0f;
+		for ( int i = 0; i < 3; ++i )
+			result.m_vecValue[i] = l.m_vecValue[i] + flSign * r.m_vecValue[i];
+	}
+	else if ( l.IsVector() && r.IsNumber() )
+	{
+		const float flScale = r.AsFloat();
+		if ( op == MAPHACK_EXPR_MUL )
+		{
+			for ( int i = 0; i < 3; ++i )
+				result.m_vecValue[i] = l.m_vecValue[i] * flScale;
+		}
+		else if ( op == MAPHACK_EXPR_DIV && flScale != 0.0f )
+		{
+			for ( int i = 0; i < 3; ++i )
+				result.m_vecValue[i] = l.m_vecValue[i] / flScale;
+		}
+		else
+		{
+			return;
+		}
+	}
+	else if ( l.IsNumber() && r.IsVector() && op == MAPHACK_EXPR_MUL )
+	{
+		const float flScale = l.AsFloat();
+		for ( int i = 0; i < 3; ++i )
+			result.m_vecValue[i] = r.m_vecValue[i] * flScale;
+	}
+	else
+	{
+		return;
+	}
+
+	result.m_Type = MAPHACK_TYPE_VECTOR;
+}
+
+//-----------------------------------------------------------------------------
+int CMapHackExpression::ParseOr()
+{
+	int iLeft = ParseAnd();
+	while ( !m_bError && Match( "||" ) )
+	{
+		const int iRight = ParseAnd();
+		iLeft = AddNode( MAPHACK_EXPR_OR, iLeft, iRight );
+	}
+
+	return iLeft;
+}
+
+//-----------------------------------------------------------------------------
+int CMapHackExpression::ParseAnd()
+{
+	int iLeft = ParseEquality();
+	while ( !m_bError && Match( "&&" ) )
+	{
+		const int iRight = ParseEquality();
+		iLeft = AddNode( MAPHACK_EXPR_AND, iLeft, iRight );
+	}
+
+	return iLeft;
+}
+
+//-----------------------------------------------------------------------------
+int CMapHackExpression::ParseEquality()
+{
+	int iLeft = ParseRelational();
+	while ( !m_bError )
+	{
+		MapHackExprOp_t op;
+		if ( Match( "==" ) )
+			op = MAPHACK_EXPR_EQ;
+		else if ( Match( "!=" ) )
+			op = MAPHACK_EXPR_NE;
+		else
+			break;
+
+		const int iRight = ParseRelational();
+		iLeft = AddNode( op, iLeft, iRight );
+	}
+
+	return iLeft;
+}
+
+//-----------------------------------------------------------------------------
+int CMapHackExpression::ParseRelational()
+{
+	int iLeft = ParseAdditive();
+	while ( !m_bError )
+	{
+		// Longer tokens first
+		MapHackExprOp_t op;
+		if ( Match( ">=" ) )
+			op = MAPHACK_EXPR_GE;
+		else if ( Match( "<=" ) )
+			op = MAPHACK_EXPR_LE;
+		else if ( Match( ">" ) )
+			op = MAPHACK_EXPR_GT;
+		else if ( Match( "<" ) )
+			op = MAPHACK_EXPR_LT;
+		else
+			break;
+
+		const int iRight = ParseAdditive();
+		iLeft = AddNode( op, iLeft, iRight );
+	}
+
+	return iLeft;
+}
+
+//-----------------------------------------------------------------------------
+int CMapHackExpression::ParseAdditive()
+{
+	int iLeft = ParseTerm();
+	while ( !m_bError )
+	{
+		MapHackExprOp_t op;
+		if ( Match( "+" ) )
+			op = MAPHACK_EXPR_ADD;
+		else if ( Match( "-" ) )
+			op = MAPHACK_EXPR_SUB;
+		else
+			break;
+
+		const int iRight = ParseTerm();
+		iLeft = AddNode( op, iLeft, iRight );
+	}
+
+	return iLeft;
+}
+
+//-----------------------------------------------------------------------------
+int CMapHackExpression::ParseTerm()
+{
+	int iLeft = ParseUnary();
+	while ( !m_bError )
+	{
+		MapHackExprOp_t op;
+		if ( Match( "*" ) )
+			op = MAPHACK_EXPR_MUL;
+		else if ( Match( "/" ) )
+			op = MAPHACK_EXPR_DIV;
+		else if ( Match( "%" ) )
+			op = MAPHACK_EXPR_MOD;
+		else
+			break;
+
+		const int iRight = ParseUnary();
+		iLeft = AddNode( op, iLeft, iRight );
+	}
+
+	return iLeft;
+}
+
+//-----------------------------------------------------------------------------
+int CMapHackExpression::ParseUnary()
+{
+	SkipWhitespace();
+
+	// Don't eat the first half of "!="
+	if ( m_pszCursor[0] == '!' && m_pszCursor[1] != '=' )
+	{
+		++m_pszCursor;
+		return AddNode( MAPHACK_EXPR_NOT, ParseUnary() );
+	}
+
+	if ( Match( "-" ) )
+		return AddNode( MAPHACK_EXPR_NEGATE, ParseUnary() );
+
+	if ( Match( "+" ) )
+		return ParseUnary();
+
+	return ParsePrimary();
+}
+
+//-----------------------------------------------------------------------------
+int CMapHackExpression::ParsePrimary()
+{
+	if ( m_bError )
+		return -1;
+
+	SkipWhitespace();
+
+	const char *psz = m_pszCursor;
+
+	// Parentheses
+	if ( *psz == '(' )
+	{
+		++m_pszCursor;
+		const int iInner = ParseOr();
+		if ( !Match( ")" ) )
+		{
+			Error( "missing ')'" );
+			return -1;
+		}
+
+		return iInner;
+	}
+
+	// Quoted string
+	if ( *psz == '\'' || *psz == '"' )
+	{
+		const char chQuote = *psz++;
+		const char *pszStart = psz;
+		while ( *psz != '\0' && *psz != chQuote )
+			++psz;
+
+		if ( *psz != chQuote )
+		{
+			Error( "unterminated string" );
+			return -1;
+		}
+
+		const int iNode = AddNode( MAPHACK_EXPR_CONST );
+		m_vecNodes[iNode].m_ConstType = MapHackType_t::TYPE_STRING;
+		m_vecNodes[iNode].m_iStringOffset = AddString( pszStart, (int)( psz - pszStart ) );
+
+		m_pszCursor = psz + 1;
+		return iNode;
+	}
+
+	// Numbers
+	if ( isdigit( (unsigned char)psz[0] ) || ( psz[0] == '.' && isdigit( (unsigned char)psz[1] ) ) )
+	{
+		char *pIEnd;
+		char *pFEnd;
+		const long iVal = strtol( psz, &pIEnd, 10 );
+		const double flVal = strtod( psz, &pFEnd );
+
+#ifdef POSIX
+		// No hex floats, same as KeyValues
+		if ( tolower( psz[1] ) == 'x' )
+			pFEnd = (char *)psz;
+#endif
+
+		const int iNode = AddNode( MAPHACK_EXPR_CONST );
+		MapHackExprNode_t &node = m_vecNodes[iNode];
+
+		if ( pFEnd > pIEnd )
+		{
+			node.m_ConstType = MapHackType_t::TYPE_FLOAT;
+			node.m_flConst = (float)flVal;
+			m_pszCursor = pFEnd;
+		}
+		else
+		{
+			node.m_ConstType = MapHackType_t::TYPE_INT;
+			node.m_iConst = (int)iVal;
+			m_pszCursor = pIEnd;
+		}
+
+		// "1abc" isn't a number or a name
+		if ( MapHack_IsIdentChar( *m_pszCursor ) )
+		{
+			Error( "malformed number" );
+			return -1;
+		}
+
+		return iNode;
+	}
+
+	// Variables, or a bare word if there is no such variable
+	// '%' is optional here, conditions can name variables directly
+	if ( *psz == '%' )
+		++psz;
+
+	const char *pszStart = psz;
+	while ( MapHack_IsIdentChar( *psz ) )
+		++psz;
+
+	const int len = (int)( psz - pszStart );
+	if ( len <= 0 )
+	{
+		Error( ( *psz == '\0' ) ? "unexpected end of expression" : "unexpected character" );
+		return -1;
+	}
+
+	m_pszCursor = psz;
+
+	char szName[MAPHACK_EXPR_MAX_TOKEN];
+	V_strncpy( szName, pszStart, Min( len + 1, (int)sizeof( szName ) ) );
+
+	// Builtin function call?
+	SkipWhitespace();
+	if ( *m_pszCursor == '(' )
+	{
+		++m_pszCursor;
+		return ParseFunction( szName );
+	}
+
+	const MapHackVariable_t *pVar = m_fnLookup ? m_fnLookup( szName ) : NULL;
+	if ( pVar )
+	{
+		const int iNode = AddNode( MAPHACK_EXPR_VARIABLE );
+		m_vecNodes[iNode].m_pVar = pVar;
+		return iNode;
+	}
+
+	// Vector components, e.g. "vecPos.z"
+	if ( len > 2 && szName[len - 2] == '.' && len < (int)sizeof( szName ) )
+	{
+		const char chComponent = (char)tolower( szName[len - 1] );
+		if ( chComponent == 'x' || chComponent == 'y' || chComponent == 'z' )
+		{
+			szName[len - 2] = '\0';
+			pVar = m_fnLookup ? m_fnLookup( szName ) : NULL;
+
+			if ( pVar && pVar->m_Type == MAPHACK_TYPE_VECTOR )
+			{
+				const int iNode = AddNode( MAPHACK_EXPR_COMPONENT );
+				m_vecNodes[iNode].m_pVar = pVar;
+				m_vecNodes[iNode].m_iConst = chComponent - 'x';
+				return iNode;
+			}
+		}
+	}
+
+	const int iNode = AddNode( MAPHACK_EXPR_CONST );
+	m_vecNodes[iNode].m_ConstType = MapHackType_t::TYPE_STRING;
+	m_vecNodes[iNode].m_iStringOffset = AddString( pszStart, len );
+
+	return iNode;
+}
+
+//-----------------------------------------------------------------------------
+// Cursor is past the opening parenthesis
+//-----------------------------------------------------------------------------
+int CMapHackExpression::ParseFunction( const char *pszName )
+{
+	if ( !V_stricmp( pszName, "vec" ) )
+	{
+		int args[3];
+		for ( int i = 0; i < 3; ++i )
+		{
+			if ( i > 0 && !Match( "," ) )
+			{
+				Error( "vec() takes three arguments" );
+				return -1;
+			}
+
+			args[i] = ParseOr();
+			if ( m_bError )
+				return -1;
+		}
+
+		if ( !Match( ")" ) )
+		{
+			Error( "missing ')'" );
+			return -1;
+		}
+
+		return AddNode( MAPHACK_EXPR_VECTOR, args[0], args[1], args[2] );
+	}
+
+	Error( "unknown function" );
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+int CMapHackExpression::AddNode( const MapHackExprOp_t op, const int iLeft, const int iRight, const int iThird )
+{
+	if ( m_bError )
+		return -1;
+
+	// Children failed to parse
+	if ( op > MAPHACK_EXPR_COMPONENT && iLeft == -1 )
+		return -1;
+
+	if ( op >= MAPHACK_EXPR_AND && iRight == -1 )
+		return -1;
+
+	if ( op == MAPHACK_EXPR_VECTOR && iThird == -1 )
+		return -1;
+
+	const int idx = m_vecNodes.AddToTail();
+
+	MapHackExprNode_t &node = m_vecNodes[idx];
+	node.m_Op = op;
+	node.m_iLeft = iLeft;
+	node.m_iRight = iRight;
+	node.m_iThird = iThird;
+	node.m_ConstType = MapHackType_t::TYPE_NONE;
+	node.m_iConst = 0;
+	node.m_flConst = 0.0f;
+	node.m_iStringOffset = 0;
+	node.m_pVar = NULL;
+
+	return idx;
+}
+
+//-----------------------------------------------------------------------------
+int CMapHackExpression::AddString( const char *psz, const int len )
+{
+	const int offset = m_StringPool.Count();
+
+	m_StringPool.AddMultipleToTail( len, psz );
+	m_StringPool.AddToTail( '\0' );
+
+	return offset;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackExpression::SkipWhitespace()
+{
+	while ( *m_pszCursor != '\0' && isspace( (unsigned char)*m_pszCursor ) )
+		++m_pszCursor;
+}
+
+//-----------------------------------------------------------------------------
+bool CMapHackExpression::Match( const char *pszToken )
+{
+	SkipWhitespace();
+
+	const int len = V_strlen( pszToken );
+	if ( V_strncmp( m_pszCursor, pszToken, len ) != 0 )
+		return false;
+
+	// Single character tokens must not be the start of a longer operator, e.g. "<" vs "<="
+	if ( len == 1 && m_pszCursor[1] == '=' && ( *pszToken == '<' || *pszToken == '>' || *pszToken == '!' ) )
+		return false;
+
+	m_pszCursor += len;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+bool CMapHackExpression::Error( const char *pszMsg )
+{
+	if ( !m_bError )
+	{
+		Warning( "MapHack WARNING: Bad expression \"%s\", %s at column %d!\n",
+			m_pszSource, pszMsg, (int)( m_pszCursor - m_pszSource ) + 1 );
+	}
+
+	m_bError = true;
+	return false;
+}
@@ -0,0 +1,145 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Compiled MapHack expressions. Conditions and assignments are
+//			parsed once into a flat node tree and evaluated without touching
+//			the heap.
+//
+//=============================================================================//
+
+#ifndef MAPHACK_EXPRESSION_H
+#define MAPHACK_EXPRESSION_H
+
+#include "tier1/utlvector.h"
+
+struct MapHackVariable_t;
+typedef KeyValues::types_t MapHackType_t;
+
+//-----------------------------------------------------------------------------
+// Resolves a variable name at compile time, NULL if there is no such variable
+//-----------------------------------------------------------------------------
+typedef const MapHackVariable_t *( *FnMapHackVariableLookup_t )( const char *pszName );
+
+//-----------------------------------------------------------------------------
+enum MapHackExprOp_t
+{
+	MAPHACK_EXPR_INVALID = -1,
+
+	// Leaves
+	MAPHACK_EXPR_CONST,
+	MAPHACK_EXPR_VARIABLE,
+	MAPHACK_EXPR_COMPONENT,
+
+	// Unary
+	MAPHACK_EXPR_NOT,
+	MAPHACK_EXPR_NEGATE,
+
+	// Logical
+	MAPHACK_EXPR_AND,
+	MAPHACK_EXPR_OR,
+
+	// Comparison
+	MAPHACK_EXPR_EQ,
+	MAPHACK_EXPR_NE,
+	MAPHACK_EXPR_GE,
+	MAPHACK_EXPR_GT,
+	MAPHACK_EXPR_LE,
+	MAPHACK_EXPR_LT,
+
+	// Arithmetic
+	MAPHACK_EXPR_ADD,
+	MAPHACK_EXPR_SUB,
+	MAPHACK_EXPR_MUL,
+	MAPHACK_EXPR_DIV,
+	MAPHACK_EXPR_MOD,
+
+	// Builtins
+	MAPHACK_EXPR_VECTOR,
+};
+
+//-----------------------------------------------------------------------------
+// Result of an evaluated node, TYPE_NONE means the result is unusable
+//-----------------------------------------------------------------------------
+struct MapHackExprValue_t
+{
+	MapHackType_t m_Type;
+
+	int m_iValue;
+	float m_flValue;
+	const char *m_pszValue;
+	float m_vecValue[3];
+
+	bool IsNumber() const { return ( m_Type == MapHackType_t::TYPE_INT || m_Type == MapHackType_t::TYPE_FLOAT ); }
+	bool IsVector() const;
+	float AsFloat() const { return ( m_Type == MapHackType_t::TYPE_FLOAT ) ? m_flValue : (float)m_iValue; }
+	bool IsTrue() const;
+};
+
+//-----------------------------------------------------------------------------
+struct MapHackExprNode_t
+{
+	MapHackExprOp_t m_Op;
+
+	// Child node indices
+	int m_iLeft;
+	int m_iRight;
+	int m_iThird;
+
+	// MAPHACK_EXPR_CONST
+	MapHackType_t m_ConstType;
+	int m_iConst;
+	float m_flConst;
+	int m_iStringOffset; // Offset into the string pool
+
+	// MAPHACK_EXPR_VARIABLE, MAPHACK_EXPR_COMPONENT (m_iConst is the component)
+	const MapHackVariable_t *m_pVar;
+};
+
+//-----------------------------------------------------------------------------
+class CMapHackExpression
+{
+public:
+	CMapHackExpression();
+
+	// Parse the string, returns false (and warns) on syntax errors
+	bool Compile( const char *pszExpression, FnMapHackVariableLookup_t fnLookup );
+
+	bool IsValid() const { return m_iRoot != -1; }
+
+	bool EvaluateBool() const;
+	void Evaluate( MapHackExprValue_t &result ) const;
+
+private:
+	void EvaluateNode( int iNode, MapHackExprValue_t &result ) const;
+	static void EvaluateVectorArithmetic( MapHackExprOp_t op,
+		const MapHackExprValue_t &l, const MapHackExprValue_t &r, MapHackExprValue_t &result );
+
+	// Recursive descent, lowest precedence first
+	int ParseOr();
+	int ParseAnd();
+	int ParseEquality();
+	int ParseRelational();
+	int ParseAdditive();
+	int ParseTerm();
+	int ParseUnary();
+	int ParsePrimary();
+	int ParseFunction( const char *pszName );
+
+	int AddNode( MapHackExprOp_t op, int iLeft = -1, int iRight = -1, int iThird = -1 );
+	int AddString( const char *psz, int len );
+
+	void SkipWhitespace();
+	bool Match( const char *pszToken );
+	bool Error( const char *pszMsg );
+
+	CUtlVector<MapHackExprNode_t> m_vecNodes;
+	CUtlVector<char> m_StringPool;
+	int m_iRoot;
+
+	// Only valid while compiling
+	const char *m_pszSource;
+	const char *m_pszCursor;
+	FnMapHackVariableLookup_t m_fnLookup;
+	bool m_bError;
+};
+
+#endif
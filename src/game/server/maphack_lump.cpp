@@ -0,0 +1,157 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Precomputed entity lumps. maphack_patch runs the pre_entities
+//			transform of static maphacks ahead of time, and the level load
+//			uses the patched lump instead of running it again.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "maphack_manager.h"
+#include "maphack_lump.h"
+#include "maphack_parser.h"
+#include "filesystem.h"
+#include "bspfile.h"
+#include "checksum_crc.h"
+#include "tier1/lzmaDecoder.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+//-----------------------------------------------------------------------------
+unsigned int MapHack_GetEntityLumpCRC( const char *pszEntData )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	CRC32_ProcessBuffer( &crc, pszEntData, V_strlen( pszEntData ) );
+	CRC32_Final( &crc );
+	return crc;
+}
+
+//-----------------------------------------------------------------------------
+// Only the header and the lump are read, not the whole map
+//-----------------------------------------------------------------------------
+bool MapHack_ReadBSPEntityLump( const char *pszBSPFilename, CUtlBuffer &buf )
+{
+	FileHandle_t hFile = filesystem->Open( pszBSPFilename, "rb", "GAME" );
+	if ( !hFile )
+		return false;
+
+	dheader_t header;
+	bool bSuccess = ( filesystem->Read( &header, sizeof( header ), hFile ) == sizeof( header ) );
+	if ( bSuccess )
+		bSuccess = ( header.ident == IDBSPHEADER && header.version >= MINBSPVERSION && header.version <= BSPVERSION );
+
+	const lump_t &lump = header.lumps[LUMP_ENTITIES];
+	if ( bSuccess )
+		bSuccess = ( lump.fileofs > 0 && lump.filelen > 0 && lump.fileofs + lump.filelen <= (int)filesystem->Size( hFile ) );
+
+	CUtlBuffer lumpData;
+	if ( bSuccess )
+	{
+		lumpData.EnsureCapacity( lump.filelen );
+		filesystem->Seek( hFile, lump.fileofs, FILESYSTEM_SEEK_HEAD );
+		bSuccess = ( filesystem->Read( lumpData.Base(), lump.filelen, hFile ) == lump.filelen );
+	}
+
+	filesystem->Close( hFile );
+
+	if ( !bSuccess )
+		return false;
+
+	unsigned char *pData = (unsigned char *)lumpData.Base();
+	int size = lump.filelen;
+
+	// Console builds compress their lumps
+	CUtlBuffer uncompressed;
+	if ( CLZMA::IsCompressed( pData ) )
+	{
+		size = CLZMA::GetActualSize( pData );
+		uncompressed.EnsureCapacity( size );
+		if ( CLZMA::Uncompress( pData, (unsigned char *)uncompressed.Base() ) != (unsigned int)size )
+			return false;
+
+		pData = (unsigned char *)uncompressed.Base();
+	}
+
+	// The lump usually carries its own NUL, the CRC only covers the text
+	const unsigned char *pEnd = (const unsigned char *)memchr( pData, '\0', size );
+	const int length = pEnd ? ( pEnd - pData ) : size;
+
+	buf.Purge();
+	buf.EnsureCapacity( length + 1 );
+	buf.Put( pData, length );
+	buf.PutChar( '\0' );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+void MapHack_BuildLumpFile( CUtlBuffer &buf, const char *pszEntData, unsigned int lumpCRC, unsigned int mapHackHash )
+{
+	MapHackLumpHeader_t header;
+	V_memset( &header, 0, sizeof( header ) );
+	header.m_nMagic = MAPHACK_LUMP_MAGIC;
+	header.m_nVersion = MAPHACK_LUMP_VERSION;
+	header.m_nSourceLumpCRC = lumpCRC;
+	header.m_nMapHackHash = mapHackHash;
+	header.m_iDataSize = V_strlen( pszEntData );
+
+	buf.Purge();
+	buf.EnsureCapacity( sizeof( header ) + header.m_iDataSize + 1 );
+	buf.Put( &header, sizeof( header ) );
+	buf.Put( pszEntData, header.m_iDataSize + 1 );
+}
+
+//-----------------------------------------------------------------------------
+bool MapHack_WriteLumpFile( const char *pszLumpFilename, const char *pszEntData, unsigned int lumpCRC, unsigned int mapHackHash )
+{
+	CUtlBuffer buf;
+	MapHack_BuildLumpFile( buf, pszEntData, lumpCRC, mapHackHash );
+	return filesystem->WriteFile( pszLumpFilename, "MOD", buf );
+}
+
+//-----------------------------------------------------------------------------
+char *MapHack_LoadLumpFile( const char *pszLumpFilename, unsigned int lumpCRC, unsigned int mapHackHash )
+{
+	if ( !filesystem->FileExists( pszLumpFilename ) )
+		return NULL;
+
+	CMapHackFileView file;
+	if ( !file.Open( pszLumpFilename ) )
+		return NULL;
+
+	return MapHack_ReadLumpFile( file, pszLumpFilename, lumpCRC, mapHackHash );
+}
+
+//-----------------------------------------------------------------------------
+char *MapHack_ReadLumpFile( const CMapHackFileView &file, const char *pszName, unsigned int lumpCRC, unsigned int mapHackHash )
+{
+	if ( file.Size() < (int)sizeof( MapHackLumpHeader_t ) )
+		return NULL;
+
+	const MapHackLumpHeader_t *pHeader = (const MapHackLumpHeader_t *)file.Base();
+	if ( pHeader->m_nMagic != MAPHACK_LUMP_MAGIC || pHeader->m_nVersion != MAPHACK_LUMP_VERSION )
+	{
+		Warning( "MapHack WARNING: \"%s\" is not a patched entity lump of this version, run maphack_patch again!\n", pszName );
+		return NULL;
+	}
+
+	// Map or maphack changed since it was patched
+	if ( pHeader->m_nSourceLumpCRC != lumpCRC || pHeader->m_nMapHackHash != mapHackHash )
+	{
+		MapHack_DebugMsg( "\"%s\" is out of date, running pre_entities\n", pszName );
+		return NULL;
+	}
+
+	const char *pszEntData = file.Base() + sizeof( MapHackLumpHeader_t );
+	if ( pHeader->m_iDataSize < 0 || pHeader->m_iDataSize >= file.Size() - (int)sizeof( MapHackLumpHeader_t )
+		|| pszEntData[pHeader->m_iDataSize] != '\0' )
+	{
+		Warning( "MapHack WARNING: \"%s\" is corrupt, running pre_entities!\n", pszName );
+		return NULL;
+	}
+
+	char *pszCopy = new char[pHeader->m_iDataSize + 1];
+	V_memcpy( pszCopy, pszEntData, pHeader->m_iDataSize + 1 );
+	return pszCopy;
+}
@@ -0,0 +1,49 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Precomputed entity lumps. maphack_patch runs the pre_entities
+//			transform of static maphacks ahead of time, and the level load
+//			uses the patched lump instead of running it again.
+//
+//=============================================================================//
+
+#ifndef MAPHACK_LUMP_H
+#define MAPHACK_LUMP_H
+
+#include "tier1/utlbuffer.h"
+
+class CMapHackFileView;
+
+//-----------------------------------------------------------------------------
+#define MAPHACK_LUMP_MAGIC ( ( 'M' << 0 ) | ( 'H' << 8 ) | ( 'L' << 16 ) | ( '1' << 24 ) )
+#define MAPHACK_LUMP_VERSION 1
+#define MAPHACK_LUMP_EXTENSION ".mhl"
+
+//-----------------------------------------------------------------------------
+// Followed by the patched entity lump
+//-----------------------------------------------------------------------------
+struct MapHackLumpHeader_t
+{
+	unsigned int m_nMagic;
+	unsigned int m_nVersion;
+
+	// What the transform ran on, anything else makes the file stale
+	unsigned int m_nSourceLumpCRC;
+	unsigned int m_nMapHackHash;
+
+	int m_iDataSize; // Without the NUL
+};
+
+//-----------------------------------------------------------------------------
+unsigned int MapHack_GetEntityLumpCRC( const char *pszEntData );
+
+// Entity lump of a .bsp as a NUL terminated string. Safe to call from worker threads.
+bool MapHack_ReadBSPEntityLump( const char *pszBSPFilename, CUtlBuffer &buf );
+
+void MapHack_BuildLumpFile( CUtlBuffer &buf, const char *pszEntData, unsigned int lumpCRC, unsigned int mapHackHash );
+bool MapHack_WriteLumpFile( const char *pszLumpFilename, const char *pszEntData, unsigned int lumpCRC, unsigned int mapHackHash );
+
+// new[]'d copy of the patched lump, NULL if there is none or it doesn't match
+char *MapHack_LoadLumpFile( const char *pszLumpFilename, unsigned int lumpCRC, unsigned int mapHackHash );
+char *MapHack_ReadLumpFile( const CMapHackFileView &file, const char *pszName, unsigned int lumpCRC, unsigned int mapHackHash );
+
+#endif
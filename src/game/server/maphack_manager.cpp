@@ -11,15 +11,38 @@
 
 #include "cbase.h"
 #include "maphack_manager.h"
+#include "maphack_expression.h"
+#include "maphack_template.h"
+#include "maphack_reflection.h"
+#include "maphack_parser.h"
+#include "maphack_compiled.h"
+#include "maphack_lump.h"
+#include "maphack_shared.h"
+#include "maphack_entindex.h"
 #include "filesystem.h"
 #include "engine/IEngineSound.h"
 #include "tier1/utlbuffer.h"
 #include "mapentities.h"
+#include "networkstringtabledefs.h"
+#include "SoundEmitterSystem/isoundemittersystembase.h"
+#include "soundchars.h"
+#include "tier1/fmtstr.h"
+#include "multiplay_gamerules.h"
+#include "vstdlib/jobthread.h"
+#include "checksum_crc.h"
 #include "vprof.h"
 
+#ifdef LINUX
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
+extern INetworkStringTableContainer *networkstringtable;
+extern ISoundEmitterSystemBase *soundemitterbase;
+
 //-----------------------------------------------------------------------------
 static CMapHackManager s_MapHackManager;
 CMapHackManager *const g_pMapHackManager = &s_MapHackManager;
@@ -32,9 +55,6 @@ CMapHackManager *const g_pMapHackManager = &s_MapHackManager;
 #define CON_COLOR_MAPHACK Color( 166, 84, 184, 255 )
 #endif
 
-//-----------------------------------------------------------------------------
-static int g_iMapHackEntitiesRecursionLevel = 0;
-
 //-----------------------------------------------------------------------------
 static CUtlVector<MapHackOutputCallback_t> g_vecOutputCallbacks;
 
@@ -79,6 +99,46 @@ CON_COMMAND( maphack_include, "Include file by name into existing maphack." )
 	GetMapHackManager()->LoadMapHackFromFile( args[1], loadFlags );
 }
 
+//-----------------------------------------------------------------------------
+// The map the server changes to next, as far as the game rules know
+//-----------------------------------------------------------------------------
+static bool MapHack_GetNextMapName( char *pszOut, int outSize )
+{
+	pszOut[0] = '\0';
+
+	static ConVarRef nextlevel( "nextlevel" );
+	if ( nextlevel.IsValid() && nextlevel.GetString()[0] != '\0' )
+	{
+		V_strncpy( pszOut, nextlevel.GetString(), outSize );
+		return true;
+	}
+
+	if ( g_pGameRules && g_pGameRules->IsMultiplayer() )
+		static_cast<CMultiplayRules *>( g_pGameRules )->GetNextLevelName( pszOut, outSize );
+
+	return ( pszOut[0] != '\0' );
+}
+
+//-----------------------------------------------------------------------------
+CON_COMMAND( maphack_preload, "Parse the maphack of a map in the background, so the level load can use it as is. Defaults to the next map in the cycle." )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	char szMapName[MAX_MAP_NAME];
+	if ( args.ArgC() >= 2 )
+	{
+		V_strcpy_safe( szMapName, args[1] );
+	}
+	else if ( !MapHack_GetNextMapName( szMapName, sizeof( szMapName ) ) )
+	{
+		Msg( "Usage: maphack_preload <map name>\n" );
+		return;
+	}
+
+	GetMapHackManager()->PreloadMapHack( szMapName );
+}
+
 //-----------------------------------------------------------------------------
 CON_COMMAND( maphack_reload, "Reload current maphack." )
 {
@@ -88,6 +148,15 @@ CON_COMMAND( maphack_reload, "Reload current maphack." )
 	GetMapHackManager()->ReloadMapHack();
 }
 
+//-----------------------------------------------------------------------------
+CON_COMMAND( maphack_hotreload, "Apply changes of the maphack file and its includes to the running maphack, only what changed is registered or run again." )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	GetMapHackManager()->HotReloadMapHack();
+}
+
 //-----------------------------------------------------------------------------
 CON_COMMAND( maphack_trigger, "Trigger a MapHack event." )
 {
@@ -112,6 +181,90 @@ CON_COMMAND( maphack_dump_vars, "Dump MapHack variables to console." )
 	GetMapHackManager()->DumpVariablesToConsole();
 }
 
+//-----------------------------------------------------------------------------
+CON_COMMAND( maphack_stats, "Print MapHack runtime statistics." )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	GetMapHackManager()->DumpStatsToConsole();
+}
+
+//-----------------------------------------------------------------------------
+CON_COMMAND( maphack_compile, "Write precompiled .mhc files for a maphack and its includes. Usage: maphack_compile [file], defaults to the current maphack." )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	const char *pszFileName = ( args.ArgC() >= 2 ) ? args[1] : GetMapHackManager()->GetFileName();
+	if ( pszFileName[0] == '\0' )
+	{
+		Msg( "Usage: maphack_compile <file>\n" );
+		return;
+	}
+
+	GetMapHackManager()->CompileMapHack( pszFileName );
+}
+
+//-----------------------------------------------------------------------------
+CON_COMMAND( maphack_patch, "Run the pre_entities of every map in a directory ahead of time, level loads then use the patched entity lumps. Usage: maphack_patch [directory], defaults to maps." )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	GetMapHackManager()->PatchMaps( ( args.ArgC() >= 2 ) ? args[1] : "maps" );
+}
+
+//-----------------------------------------------------------------------------
+CON_COMMAND( maphack_bench_parse, "Time the MapHack parser against KeyValues. Usage: maphack_bench_parse [file] [iterations], defaults to the current maphack." )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	const char *pszFileName = ( args.ArgC() >= 2 ) ? args[1] : GetMapHackManager()->GetFileName();
+	if ( pszFileName[0] == '\0' )
+	{
+		Msg( "Usage: maphack_bench_parse <file> [iterations]\n" );
+		return;
+	}
+
+	const int iterations = ( args.ArgC() >= 3 ) ? Max( 1, V_atoi( args[2] ) ) : 20;
+
+	// What loading used to do, parse and copy
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < iterations; ++i )
+	{
+		KeyValues *pKV = new KeyValues( "maphack" );
+		pKV->UsesEscapeSequences( true );
+
+		if ( !pKV->LoadFromFile( filesystem, pszFileName ) )
+		{
+			Warning( "MapHack WARNING: Can't read \"%s\"!\n", pszFileName );
+			pKV->deleteThis();
+			return;
+		}
+
+		pKV->MakeCopy()->deleteThis();
+		pKV->deleteThis();
+	}
+
+	const double flKeyValuesTime = ( Plat_FloatTime() - flStart ) * 1000.0 / iterations;
+
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < iterations; ++i )
+	{
+		KeyValues *pKV = MapHack_ParseFile( pszFileName, true );
+		if ( pKV )
+			pKV->deleteThis();
+	}
+
+	const double flParserTime = ( Plat_FloatTime() - flStart ) * 1000.0 / iterations;
+
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "MapHack: Parsed \"%s\" %d times\n", pszFileName, iterations );
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "    KeyValues and copy: %.3f ms\n", flKeyValuesTime );
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "    MapHack parser: %.3f ms (%.1fx)\n", flParserTime, flParserTime > 0.0 ? flKeyValuesTime / flParserTime : 0.0 );
+}
+
 //-----------------------------------------------------------------------------
 void Fn_SV_MapHackChanged( IConVar *pConVar, const char *pszOldValue, float flOldValue );
 ConVar sv_maphack( "sv_maphack", "1", FCVAR_NOTIFY | FCVAR_REPLICATED, "Enable MapHack system. Maphacks are text files for adding and modifying entities in the map.", Fn_SV_MapHackChanged );
@@ -119,6 +272,23 @@ ConVar sv_maphack_filename( "sv_maphack_filename", "", FCVAR_NOTIFY | FCVAR_REPL
 ConVar sv_maphack_directory( "sv_maphack_directory", "maps/maphacks", FCVAR_REPLICATED, "The game will search this directory for [mapname].txt files." );
 ConVar sv_maphack_allow_servercommand( "sv_maphack_allow_servercommand", "0", FCVAR_REPLICATED, "Allow $console function to execute server commands." );
 ConVar sv_maphack_debug( "sv_maphack_debug", "0", FCVAR_GAMEDLL, "Print MapHack behavior to the server console." );
+ConVar sv_maphack_exec_budget_ms( "sv_maphack_exec_budget_ms", "2", FCVAR_GAMEDLL, "Milliseconds per tick MapHack events may run before the rest is continued on the next tick, 0 for unlimited." );
+ConVar sv_maphack_spawn_queue( "sv_maphack_spawn_queue", "0", FCVAR_GAMEDLL, "Spawn runtime MapHack entities through the spawn queue, blocks can opt in with \"spawn_queue\" \"1\"." );
+ConVar sv_maphack_spawn_budget( "sv_maphack_spawn_budget", "8", FCVAR_GAMEDLL, "Max queued MapHack entities spawned per tick.", true, 1, false, 0 );
+ConVar sv_maphack_exec_budget_instructions( "sv_maphack_exec_budget_instructions", "0", FCVAR_GAMEDLL, "Entities and function keys per tick MapHack events may run before the rest is continued on the next tick, 0 for unlimited." );
+ConVar sv_maphack_precache_warmup( "sv_maphack_precache_warmup", "1", FCVAR_GAMEDLL, "Read the files behind MapHack precaches in the background before they are precached, so cold disk caches don't stall the level load." );
+ConVar sv_maphack_preload_next( "sv_maphack_preload_next", "0", FCVAR_GAMEDLL, "Preload the maphack of the next map in the cycle once the current map has loaded." );
+ConVar sv_maphack_parallel_includes( "sv_maphack_parallel_includes", "1", FCVAR_GAMEDLL, "Parse MapHack include files concurrently on the thread pool." );
+ConVar sv_maphack_hotreload( "sv_maphack_hotreload", "0", FCVAR_GAMEDLL, "Watch the maphack file and its includes, and apply saved changes to the running maphack (see maphack_hotreload)." );
+ConVar sv_maphack_hotreload_interval( "sv_maphack_hotreload_interval", "0.5", FCVAR_GAMEDLL, "Seconds between checks for changed MapHack files.", true, 0.0f, false, 0.0f );
+ConVar sv_maphack_patched_lumps( "sv_maphack_patched_lumps", "1", FCVAR_GAMEDLL, "Use entity lumps precomputed by maphack_patch in place of running pre_entities on level load." );
+ConVar sv_maphack_shared_cache( "sv_maphack_shared_cache", "", FCVAR_GAMEDLL, "Disk cache directory for compiled maphacks and patched entity lumps, servers on this machine can point at the same one, e.g. /dev/shm/maphack. Entries are read into each process, no memory is shared. Empty disables the cache." );
+ConVar sv_maphack_shared_cache_max_mb( "sv_maphack_shared_cache_max_mb", "256", FCVAR_GAMEDLL, "Megabytes the disk cache directory may hold, the oldest entries are removed past it. 0 is no limit.", true, 0, false, 0 );
+ConVar sv_maphack_fast_restart( "sv_maphack_fast_restart", "1", FCVAR_GAMEDLL, "Round restarts put back the maphack state of the last reload instead of registering everything again." );
+ConVar sv_maphack_respawn_cache( "sv_maphack_respawn_cache", "0", FCVAR_GAMEDLL, "Keep the parsed keys of map entities that $respawn more than this many times, 0 disables. Cached keys go straight to KeyValue(), entities that override ParseMapData() should keep this off." );
+ConVar sv_maphack_compress_entities( "sv_maphack_compress_entities", "0", FCVAR_GAMEDLL, "Keep the hacked entities compressed in memory once the level has spawned, round restarts and $respawn decompress one chunk at a time." );
+ConVar sv_maphack_compress_entities_chunk( "sv_maphack_compress_entities_chunk", "64", FCVAR_GAMEDLL, "Kilobytes of hacked entities per compressed chunk, chunks end on entity boundaries.", true, 1, false, 0 );
+ConVar sv_maphack_compiled( "sv_maphack_compiled", "1", FCVAR_GAMEDLL, "Load up to date precompiled .mhc maphacks (see maphack_compile) in place of the text files they were compiled from." );
 
 //-----------------------------------------------------------------------------
 void Fn_SV_MapHackChanged( IConVar *pConVar, const char *pszOldValue, float flOldValue )
@@ -191,6 +361,12 @@ const char *MapHack_VariableValueHelper( const char *pszValue, MapHackType_t *pT
 	return pszValue;
 }
 
+//-----------------------------------------------------------------------------
+const MapHackVariable_t *MapHack_LookupVariable( const char *pszName )
+{
+	return GetMapHackManager()->GetVariableByName( pszName );
+}
+
 //-----------------------------------------------------------------------------
 // For parsing entity KeyValues
 //-----------------------------------------------------------------------------
@@ -219,7 +395,7 @@ void MapHack_ParseEntKVBlockHelper( CBaseEntity *pEntity, KeyValues *pNode )
 			if ( FStrEq( pszName, "model" ) )
 			{
 				// Precache model and set it
-				CBaseEntity::PrecacheModel( pszValue );
+				GetMapHackManager()->PrecacheOnce( MAPHACK_PRECACHE_MODEL, pszValue );
 				pEntity->SetModel( pszValue );
 			}
 
@@ -286,38 +462,19 @@ void MapHack_ParseEntDataBlockHelper( MapHackEntityData_t *pEntData, KeyValues *
 }
 
 //-----------------------------------------------------------------------------
-// Finds a named offset in datamap
+// Finds a named offset in datamap, embedded offsets are included
 //-----------------------------------------------------------------------------
 unsigned int MapHack_FindInDataMap( const datamap_t *pMap, const char *pszName, fieldtype_t *pReturnType = NULL )
 {
-	while ( pMap )
-	{
-		for ( int i = 0; i < pMap->dataNumFields; ++i )
-		{
-			if ( !pMap->dataDesc[i].fieldName )
-				continue;
-
-			// Case-insensitive
-			if ( V_stricmp( pszName, pMap->dataDesc[i].fieldName ) == 0 )
-			{
-				if ( pReturnType )
-					*pReturnType = pMap->dataDesc[i].fieldType;
-
-				return pMap->dataDesc[i].fieldOffset[TD_OFFSET_NORMAL];
-			}
-
-			if ( pMap->dataDesc[i].td )
-			{
-				unsigned int offset;
-				if ( ( offset = MapHack_FindInDataMap( pMap->dataDesc[i].td, pszName, pReturnType ) ) != 0 )
-					return offset;
-			}
-		}
+	const CMapHackReflection *pReflection = CMapHackReflection::Get( pMap );
+	const MapHackReflectedField_t *pField = pReflection ? pReflection->FindField( pszName ) : NULL;
+	if ( !pField )
+		return 0;
 
-		pMap = pMap->baseMap;
-	}
+	if ( pReturnType )
+		*pReturnType = pField->m_pField->fieldType;
 
-	return 0;
+	return pField->m_Offset;
 }
 
 //-----------------------------------------------------------------------------
@@ -344,16 +501,17 @@ const char *MapHack_GetLabel( const char *psz, int *pDataType = NULL )
 	return psz;
 }
 
+//-----------------------------------------------------------------------------
+// Name lookups, all tables are hashed at static init
+//-----------------------------------------------------------------------------
+static const CMapHackPerfectHash<ARRAYSIZE( g_pszMapHackKeyWords ), 32> g_MapHackKeyWordHash( g_pszMapHackKeyWords );
+static const CMapHackPerfectHash<MAPHACK_FUNCTION_COUNT, 256> g_MapHackFunctionHash( g_pszMapHackFunctionTable );
+static const CMapHackPerfectHash<MAPHACK_EVENT_COUNT, 16> g_MapHackEventTypeHash( g_pszMapHackEventTypes );
+
 //-----------------------------------------------------------------------------
 bool MapHack_IsKeyWord( const char *psz )
 {
-	for ( unsigned int i = 0; i < ARRAYSIZE( g_pszMapHackKeyWords ); ++i )
-	{
-		if ( FStrEq( psz, g_pszMapHackKeyWords[i] ) )
-			return true;
-	}
-
-	return false;
+	return g_MapHackKeyWordHash.Find( psz ) != -1;
 }
 
 //-----------------------------------------------------------------------------
@@ -366,18 +524,40 @@ void MapHack_EditEntity( CBaseEntity *pEntity, KeyValues *pKV )
 }
 
 //-----------------------------------------------------------------------------
-bool MapHack_EditEntityField( CBaseEntity *pEntity, const char *pszKeyName, const char *pszFieldName, const char *pszValue )
+// Field types MapHack_SetEntityField() can parse
+//-----------------------------------------------------------------------------
+bool MapHack_IsSettableFieldType( const fieldtype_t fieldType )
 {
-	// No key names? No field names? No editing.
-	if ( !pszKeyName && !pszFieldName )
-		return false;
+	switch ( fieldType )
+	{
+		case FIELD_MODELNAME:
+		case FIELD_SOUNDNAME:
+		case FIELD_STRING:
+		case FIELD_TIME:
+		case FIELD_FLOAT:
+		case FIELD_BOOLEAN:
+		case FIELD_CHARACTER:
+		case FIELD_SHORT:
+		case FIELD_INTEGER:
+		case FIELD_TICK:
+		case FIELD_POSITION_VECTOR:
+		case FIELD_VECTOR:
+		case FIELD_VMATRIX:
+		case FIELD_VMATRIX_WORLDSPACE:
+		case FIELD_MATRIX3X4_WORLDSPACE:
+		case FIELD_COLOR32:
+			return true;
 
-	// Find a named offset in datamap
-	fieldtype_t fieldType;
-	const unsigned int fieldOffset = MapHack_FindInDataMap( pEntity->GetDataDescMap(), pszFieldName, &fieldType );
-	if ( fieldOffset == 0 )
-		return false;
+		default:
+			return false;
+	}
+}
 
+//-----------------------------------------------------------------------------
+// Parses the value straight into a resolved field
+//-----------------------------------------------------------------------------
+bool MapHack_SetEntityField( CBaseEntity *pEntity, const fieldtype_t fieldType, const unsigned int fieldOffset, const char *pszValue )
+{
 	switch ( fieldType )
 	{
 		// Strings
@@ -442,10 +622,31 @@ bool MapHack_EditEntityField( CBaseEntity *pEntity, const char *pszKeyName, cons
 		case FIELD_MATERIALINDEX:
 		case FIELD_EDICT:
 		default:
-			ConColorMsg( 0, CON_COLOR_MAPHACK, "MapHack WARNING: Field type %d unsupported! (field name: \"%s\")\n", fieldType, pszFieldName );
 			return false;
 	}
 
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+bool MapHack_EditEntityField( CBaseEntity *pEntity, const char *pszKeyName, const char *pszFieldName, const char *pszValue )
+{
+	// No key names? No field names? No editing.
+	if ( !pszKeyName && !pszFieldName )
+		return false;
+
+	// Find a named offset in datamap
+	fieldtype_t fieldType;
+	const unsigned int fieldOffset = MapHack_FindInDataMap( pEntity->GetDataDescMap(), pszFieldName, &fieldType );
+	if ( fieldOffset == 0 )
+		return false;
+
+	if ( !MapHack_SetEntityField( pEntity, fieldType, fieldOffset, pszValue ) )
+	{
+		ConColorMsg( 0, CON_COLOR_MAPHACK, "MapHack WARNING: Field type %d unsupported! (field name: \"%s\")\n", fieldType, pszFieldName );
+		return false;
+	}
+
 	MapHack_DebugMsg( "Changed field \"%s\" value to \"%s\"\n", pszFieldName, pszValue );
 	return true;
 }
@@ -456,20 +657,16 @@ bool MapHack_RemoveEntityConnections( CBaseEntity *pEntity )
 	if ( !pEntity )
 		return false;
 
-	// Iterate through a typedescript data block
-	for ( const datamap_t *pDataMap = pEntity->GetDataDescMap(); pDataMap != NULL; pDataMap = pDataMap->baseMap )
+	const CMapHackReflection *pReflection = CMapHackReflection::Get( pEntity->GetDataDescMap() );
+	if ( !pReflection )
+		return false;
+
+	for ( int i = 0; i < pReflection->GetOutputCount(); ++i )
 	{
-		for ( int i = 0; i < pDataMap->dataNumFields; ++i )
-		{
-			if ( pDataMap->dataDesc[i].fieldType == FIELD_CUSTOM &&
-				( pDataMap->dataDesc[i].flags & ( FTYPEDESC_OUTPUT | FTYPEDESC_KEY ) ) )
-			{
-				CBaseEntityOutput *pOutput = (CBaseEntityOutput *)( (intp)pEntity + pDataMap->dataDesc[i].fieldOffset[0] );
+		CBaseEntityOutput *pOutput = (CBaseEntityOutput *)( (intp)pEntity + pReflection->GetOutput( i ).m_Offset );
 
-				// Remove all connections
-				pOutput->DeleteAllElements();
-			}
-		}
+		// Remove all connections
+		pOutput->DeleteAllElements();
 	}
 
 	return true;
@@ -541,6 +738,11 @@ MapHackType_t MapHack_GetTypeByIdentifier( const char *pszIdent )
 		return MapHackType_t::TYPE_COLOR;
 	}
 
+	if ( FStrEq( pszIdent, "vector" ) )
+	{
+		return MAPHACK_TYPE_VECTOR;
+	}
+
 	return MapHackType_t::TYPE_NONE;
 }
 
@@ -598,8 +800,29 @@ CMapHackManager::CMapHackManager()
 
 	m_pMapHack = NULL;
 	m_bPreEntity = true;
+
+	m_mapExpressions.SetLessFunc( DefLessFunc( KeyValues * ) );
+	m_mapSpawnTemplates.SetLessFunc( DefLessFunc( KeyValues * ) );
 	m_pNewMapData = NULL;
+	m_pEntityIndex = new CMapHackEntityIndex();
+	m_bEntDataCompressed = false;
 	m_pszIdentifier = "";
+
+	m_pExecContext = NULL;
+	m_flExecTimeUsed = 0.0;
+	m_iExecInstructionsUsed = 0;
+
+	m_pPreload = NULL;
+	m_hPreloadThread = NULL;
+
+	m_szFileName[0] = '\0';
+	m_iFileLoadFlags = 0;
+	m_bWatchesDirty = false;
+	m_iWatchFd = -1;
+	m_flNextWatchCheck = 0.0;
+	m_pHotReload = NULL;
+	m_pPrecacheManifest = NULL;
+	m_pSnapshot = NULL;
 }
 
 //-----------------------------------------------------------------------------
@@ -612,15 +835,13 @@ CMapHackManager::~CMapHackManager()
 	}
 
 	delete[] m_pNewMapData;
+	delete m_pEntityIndex;
+	delete m_pSnapshot;
 }
 
 //-----------------------------------------------------------------------------
 bool CMapHackManager::Init()
 {
-	// Register functions
-	for ( int type = 0; type < MAPHACK_FUNCTION_COUNT; ++type )
-		m_dictFunctions.Insert( g_pszMapHackFunctionTable[type], (MapHackFunctionType_t)type );
-
 	return true;
 }
 
@@ -628,14 +849,21 @@ bool CMapHackManager::Init()
 void CMapHackManager::Shutdown()
 {
 	ResetMapHack();
+	PurgePreload();
+	PurgeIncludeCache();
 
-	m_dictFunctions.Purge();
 	m_vecEntData.PurgeAndDeleteElements();
+
+	CMapHackReflection::PurgeAll();
 }
 
 //-----------------------------------------------------------------------------
+static const char *MapHack_GetNonStaticFunction( KeyValues *pKV );
 const char *CMapHackManager::LevelInit( const char *pMapData )
 {
+	m_pEntityIndex->Purge();
+	m_bEntDataCompressed = false;
+
 	if ( m_pNewMapData )
 	{
 		delete[] m_pNewMapData;
@@ -647,21 +875,43 @@ const char *CMapHackManager::LevelInit( const char *pMapData )
 	// Load maphack into memory before entities settle in
 	if ( sv_maphack.GetBool() )
 	{
-		// Look for custom filename
-		const char *pszFileName = sv_maphack_filename.GetString();
-		if ( pszFileName[0] == '\0' )
-			pszFileName = UTIL_VarArgs( "%s\\%s.txt", sv_maphack_directory.GetString(), STRING( gpGlobals->mapname ) );
+		char szFileName[MAX_PATH];
+		GetMapHackFileName( STRING( gpGlobals->mapname ), szFileName, sizeof( szFileName ) );
 
 		const int loadFlags = MAPHACK_PRECACHE | MAPHACK_REGISTER_VARS | MAPHACK_LOAD_INCLUDES;
-		LoadMapHackFromFile( pszFileName, loadFlags );
+
+		// Parsed while the previous map was running?
+		KeyValues *pPreloaded = AdoptPreload( szFileName );
+		if ( pPreloaded )
+		{
+			if ( LoadMapHack( pPreloaded, loadFlags | MAPHACK_ADOPT ) )
+			{
+				// The maphack owns the tree now
+				m_pPreload->m_pKV = NULL;
+				SetMapHackFile( szFileName, loadFlags );
+			}
+
+			++m_Stats.m_iPreloadsAdopted;
+		}
+		else
+		{
+			LoadMapHackFromFile( szFileName, loadFlags );
+		}
+
+		PurgePreload();
 	}
 
 	// Do pre-entity stuff if we got a maphack in memory
 	if ( m_pMapHack )
 	{
 		KeyValues *pKVPreEntities = m_pMapHack->FindKey( "pre_entities" );
-		if ( pKVPreEntities )
+		// Patched ahead of time by maphack_patch, or by another server?
+		if ( pKVPreEntities && !LoadPatchedLump( pMapData, pKVPreEntities ) )
 		{
+			// Static results are shared, hashed before running changes the tree
+			const bool bShare = MapHack_IsSharedCacheEnabled() && !MapHack_GetNonStaticFunction( pKVPreEntities );
+			const unsigned int preEntityHash = bShare ? GetPreEntityHash( pKVPreEntities ) : 0;
+
 			// Parse map data
 			BuildEntityList( pMapData );
 
@@ -673,9 +923,15 @@ const char *CMapHackManager::LevelInit( const char *pMapData )
 
 			// Clean up the mess
 			m_vecEntData.PurgeAndDeleteElements();
+
+			if ( bShare && m_pNewMapData )
+				MapHack_StoreSharedLump( MapHack_GetEntityLumpCRC( pMapData ), preEntityHash, m_pNewMapData );
 		}
 	}
 
+	// The pre-entity pass gave the warm-up a head start
+	FlushPrecache();
+
 	// Return new data
 	return m_pNewMapData;
 }
@@ -685,10 +941,40 @@ void CMapHackManager::LevelInitPostEntity()
 {
 	m_bPreEntity = false;
 
+	// Entities have spawned, tokenize the lump once for restarts and respawns
+	if ( m_pMapHack )
+		GetEntityIndex();
+
+	// Only the index reads the hacked entities from now on
+	if ( m_pNewMapData && sv_maphack_compress_entities.GetBool() )
+	{
+		CMapHackEntityIndex &index = GetEntityIndex();
+		index.Compress( sv_maphack_compress_entities_chunk.GetInt() * 1024 );
+		if ( index.IsCompressed() )
+		{
+			delete[] m_pNewMapData;
+			m_pNewMapData = NULL;
+			m_bEntDataCompressed = true;
+
+			MapHack_DebugMsg( "Compressed the hacked entities from %d to %d bytes in %d chunks\n", index.GetLumpSize(), index.GetCompressedSize(), index.GetChunkCount() );
+		}
+	}
+
 	if ( sv_maphack.GetBool() && m_pMapHack )
 	{
 		// If we got a maphack in memory, run entities
-		RunEntities( m_pMapHack->FindKey( "entities" ) );
+		RunFileEntities( m_pMapHack->FindKey( "entities" ) );
+	}
+
+	// Include parses on the thread pool may have stored entries
+	if ( MapHack_IsSharedCacheEnabled() )
+		MapHack_EvictSharedEntries();
+
+	if ( sv_maphack.GetBool() && sv_maphack_preload_next.GetBool() )
+	{
+		char szMapName[MAX_MAP_NAME];
+		if ( MapHack_GetNextMapName( szMapName, sizeof( szMapName ) ) )
+			PreloadMapHack( szMapName );
 	}
 }
 
@@ -696,6 +982,9 @@ void CMapHackManager::LevelInitPostEntity()
 void CMapHackManager::LevelShutdownPostEntity()
 {
 	ResetMapHack();
+
+	// Precache tables don't outlive the level
+	PurgePrecache();
 }
 
 //-----------------------------------------------------------------------------
@@ -704,8 +993,29 @@ void CMapHackManager::Think()
 	if ( !HasMapHack() )
 		return;
 
+	// Between event bodies, nothing is running on the old version
+	if ( sv_maphack_hotreload.GetBool() && m_szFileName[0] != '\0' && Plat_FloatTime() >= m_flNextWatchCheck )
+	{
+		m_flNextWatchCheck = Plat_FloatTime() + sv_maphack_hotreload_interval.GetFloat();
+
+		if ( CheckWatchedFiles() )
+			HotReloadMapHack();
+	}
+
+	// New tick, new budget
+	m_flExecTimeUsed = 0.0;
+	m_iExecInstructionsUsed = 0;
+
+	ResumeSuspendedContexts();
+
 	if ( m_dictEvents.Count() > 0 )
 		HandleEvents();
+
+	if ( m_vecSpawnQueue.Count() > 0 )
+		DrainSpawnQueue();
+
+	if ( m_vecSuspendedContexts.Count() > 0 )
+		++m_Stats.m_iDeferredTicks;
 }
 
 //-----------------------------------------------------------------------------
@@ -808,25 +1118,20 @@ void CMapHackManager::InvokeEntityOutputCallbacks( const MapHackOutputCallbackPa
 		if ( !pEnt || pEnt->entindex() != params.m_pCaller->entindex() )
 			continue;
 
-		const datamap_t *pDataMap = pEnt->GetDataDescMap();
-		while ( pDataMap )
+		const CMapHackReflection *pReflection = CMapHackReflection::Get( pEnt->GetDataDescMap() );
+		if ( !pReflection )
+			continue;
+
+		// Outputs can't be shared, the first match is the only one
+		const intp sourceOffset = (intp)params.m_pSource - (intp)pEnt;
+		for ( int j = 0; j < pReflection->GetOutputCount(); ++j )
 		{
-			const int fields = pDataMap->dataNumFields;
-			for ( int j = 0; j < fields; ++j )
+			const MapHackReflectedField_t &output = pReflection->GetOutput( j );
+			if ( (intp)output.m_Offset == sourceOffset )
 			{
-				const typedescription_t *pDataDesc = &pDataMap->dataDesc[j];
-				if ( pDataDesc->fieldType == FIELD_CUSTOM && pDataDesc->flags & FTYPEDESC_OUTPUT )
-				{
-					const CBaseEntityOutput *pOutput = (CBaseEntityOutput *)( (intp)pEnt + (int)pDataDesc->fieldOffset[0] );
-					if ( pOutput == params.m_pSource )
-					{
-						callback.m_fnCallback( pEnt, pDataDesc->externalName, params );
-						break;
-					}
-				}
+				callback.m_fnCallback( pEnt, output.m_pszName, params );
+				break;
 			}
-
-			pDataMap = pDataMap->baseMap;
 		}
 	}
 }
@@ -852,6 +1157,13 @@ bool CMapHackManager::LoadMapHack( KeyValues *pKV, const int loadFlags, const ch
 
 	const bool bInclude = ( loadFlags & MAPHACK_INCLUDE );
 
+	// Root file or maphack_include, nested includes are loaded by one of these
+	const bool bOutermost = ( m_vecIncludeStack.Count() == 0 );
+
+	// maphack_include, the snapshot doesn't know about this one
+	if ( bInclude && bOutermost )
+		PurgeSnapshot();
+
 	if ( !bInclude )
 	{
 		ResetMapHack();
@@ -859,7 +1171,7 @@ bool CMapHackManager::LoadMapHack( KeyValues *pKV, const int loadFlags, const ch
 		SetIdentifier( pszIdentifier );
 
 		// Store keyvalues in memory
-		m_pMapHack = pKV->MakeCopy();
+		m_pMapHack = ( loadFlags & MAPHACK_ADOPT ) ? pKV : pKV->MakeCopy();
 	}
 
 	if ( loadFlags & MAPHACK_LOAD_INCLUDES )
@@ -868,14 +1180,40 @@ bool CMapHackManager::LoadMapHack( KeyValues *pKV, const int loadFlags, const ch
 	if ( loadFlags & MAPHACK_REGISTER_VARS )
 		RegisterVariables( pKV->FindKey( "vars" ) );
 
+	// Includes have been collected by now, the outermost file precaches everything at once
 	if ( loadFlags & MAPHACK_PRECACHE )
-		Precache( pKV->FindKey( "precache" ) );
+	{
+		// Compiled files already know what they precache
+		if ( bOutermost && m_pPrecacheManifest )
+		{
+			FOR_EACH_VEC( *m_pPrecacheManifest, i )
+				AddPrecache( m_pPrecacheManifest->Element( i ).m_Type, m_pPrecacheManifest->Element( i ).m_Name.Get() );
+		}
+		else
+		{
+			CollectPrecache( pKV, false );
+		}
+
+		// LevelInit precaches after the pre-entity pass
+		if ( bOutermost )
+		{
+			WarmPrecache();
+
+			if ( !IsPreEntity() )
+				FlushPrecache();
+		}
+	}
 
 	if ( loadFlags & MAPHACK_REGISTER_EVENTS )
 		RegisterEvents( pKV->FindKey( "events" ), pKV );
 
 	if ( loadFlags & MAPHACK_RUN_ENTITIES )
-		RunEntities( pKV->FindKey( "entities" ) );
+	{
+		if ( bInclude && m_pSnapshot )
+			m_pSnapshot->m_vecIncludes.AddToTail( pKV );
+
+		RunFileEntities( pKV->FindKey( "entities" ) );
+	}
 
 	return true;
 }
@@ -884,71 +1222,1389 @@ bool CMapHackManager::LoadMapHack( KeyValues *pKV, const int loadFlags, const ch
 bool CMapHackManager::LoadMapHackFromFile( const char *pszFileName, const int loadFlags )
 {
 	bool bSuccess = false;
-
-	KeyValues *pKV = new KeyValues( "maphack" );
+	bool bAdopted = false;
 
 	// KV parser requires that we allow escape characters
-	pKV->UsesEscapeSequences( true );
+	CUtlVector<MapHackPrecacheEntry_t> vecManifest;
+	KeyValues *pKV = MapHack_LoadCompiledFile( pszFileName, true, &vecManifest );
+
+	// Other servers on the machine may have read it already
+	MapHackContentKey_t key;
+	const bool bShared = !pKV && MapHack_IsSharedCacheEnabled() && MapHack_GetContentKey( pszFileName, key );
+	if ( bShared )
+		pKV = MapHack_LoadSharedFile( key, true, &vecManifest );
+
+	if ( pKV )
+	{
+		m_pPrecacheManifest = &vecManifest;
+	}
+	else
+	{
+		pKV = MapHack_ParseFile( pszFileName, true );
+
+		// Stored before loading gets to change the tree
+		if ( pKV && bShared )
+		{
+			CollectPrecache( pKV, false, &vecManifest );
+			MapHack_StoreSharedFile( key, pKV, &vecManifest, true );
+			m_pPrecacheManifest = &vecManifest;
+		}
+	}
 
-	if ( pKV->LoadFromFile( filesystem, pszFileName ) )
+	if ( pKV )
 	{
 		MapHack_DebugMsg( "Loading from file \"%s\"\n", pszFileName );
 
-		// Parse file
-		bSuccess = LoadMapHack( pKV, loadFlags );
+		// Parse file, the root maphack keeps the tree
+		bSuccess = LoadMapHack( pKV, loadFlags | MAPHACK_ADOPT );
+		m_pPrecacheManifest = NULL;
+		bAdopted = bSuccess && !( loadFlags & MAPHACK_INCLUDE );
+
+		if ( bAdopted )
+			SetMapHackFile( pszFileName, loadFlags );
 	}
 
 	if ( !bSuccess && ( loadFlags & MAPHACK_COMPLAIN ) )
 		Warning( "Failed to load MapHack %s!\n", pszFileName );
 
+	// maphack_include, queued spawns may still run its entities
+	if ( pKV && !bAdopted )
+	{
+		if ( bSuccess )
+			m_vecIncludeTrees.AddToTail( pKV );
+		else
+			ReleaseIncludeTree( pKV );
+	}
+
+	return bSuccess;
+}
+
+//-----------------------------------------------------------------------------
+// Includes are compiled the way LoadIncludes() reads them
+//-----------------------------------------------------------------------------
+bool CMapHackManager::CompileMapHack( const char *pszFileName )
+{
+	CUtlDict<bool> dictCompiled;
+	return CompileFile( pszFileName, true, dictCompiled );
+}
+
+//-----------------------------------------------------------------------------
+bool CMapHackManager::CompileFile( const char *pszFilename, const bool bEscapeSequences, CUtlDict<bool> &dictCompiled )
+{
+	// Shared and cyclic includes are compiled once
+	if ( dictCompiled.IsValidIndex( dictCompiled.Find( pszFilename ) ) )
+		return true;
+
+	dictCompiled.Insert( pszFilename, true );
+
+	// Always from the text, that's what the .mhc has to match
+	MapHackFileStamp_t stamp;
+	KeyValues *pKV = MapHack_GetFileStamp( pszFilename, stamp ) ? MapHack_ParseFile( pszFilename, bEscapeSequences ) : NULL;
+	if ( !pKV )
+	{
+		Warning( "MapHack WARNING: Can't compile \"%s\", failed to read it!\n", pszFilename );
+		return false;
+	}
+
+	CUtlVector<MapHackPrecacheEntry_t> vecManifest;
+	CollectPrecache( pKV, false, &vecManifest );
+
+	int size = 0;
+	bool bSuccess = MapHack_WriteCompiledFile( pszFilename, pKV, vecManifest, stamp, bEscapeSequences, &size );
+	if ( bSuccess )
+		ConColorMsg( 0, CON_COLOR_MAPHACK, "MapHack: Compiled \"%s\" (%d bytes, %d precaches)\n", pszFilename, size, vecManifest.Count() );
+	else
+		Warning( "MapHack WARNING: Failed to write the compiled \"%s\"!\n", pszFilename );
+
+	KeyValues *pIncludes = pKV->FindKey( "includes" );
+	if ( pIncludes )
+	{
+		for ( KeyValues *pInclude = pIncludes->GetFirstValue(); pInclude; pInclude = pInclude->GetNextValue() )
+		{
+			if ( !CompileFile( pInclude->GetString(), false, dictCompiled ) )
+				bSuccess = false;
+		}
+	}
+
+	pKV->deleteThis();
+	return bSuccess;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::ReloadMapHack()
+{
+	if ( !HasMapHack() )
+		return;
+
+	ResetMapHack( false );
+
+	// Registration records what the next round restart goes back to
+	m_pSnapshot = new MapHackSnapshot_t();
+
+	LoadIncludes( m_pMapHack->FindKey( "includes" ), MAPHACK_LOAD_POST_ENTITY );
+	RegisterVariables( m_pMapHack->FindKey( "vars" ) );
+	RegisterEvents( m_pMapHack->FindKey( "events" ), m_pMapHack );
+	RunFileEntities( m_pMapHack->FindKey( "entities" ) );
+
+	// Includes have run their entities now, hot reloads diff against those too
+	m_iFileLoadFlags |= MAPHACK_LOAD_POST_ENTITY;
+}
+
+//-----------------------------------------------------------------------------
+// Variables, events, game event listeners and compiled expressions are kept,
+// only their state goes back to the snapshot
+//-----------------------------------------------------------------------------
+void CMapHackManager::RestartMapHack()
+{
+	if ( !HasMapHack() )
+		return;
+
+	// Level loads don't register events, the first restart of a level reloads
+	if ( !m_pSnapshot || !sv_maphack_fast_restart.GetBool() )
+	{
+		ReloadMapHack();
+		return;
+	}
+
+	m_vecEventQueue.Purge();
+
+	// Everything pending belongs to the round that just ended
+	PurgeExecContexts();
+	PurgeSpawnQueue();
+	m_dictSpawnedEnts.Purge();
+
+	// Pooled entities went with the map cleanup
+	PurgeSpawnTemplates();
+
+	m_vecEntityHashes.Purge();
+
+	// The map cleanup took the bound entities, their handles are already NULL
+	RemoveAllOutputCallbacks();
+
+	FOR_EACH_VEC( m_pSnapshot->m_vecVars, i )
+	{
+		const MapHackVariableState_t &state = m_pSnapshot->m_vecVars[i];
+		state.m_pVar->CopyValue( *state.m_pSaved );
+	}
+
+	FOR_EACH_VEC( m_pSnapshot->m_vecEvents, i )
+	{
+		const MapHackEventState_t &state = m_pSnapshot->m_vecEvents[i];
+		MapHackEvent_t *pEvent = state.m_pEvent;
+
+		pEvent->m_bTriggered = state.m_bTriggered;
+		pEvent->m_flTriggerTime = state.m_flTriggerTime;
+		pEvent->m_bStopped = state.m_bStopped;
+		pEvent->m_flDelayTime = state.m_flDelayTime;
+
+		if ( pEvent->m_Type != MAPHACK_EVENT_OUTPUT )
+			continue;
+
+		// Bind to the new round's entity, same lookup as registration
+		CBaseEntity *pEnt = NULL;
+		if ( pEvent->m_szOutputEntName[0] != '\0' )
+			pEnt = GetEntityByTargetName( pEvent->m_szOutputEntName );
+
+		if ( !pEnt )
+			pEnt = GetFirstEntityByClassName( pEvent->m_szOutputClassName );
+
+		pEvent->m_hOutputEnt = pEnt;
+
+		if ( pEnt )
+			RegisterOutputCallback( pEnt, Fn_EntityOutputCallback );
+	}
+
+	// Same order as a reload, includes first
+	FOR_EACH_VEC( m_pSnapshot->m_vecIncludes, i )
+		RunFileEntities( m_pSnapshot->m_vecIncludes[i]->FindKey( "entities" ) );
+
+	RunFileEntities( m_pMapHack->FindKey( "entities" ) );
+
+	++m_Stats.m_iFastRestarts;
+}
+
+//-----------------------------------------------------------------------------
+// Content hash of a key and everything below it, peers aren't included
+//-----------------------------------------------------------------------------
+static void MapHack_HashKeyValuesHelper( CRC32_t &crc, KeyValues *pKV )
+{
+	const char *pszName = pKV->GetName();
+	CRC32_ProcessBuffer( &crc, pszName, V_strlen( pszName ) + 1 );
+
+	if ( pKV->GetFirstSubKey() )
+	{
+		for ( KeyValues *pSub = pKV->GetFirstSubKey(); pSub; pSub = pSub->GetNextKey() )
+			MapHack_HashKeyValuesHelper( crc, pSub );
+
+		// Keeps { "a" { "b" "c" } } apart from { "a" { } "b" "c" }
+		CRC32_ProcessBuffer( &crc, "}", 1 );
+	}
+	else
+	{
+		const char *pszValue = pKV->GetString();
+		CRC32_ProcessBuffer( &crc, pszValue, V_strlen( pszValue ) + 1 );
+	}
+}
+
+static unsigned int MapHack_HashKeyValues( KeyValues *pKV )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	MapHack_HashKeyValuesHelper( crc, pKV );
+	CRC32_Final( &crc );
+
+	return crc;
+}
+
+//-----------------------------------------------------------------------------
+static bool MapHack_IsInTree( KeyValues *pTree, const KeyValues *pKV )
+{
+	if ( pTree == pKV )
+		return true;
+
+	for ( KeyValues *pSub = pTree->GetFirstSubKey(); pSub; pSub = pSub->GetNextKey() )
+	{
+		if ( MapHack_IsInTree( pSub, pKV ) )
+			return true;
+	}
+
+	return false;
+}
+
+static bool MapHack_IsInTrees( const CUtlVector<KeyValues*> &vecTrees, const KeyValues *pKV )
+{
+	for ( int i = 0; i < vecTrees.Count(); ++i )
+	{
+		if ( MapHack_IsInTree( vecTrees[i], pKV ) )
+			return true;
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+static bool MapHack_IsSameEvent( const MapHackEvent_t *pA, const MapHackEvent_t *pB )
+{
+	if ( pA->m_Type != pB->m_Type || pA->m_nDefinitionHash != pB->m_nDefinitionHash || pA->m_iDataType != pB->m_iDataType )
+		return false;
+
+	if ( !pA->m_pKVData || !pB->m_pKVData )
+		return ( pA->m_pKVData == pB->m_pKVData );
+
+	return MapHack_HashKeyValues( pA->m_pKVData ) == MapHack_HashKeyValues( pB->m_pKVData );
+}
+
+//-----------------------------------------------------------------------------
+// The new version is registered into empty tables next to the running one,
+// then the two are merged. Variables keep their values and events their
+// timers and delayed triggers unless their definition changed, and entity
+// keys that have run before aren't run again.
+//-----------------------------------------------------------------------------
+bool CMapHackManager::HotReloadMapHack()
+{
+	if ( !HasMapHack() || m_szFileName[0] == '\0' )
+	{
+		Warning( "MapHack WARNING: Hot reload needs a maphack loaded from a file!\n" );
+		return false;
+	}
+
+	// Registers and runs things the snapshot doesn't know about
+	PurgeSnapshot();
+
+	KeyValues *pKV = MapHack_LoadFile( m_szFileName, true );
+	if ( !pKV || !FStrEq( pKV->GetName(), "maphack" ) )
+	{
+		Warning( "MapHack WARNING: Hot reload of \"%s\" failed, keeping the running version\n", m_szFileName );
+
+		if ( pKV )
+			pKV->deleteThis();
+
+		// Not again until the next save
+		RefreshWatchedFiles();
+		return false;
+	}
+
+	const double flStart = Plat_FloatTime();
+
+	// Bodies from the maphack tree and the include trees can't outlive them
+	CUtlVector<KeyValues*> vecTrees;
+	vecTrees.AddVectorToTail( m_vecHotReloadEntities );
+	vecTrees.AddVectorToTail( m_vecIncludeTrees );
+	FOR_EACH_DICT_FAST( m_dictEvents, i )
+	{
+		if ( m_dictEvents[i] && m_dictEvents[i]->m_pKVData )
+			vecTrees.AddToTail( m_dictEvents[i]->m_pKVData );
+	}
+
+	PurgeBlockReferences( vecTrees, true );
+
+	// Compiled expressions and spawn templates point into the old trees
+	PurgeExpressions();
+	PurgeSpawnTemplates();
+
+	// Set the running version aside
+	CUtlDict<MapHackVariable_t*> dictOldVars;
+	FOR_EACH_DICT_FAST( m_dictVars, i )
+		dictOldVars.Insert( m_dictVars.GetElementName( i ), m_dictVars[i] );
+
+	CUtlDict<MapHackEvent_t*> dictOldEvents;
+	FOR_EACH_DICT_FAST( m_dictEvents, i )
+		dictOldEvents.Insert( m_dictEvents.GetElementName( i ), m_dictEvents[i] );
+
+	m_dictVars.RemoveAll();
+	m_dictEvents.RemoveAll();
+
+	MapHackHotReload_t hotReload;
+	hotReload.m_pKVEntities = new KeyValues( "entities" );
+
+	for ( int i = 0; i < m_vecEntityHashes.Count(); ++i )
+	{
+		const unsigned short idx = hotReload.m_mapRunEntities.Find( m_vecEntityHashes[i] );
+		if ( hotReload.m_mapRunEntities.IsValidIndex( idx ) )
+			++hotReload.m_mapRunEntities[idx];
+		else
+			hotReload.m_mapRunEntities.Insert( m_vecEntityHashes[i], 1 );
+	}
+
+	m_vecEntityHashes.RemoveAll();
+
+	// Same passes as the original load, entities are collected instead of run
+	m_pHotReload = &hotReload;
+	PurgeWatchedFiles();
+
+	const int loadFlags = m_iFileLoadFlags | MAPHACK_REGISTER_EVENTS;
+
+	if ( loadFlags & MAPHACK_LOAD_INCLUDES )
+		LoadIncludes( pKV->FindKey( "includes" ), loadFlags );
+
+	RegisterVariables( pKV->FindKey( "vars" ) );
+
+	if ( loadFlags & MAPHACK_PRECACHE )
+	{
+		CollectPrecache( pKV, false );
+		WarmPrecache();
+		FlushPrecache();
+	}
+
+	RegisterEvents( pKV->FindKey( "events" ), pKV );
+	RunFileEntities( pKV->FindKey( "entities" ) );
+
+	m_pHotReload = NULL;
+	SetMapHackFile( m_szFileName, m_iFileLoadFlags );
+
+	// Merge variables, unchanged ones keep their value
+	int varsChanged = 0, varsAdded = 0;
+	FOR_EACH_DICT_FAST( m_dictVars, i )
+	{
+		MapHackVariable_t *pVar = m_dictVars[i];
+
+		const int idx = dictOldVars.Find( pVar->m_szName );
+		if ( !dictOldVars.IsValidIndex( idx ) )
+		{
+			++varsAdded;
+			continue;
+		}
+
+		MapHackVariable_t *pOldVar = dictOldVars[idx];
+		dictOldVars.RemoveAt( idx );
+
+		if ( pOldVar->m_nDefinitionHash == pVar->m_nDefinitionHash )
+		{
+			m_dictVars[i] = pOldVar;
+			delete pVar;
+		}
+		else
+		{
+			++varsChanged;
+			delete pOldVar;
+		}
+	}
+
+	const int varsRemoved = dictOldVars.Count();
+	dictOldVars.PurgeAndDeleteElements();
+
+	// Merge events, unchanged ones keep their timers
+	int eventsChanged = 0, eventsAdded = 0;
+	CUtlVector<MapHackEvent_t*> vecRetired;
+	FOR_EACH_DICT_FAST( m_dictEvents, i )
+	{
+		MapHackEvent_t *pEvent = m_dictEvents[i];
+
+		const int idx = dictOldEvents.Find( pEvent->m_szName );
+		if ( !dictOldEvents.IsValidIndex( idx ) )
+		{
+			++eventsAdded;
+			continue;
+		}
+
+		MapHackEvent_t *pOldEvent = dictOldEvents[idx];
+		dictOldEvents.RemoveAt( idx );
+
+		if ( MapHack_IsSameEvent( pOldEvent, pEvent ) )
+		{
+			m_dictEvents[i] = pOldEvent;
+			delete pEvent;
+			continue;
+		}
+
+		++eventsChanged;
+		vecRetired.AddToTail( pOldEvent );
+
+		// Delayed triggers carry over to the new version
+		for ( int j = 0; j < m_vecEventQueue.Count(); ++j )
+		{
+			if ( m_vecEventQueue[j].m_pEvent == pOldEvent )
+				m_vecEventQueue[j].m_pEvent = pEvent;
+		}
+	}
+
+	const int eventsRemoved = dictOldEvents.Count();
+	FOR_EACH_DICT_FAST( dictOldEvents, i )
+	{
+		MapHackEvent_t *pOldEvent = dictOldEvents[i];
+		vecRetired.AddToTail( pOldEvent );
+
+		FOR_EACH_VEC_BACK( m_vecEventQueue, j )
+		{
+			if ( m_vecEventQueue[j].m_pEvent == pOldEvent )
+				m_vecEventQueue.Remove( j );
+		}
+	}
+
+	// Bodies of changed events stop, the new version runs from the start when triggered
+	vecTrees.RemoveAll();
+	for ( int i = 0; i < vecRetired.Count(); ++i )
+	{
+		if ( vecRetired[i]->m_pKVData )
+			vecTrees.AddToTail( vecRetired[i]->m_pKVData );
+	}
+
+	PurgeBlockReferences( vecTrees, false );
+	vecRetired.PurgeAndDeleteElements();
+
+	m_pMapHack->deleteThis();
+	m_pMapHack = pKV;
+
+	// Only entity keys that are new or different
+	const int entitiesRun = m_vecEntityHashes.Count() - hotReload.m_iSkippedEntities;
+	if ( hotReload.m_pKVEntities->GetFirstTrueSubKey() )
+	{
+		m_vecHotReloadEntities.AddToTail( hotReload.m_pKVEntities );
+		RunEntities( hotReload.m_pKVEntities );
+	}
+	else
+	{
+		hotReload.m_pKVEntities->deleteThis();
+	}
+
+	// New output events might be looking for entities that exist by now
+	UpdateOutputEvents();
+
+	++m_Stats.m_iHotReloads;
+	m_Stats.m_iHotReloadChanges += varsChanged + varsAdded + eventsChanged + eventsAdded;
+	m_Stats.m_iHotReloadEntities += entitiesRun;
+	m_Stats.m_iHotReloadEntitiesSkipped += hotReload.m_iSkippedEntities;
+
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "MapHack: Hot reloaded \"%s\" in %.2f ms\n", m_szFileName, ( Plat_FloatTime() - flStart ) * 1000.0 );
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "    vars: %d changed, %d added, %d removed\n", varsChanged, varsAdded, varsRemoved );
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "    events: %d changed, %d added, %d removed\n", eventsChanged, eventsAdded, eventsRemoved );
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "    entity keys: %d run, %d unchanged\n", entitiesRun, hotReload.m_iSkippedEntities );
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::SetMapHackFile( const char *pszFileName, const int loadFlags )
+{
+	if ( pszFileName != m_szFileName )
+		V_strcpy_safe( m_szFileName, pszFileName );
+
+	m_iFileLoadFlags = loadFlags;
+	AddWatchedFile( pszFileName );
+}
+
+//-----------------------------------------------------------------------------
+// Entities block of a file, hot reload only runs the keys that changed since
+//-----------------------------------------------------------------------------
+void CMapHackManager::RunFileEntities( KeyValues *pKV )
+{
+	if ( !pKV )
+		return;
+
+	for ( KeyValues *pKVEnt = pKV->GetFirstTrueSubKey(); pKVEnt; pKVEnt = pKVEnt->GetNextTrueSubKey() )
+	{
+		const unsigned int hash = MapHack_HashKeyValues( pKVEnt );
+		m_vecEntityHashes.AddToTail( hash );
+
+		if ( !m_pHotReload )
+			continue;
+
+		const unsigned short idx = m_pHotReload->m_mapRunEntities.Find( hash );
+		if ( m_pHotReload->m_mapRunEntities.IsValidIndex( idx ) && m_pHotReload->m_mapRunEntities[idx] > 0 )
+		{
+			--m_pHotReload->m_mapRunEntities[idx];
+			++m_pHotReload->m_iSkippedEntities;
+			continue;
+		}
+
+		m_pHotReload->m_pKVEntities->AddSubKey( pKVEnt->MakeCopy() );
+	}
+
+	if ( !m_pHotReload )
+		RunEntities( pKV );
+}
+
+//-----------------------------------------------------------------------------
+// Drops suspended event bodies and queued spawns that run blocks of the given
+// trees, or with bOutside, blocks that aren't part of any of them
+//-----------------------------------------------------------------------------
+void CMapHackManager::PurgeBlockReferences( const CUtlVector<KeyValues*> &vecTrees, const bool bOutside )
+{
+	CUtlVector<MapHackExecContext_t*> vecDropped;
+
+	FOR_EACH_VEC_BACK( m_vecSuspendedContexts, i )
+	{
+		MapHackExecContext_t *pContext = m_vecSuspendedContexts[i];
+		for ( int j = 0; j < pContext->m_vecFrames.Count(); ++j )
+		{
+			if ( MapHack_IsInTrees( vecTrees, pContext->m_vecFrames[j].m_pBlock ) == bOutside )
+			{
+				m_vecSuspendedContexts.Remove( i );
+				vecDropped.AddToTail( pContext );
+				break;
+			}
+		}
+	}
+
+	// Off the list first, completion events may suspend bodies of their own
+	for ( int i = 0; i < vecDropped.Count(); ++i )
+	{
+		ReleaseFrameBatches( vecDropped[i]->m_vecFrames, true );
+		delete vecDropped[i];
+	}
+
+	FOR_EACH_VEC_BACK( m_vecSpawnQueue, i )
+	{
+		if ( MapHack_IsInTrees( vecTrees, m_vecSpawnQueue[i].m_pKVEnt ) != bOutside )
+			continue;
+
+		MapHackSpawnBatch_t *pBatch = m_vecSpawnQueue[i].m_pBatch;
+		m_vecSpawnQueue.Remove( i );
+
+		// The block is gone, so is its completion event
+		if ( m_vecSpawnBatches.HasElement( pBatch ) && --pBatch->m_iPending <= 0 && pBatch->m_bSealed )
+		{
+			m_vecSpawnBatches.FindAndFastRemove( pBatch );
+			delete pBatch;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::AddWatchedFile( const char *pszFilename )
+{
+	MapHackWatchedFile_t file;
+	if ( !MapHack_GetFileStamp( pszFilename, file.m_Stamp ) )
+		return;
+
+	file.m_iWatch = -1;
+
+	const int idx = m_dictWatchedFiles.Find( pszFilename );
+	if ( m_dictWatchedFiles.IsValidIndex( idx ) )
+		m_dictWatchedFiles[idx] = file;
+	else
+		m_dictWatchedFiles.Insert( pszFilename, file );
+
+	m_bWatchesDirty = true;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::UpdateFileWatches()
+{
+	m_bWatchesDirty = false;
+
+#ifdef LINUX
+	// Start over, saving through a rename leaves the old watch on a dead inode
+	if ( m_iWatchFd != -1 )
+		close( m_iWatchFd );
+
+	m_iWatchFd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+#endif
+
+	FOR_EACH_DICT_FAST( m_dictWatchedFiles, i )
+	{
+		MapHackWatchedFile_t &file = m_dictWatchedFiles[i];
+		file.m_iWatch = -1;
+
+#ifdef LINUX
+		// Files in packs don't change, they're polled like everything without a watch
+		char szFullPath[MAX_PATH];
+		if ( m_iWatchFd != -1 && filesystem->RelativePathToFullPath( m_dictWatchedFiles.GetElementName( i ), NULL, szFullPath, sizeof( szFullPath ), FILTER_CULLPACK ) )
+			file.m_iWatch = inotify_add_watch( m_iWatchFd, szFullPath, IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB );
+#endif
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Returns true if any of the files has changed since the last check
+//-----------------------------------------------------------------------------
+bool CMapHackManager::CheckWatchedFiles()
+{
+	if ( m_bWatchesDirty )
+		UpdateFileWatches();
+
+	bool bChanged = false;
+
+#ifdef LINUX
+	if ( m_iWatchFd != -1 )
+	{
+		// Any event will do, the reload rebuilds the watches anyway
+		char buf[4096];
+		while ( read( m_iWatchFd, buf, sizeof( buf ) ) > 0 )
+			bChanged = true;
+	}
+#endif
+
+	FOR_EACH_DICT_FAST( m_dictWatchedFiles, i )
+	{
+		const MapHackWatchedFile_t &file = m_dictWatchedFiles[i];
+		if ( file.m_iWatch != -1 )
+			continue;
+
+		// Deleted files are picked up again when they come back
+		MapHackFileStamp_t stamp;
+		if ( !MapHack_GetFileStamp( m_dictWatchedFiles.GetElementName( i ), stamp ) )
+			continue;
+
+		if ( stamp.m_Time != file.m_Stamp.m_Time || stamp.m_Size != file.m_Stamp.m_Size )
+			bChanged = true;
+	}
+
+	return bChanged;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::RefreshWatchedFiles()
+{
+	FOR_EACH_DICT_FAST( m_dictWatchedFiles, i )
+		MapHack_GetFileStamp( m_dictWatchedFiles.GetElementName( i ), m_dictWatchedFiles[i].m_Stamp );
+
+	m_bWatchesDirty = true;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::PurgeWatchedFiles()
+{
+#ifdef LINUX
+	if ( m_iWatchFd != -1 )
+		close( m_iWatchFd );
+#endif
+
+	m_iWatchFd = -1;
+	m_dictWatchedFiles.Purge();
+	m_bWatchesDirty = false;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::LoadIncludes( KeyValues *pKV, int loadFlags )
+{
+	if ( !pKV )
+		return;
+
+	// Parse the whole include tree up front, below this everything is cached
+	if ( m_vecIncludeStack.Count() == 0 && sv_maphack_parallel_includes.GetBool() )
+		PrefetchIncludes( pKV );
+
+	for ( KeyValues *pValue = pKV->GetFirstValue(); pValue; pValue = pValue->GetNextValue() )
+	{
+		const char *pszFilename = pValue->GetString();
+
+		if ( IsIncludeLoading( pszFilename ) )
+		{
+			Warning( "MapHack WARNING: Include cycle, \"%s\" is already being loaded!\n", pszFilename );
+			++m_Stats.m_iIncludeCycles;
+			continue;
+		}
+
+		KeyValues *pInclude = GetCachedInclude( pszFilename );
+		if ( !pInclude )
+			continue;
+
+		MapHack_DebugMsg( "Including \"%s\"\n", pszFilename );
+		AddWatchedFile( pszFilename );
+
+		m_vecIncludeStack.AddToTail( pszFilename );
+		LoadMapHack( pInclude, loadFlags | MAPHACK_INCLUDE );
+		m_vecIncludeStack.RemoveMultipleFromTail( 1 );
+	}
+}
+
+//-----------------------------------------------------------------------------
+bool MapHack_GetFileStamp( const char *pszFilename, MapHackFileStamp_t &stamp )
+{
+	if ( !filesystem->FileExists( pszFilename ) )
+		return false;
+
+	stamp.m_Time = filesystem->GetFileTime( pszFilename );
+	stamp.m_Size = filesystem->Size( pszFilename );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+bool CMapHackManager::IsIncludeLoading( const char *pszFilename ) const
+{
+	for ( int i = 0; i < m_vecIncludeStack.Count(); ++i )
+	{
+		if ( V_stricmp( m_vecIncludeStack[i], pszFilename ) == 0 )
+			return true;
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Parsed includes are kept for the whole session, shared libraries are read
+// once no matter how many maps use them
+//-----------------------------------------------------------------------------
+KeyValues *CMapHackManager::GetCachedInclude( const char *pszFilename )
+{
+	MapHackFileStamp_t stamp;
+	if ( !MapHack_GetFileStamp( pszFilename, stamp ) )
+	{
+		DevWarning( "MapHack WARNING: Missing include file \"%s\"\n", pszFilename );
+		return NULL;
+	}
+
+	const int idx = m_dictIncludeCache.Find( pszFilename );
+	if ( m_dictIncludeCache.IsValidIndex( idx ) )
+	{
+		MapHackIncludeCacheEntry_t &entry = m_dictIncludeCache[idx];
+		if ( entry.m_Stamp.m_Time == stamp.m_Time && entry.m_Stamp.m_Size == stamp.m_Size )
+		{
+			// Prefetched ones were counted as misses already
+			if ( entry.m_bPrefetched )
+				entry.m_bPrefetched = false;
+			else
+				++m_Stats.m_iIncludeCacheHits;
+
+			return entry.m_pKV;
+		}
+
+		// Changed on disk
+		ReleaseIncludeTree( entry.m_pKV );
+		m_dictIncludeCache.RemoveAt( idx );
+	}
+
+	++m_Stats.m_iIncludeCacheMisses;
+
+	KeyValues *pInclude = MapHack_LoadFile( pszFilename, false );
+	if ( !pInclude )
+		return NULL;
+
+	AddCachedInclude( pszFilename, pInclude, stamp );
+	return pInclude;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::AddCachedInclude( const char *pszFilename, KeyValues *pKV, const MapHackFileStamp_t &stamp )
+{
+	const int idx = m_dictIncludeCache.Find( pszFilename );
+	if ( m_dictIncludeCache.IsValidIndex( idx ) )
+	{
+		ReleaseIncludeTree( m_dictIncludeCache[idx].m_pKV );
+		m_dictIncludeCache.RemoveAt( idx );
+	}
+
+	MapHackIncludeCacheEntry_t entry;
+	entry.m_pKV = pKV;
+	entry.m_Stamp = stamp;
+	entry.m_bPrefetched = false;
+	m_dictIncludeCache.Insert( pszFilename, entry );
+}
+
+//-----------------------------------------------------------------------------
+struct MapHackIncludeParse_t
+{
+	const char *m_pszFilename;
+	MapHackFileStamp_t m_Stamp;
+	KeyValues *m_pKV; // NULL if it failed to parse
+};
+
+//-----------------------------------------------------------------------------
+// Thread pool
+//-----------------------------------------------------------------------------
+static void MapHack_ParseInclude( MapHackIncludeParse_t &parse )
+{
+	parse.m_pKV = MapHack_LoadFile( parse.m_pszFilename, false );
+}
+
+//-----------------------------------------------------------------------------
+// Parses every include that isn't cached on the thread pool, one wave per
+// include depth. Only the cache is filled, LoadIncludes() still merges the
+// files one by one in declared order
+//-----------------------------------------------------------------------------
+void CMapHackManager::PrefetchIncludes( KeyValues *pKV )
+{
+	CUtlVector<KeyValues*> vecBlocks;
+	vecBlocks.AddToTail( pKV );
+
+	// Includes can repeat or form cycles
+	CUtlDict<bool> dictSeen;
+
+	while ( vecBlocks.Count() > 0 )
+	{
+		CUtlVector<MapHackIncludeParse_t> vecParses;
+		CUtlVector<KeyValues*> vecNextBlocks;
+
+		for ( int i = 0; i < vecBlocks.Count(); ++i )
+		{
+			for ( KeyValues *pValue = vecBlocks[i]->GetFirstValue(); pValue; pValue = pValue->GetNextValue() )
+			{
+				const char *pszFilename = pValue->GetString();
+				if ( dictSeen.IsValidIndex( dictSeen.Find( pszFilename ) ) )
+					continue;
+
+				dictSeen.Insert( pszFilename, true );
+
+				// Missing files are left for LoadIncludes() to complain about
+				MapHackFileStamp_t stamp;
+				if ( !MapHack_GetFileStamp( pszFilename, stamp ) )
+					continue;
+
+				const int idx = m_dictIncludeCache.Find( pszFilename );
+				if ( m_dictIncludeCache.IsValidIndex( idx ) )
+				{
+					const MapHackIncludeCacheEntry_t &entry = m_dictIncludeCache[idx];
+					if ( entry.m_Stamp.m_Time == stamp.m_Time && entry.m_Stamp.m_Size == stamp.m_Size )
+					{
+						KeyValues *pIncludes = entry.m_pKV->FindKey( "includes" );
+						if ( pIncludes )
+							vecNextBlocks.AddToTail( pIncludes );
+
+						continue;
+					}
+				}
+
+				MapHackIncludeParse_t &parse = vecParses[vecParses.AddToTail()];
+				parse.m_pszFilename = pszFilename;
+				parse.m_Stamp = stamp;
+				parse.m_pKV = NULL;
+			}
+		}
+
+		if ( vecParses.Count() > 1 )
+		{
+			ParallelProcess( vecParses.Base(), vecParses.Count(), MapHack_ParseInclude );
+		}
+		else if ( vecParses.Count() == 1 )
+		{
+			MapHack_ParseInclude( vecParses[0] );
+		}
+
+		for ( int i = 0; i < vecParses.Count(); ++i )
+		{
+			const MapHackIncludeParse_t &parse = vecParses[i];
+			if ( !parse.m_pKV )
+				continue;
+
+			++m_Stats.m_iIncludeCacheMisses;
+			++m_Stats.m_iIncludeParallelParses;
+
+			AddCachedInclude( parse.m_pszFilename, parse.m_pKV, parse.m_Stamp );
+			m_dictIncludeCache[m_dictIncludeCache.Find( parse.m_pszFilename )].m_bPrefetched = true;
+
+			KeyValues *pIncludes = parse.m_pKV->FindKey( "includes" );
+			if ( pIncludes )
+				vecNextBlocks.AddToTail( pIncludes );
+		}
+
+		vecBlocks.Swap( vecNextBlocks );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Nothing that is keyed by its blocks may outlive the tree, cached includes
+// and maphack_include files alike
+//-----------------------------------------------------------------------------
+void CMapHackManager::ReleaseIncludeTree( KeyValues *pKV )
+{
+	CUtlVector<KeyValues*> vecTrees;
+	vecTrees.AddToTail( pKV );
+
+	PurgeSnapshot( pKV );
+	PurgeBlockReferences( vecTrees, false );
+	PurgeTreeCaches( pKV );
 	pKV->deleteThis();
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::PurgeIncludeCache()
+{
+	PurgeSnapshot();
+
+	FOR_EACH_DICT_FAST( m_dictIncludeCache, i )
+	{
+		PurgeTreeCaches( m_dictIncludeCache[i].m_pKV );
+		m_dictIncludeCache[i].m_pKV->deleteThis();
+	}
+
+	m_dictIncludeCache.Purge();
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::SnapshotVariable( MapHackVariable_t *pVar )
+{
+	if ( !m_pSnapshot )
+		return;
+
+	MapHackVariableState_t &state = m_pSnapshot->m_vecVars[m_pSnapshot->m_vecVars.AddToTail()];
+	state.m_pVar = pVar;
+	state.m_pSaved = new MapHackVariable_t();
+	state.m_pSaved->CopyValue( *pVar );
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::SnapshotEvent( MapHackEvent_t *pEvent )
+{
+	if ( !m_pSnapshot )
+		return;
+
+	MapHackEventState_t &state = m_pSnapshot->m_vecEvents[m_pSnapshot->m_vecEvents.AddToTail()];
+	state.m_pEvent = pEvent;
+	state.m_bTriggered = pEvent->m_bTriggered;
+	state.m_flTriggerTime = pEvent->m_flTriggerTime;
+	state.m_bStopped = pEvent->m_bStopped;
+	state.m_flDelayTime = pEvent->m_flDelayTime;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::PurgeSnapshot()
+{
+	delete m_pSnapshot;
+	m_pSnapshot = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Include trees are about to go away, the snapshot can't run them anymore
+//-----------------------------------------------------------------------------
+void CMapHackManager::PurgeSnapshot( const KeyValues *pInclude )
+{
+	if ( m_pSnapshot && m_pSnapshot->m_vecIncludes.HasElement( const_cast<KeyValues *>( pInclude ) ) )
+		PurgeSnapshot();
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::GetMapHackFileName( const char *pszMapName, char *pszOut, int outSize )
+{
+	// Look for custom filename
+	const char *pszFileName = sv_maphack_filename.GetString();
+	if ( pszFileName[0] != '\0' )
+	{
+		V_strncpy( pszOut, pszFileName, outSize );
+		return;
+	}
+
+	V_snprintf( pszOut, outSize, "%s\\%s.txt", sv_maphack_directory.GetString(), pszMapName );
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::GetPatchedLumpFileName( const char *pszMapName, char *pszOut, int outSize )
+{
+	V_snprintf( pszOut, outSize, "%s\\%s" MAPHACK_LUMP_EXTENSION, sv_maphack_directory.GetString(), pszMapName );
+}
+
+//-----------------------------------------------------------------------------
+// Functions that make pre_entities more than a function of the map and the
+// maphack. Variables they change would be missing from the events when the
+// transform is skipped.
+//-----------------------------------------------------------------------------
+static const char *MapHack_GetNonStaticFunction( KeyValues *pKV )
+{
+	for ( KeyValues *pSub = pKV->GetFirstSubKey(); pSub; pSub = pSub->GetNextKey() )
+	{
+		switch ( g_MapHackFunctionHash.Find( pSub->GetName() ) )
+		{
+			case MAPHACK_FUNCTION_SET:
+			case MAPHACK_FUNCTION_INCREMENT:
+			case MAPHACK_FUNCTION_DECREMENT:
+			case MAPHACK_FUNCTION_RAND:
+			case MAPHACK_FUNCTION_ASSIGN:
+			case MAPHACK_FUNCTION_GETPOS:
+			case MAPHACK_FUNCTION_GETANG:
+				return pSub->GetName();
+
+			default:
+				break;
+		}
+
+		if ( pSub->GetFirstSubKey() )
+		{
+			const char *pszFunction = MapHack_GetNonStaticFunction( pSub );
+			if ( pszFunction )
+				return pszFunction;
+		}
+	}
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Everything the transform reads besides the map, taken before it runs since
+// running changes the tree
+//-----------------------------------------------------------------------------
+unsigned int CMapHackManager::GetPreEntityHash( KeyValues *pPreEntities ) const
+{
+	// Includes can define variables too, so they're hashed as registered
+	unsigned int varsHash = 0;
+	FOR_EACH_DICT_FAST( m_dictVars, i )
+		varsHash += m_dictVars[i]->m_nDefinitionHash;
+
+	const unsigned int preEntitiesHash = MapHack_HashKeyValues( pPreEntities );
+
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	CRC32_ProcessBuffer( &crc, &preEntitiesHash, sizeof( preEntitiesHash ) );
+	CRC32_ProcessBuffer( &crc, &varsHash, sizeof( varsHash ) );
+	CRC32_Final( &crc );
+
+	return crc;
+}
+
+//-----------------------------------------------------------------------------
+bool CMapHackManager::LoadPatchedLump( const char *pszEntData, KeyValues *pPreEntities )
+{
+	char szLumpFile[MAX_PATH];
+	GetPatchedLumpFileName( STRING( gpGlobals->mapname ), szLumpFile, sizeof( szLumpFile ) );
+
+	const bool bPatched = sv_maphack_patched_lumps.GetBool() && filesystem->FileExists( szLumpFile );
+	if ( !bPatched && !MapHack_IsSharedCacheEnabled() )
+		return false;
+
+	const unsigned int lumpCRC = MapHack_GetEntityLumpCRC( pszEntData );
+	const unsigned int preEntityHash = GetPreEntityHash( pPreEntities );
+
+	if ( bPatched )
+	{
+		m_pNewMapData = MapHack_LoadLumpFile( szLumpFile, lumpCRC, preEntityHash );
+		if ( m_pNewMapData )
+		{
+			MapHack_DebugMsg( "Using patched entity lump \"%s\"\n", szLumpFile );
+			++m_Stats.m_iPatchedLumps;
+			return true;
+		}
+	}
+
+	if ( MapHack_IsSharedCacheEnabled() )
+	{
+		m_pNewMapData = MapHack_LoadSharedLump( lumpCRC, preEntityHash );
+		if ( m_pNewMapData )
+		{
+			MapHack_DebugMsg( "Using shared entity lump of \"%s\"\n", STRING( gpGlobals->mapname ) );
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+struct MapHackPatchJob_t
+{
+	char m_szMapName[MAX_MAP_NAME];
+	char m_szBSPFileName[MAX_PATH];
+	char m_szFileName[MAX_PATH];
+
+	// Results
+	char *m_pszEntData;
+	KeyValues *m_pKV;
+};
+
+//-----------------------------------------------------------------------------
+// Worker thread, file reads and parsing are what the maps don't share
+//-----------------------------------------------------------------------------
+static void MapHack_ReadPatchJob( MapHackPatchJob_t &job )
+{
+	CUtlBuffer buf;
+	if ( MapHack_ReadBSPEntityLump( job.m_szBSPFileName, buf ) )
+	{
+		job.m_pszEntData = new char[buf.TellPut()];
+		V_memcpy( job.m_pszEntData, buf.Base(), buf.TellPut() );
+	}
+
+	job.m_pKV = MapHack_LoadFile( job.m_szFileName, true );
+}
+
+//-----------------------------------------------------------------------------
+// Maps are read and their maphacks parsed on the thread pool, the transforms
+// run here one map at a time since they share the manager
+//-----------------------------------------------------------------------------
+void CMapHackManager::PatchMaps( const char *pszDirectory )
+{
+	if ( HasMapHack() || HasEntData() )
+	{
+		Warning( "MapHack WARNING: maphack_patch can't run while a maphack is loaded!\n" );
+		return;
+	}
+
+	const double flStart = Plat_FloatTime();
+
+	CUtlVector<MapHackPatchJob_t> vecJobs;
+
+	FileFindHandle_t hFind;
+	for ( const char *pszBSP = filesystem->FindFirstEx( CFmtStr( "%s/*.bsp", pszDirectory ), "GAME", &hFind ); pszBSP; pszBSP = filesystem->FindNext( hFind ) )
+	{
+		if ( filesystem->FindIsDirectory( hFind ) )
+			continue;
+
+		MapHackPatchJob_t &job = vecJobs[vecJobs.AddToTail()];
+		V_FileBase( pszBSP, job.m_szMapName, sizeof( job.m_szMapName ) );
+		V_snprintf( job.m_szBSPFileName, sizeof( job.m_szBSPFileName ), "%s/%s", pszDirectory, pszBSP );
+		GetMapHackFileName( job.m_szMapName, job.m_szFileName, sizeof( job.m_szFileName ) );
+		job.m_pszEntData = NULL;
+		job.m_pKV = NULL;
+
+		// Maps without a maphack have nothing to patch
+		if ( !filesystem->FileExists( job.m_szFileName ) )
+			vecJobs.RemoveMultipleFromTail( 1 );
+	}
+
+	filesystem->FindClose( hFind );
+
+	if ( vecJobs.Count() == 0 )
+	{
+		ConColorMsg( 0, CON_COLOR_MAPHACK, "MapHack: No maps with a maphack in \"%s\"\n", pszDirectory );
+		return;
+	}
+
+	ParallelProcess( vecJobs.Base(), vecJobs.Count(), MapHack_ReadPatchJob );
+
+	// Runs the same code as a level load
+	const bool bPreEntity = m_bPreEntity;
+	m_bPreEntity = true;
+
+	int patched = 0;
+	FOR_EACH_VEC( vecJobs, i )
+	{
+		MapHackPatchJob_t &job = vecJobs[i];
+
+		if ( !job.m_pKV )
+		{
+			Warning( "MapHack WARNING: Can't read \"%s\"!\n", job.m_szFileName );
+		}
+		else if ( !job.m_pszEntData )
+		{
+			Warning( "MapHack WARNING: Can't read the entity lump of \"%s\"!\n", job.m_szBSPFileName );
+			job.m_pKV->deleteThis();
+		}
+		else if ( PatchMap( job.m_szMapName, job.m_pszEntData, job.m_pKV ) )
+		{
+			++patched;
+		}
+
+		// PatchMap() took the tree
+		delete[] job.m_pszEntData;
+		job.m_pszEntData = NULL;
+		job.m_pKV = NULL;
+	}
+
+	m_bPreEntity = bPreEntity;
+
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "MapHack: Patched %d of %d maps with a maphack in %.2f seconds\n", patched, vecJobs.Count(), Plat_FloatTime() - flStart );
+}
+
+//-----------------------------------------------------------------------------
+// Takes the tree
+//-----------------------------------------------------------------------------
+bool CMapHackManager::PatchMap( const char *pszMapName, const char *pszEntData, KeyValues *pKV )
+{
+	KeyValues *pPreEntities = pKV->FindKey( "pre_entities" );
+	if ( !pPreEntities )
+	{
+		MapHack_DebugMsg( "\"%s\" has no pre_entities, nothing to patch\n", pszMapName );
+		pKV->deleteThis();
+		return false;
+	}
+
+	const char *pszFunction = MapHack_GetNonStaticFunction( pPreEntities );
+	if ( pszFunction )
+	{
+		Warning( "MapHack WARNING: Can't patch \"%s\", its pre_entities use %s!\n", pszMapName, pszFunction );
+		pKV->deleteThis();
+		return false;
+	}
+
+	// Variables and includes, no precaching without a map
+	if ( !LoadMapHack( pKV, MAPHACK_REGISTER_VARS | MAPHACK_LOAD_INCLUDES | MAPHACK_ADOPT ) )
+	{
+		pKV->deleteThis();
+		return false;
+	}
+
+	const unsigned int hash = GetPreEntityHash( pPreEntities );
+
+	BuildEntityList( pszEntData );
+	RunEntities( pPreEntities );
+	FinalizeEntData();
+	m_vecEntData.PurgeAndDeleteElements();
+
+	char szLumpFile[MAX_PATH];
+	GetPatchedLumpFileName( pszMapName, szLumpFile, sizeof( szLumpFile ) );
+
+	const bool bSuccess = m_pNewMapData && MapHack_WriteLumpFile( szLumpFile, m_pNewMapData, MapHack_GetEntityLumpCRC( pszEntData ), hash );
+	if ( bSuccess )
+		ConColorMsg( 0, CON_COLOR_MAPHACK, "MapHack: Patched \"%s\" into \"%s\"\n", pszMapName, szLumpFile );
+	else
+		Warning( "MapHack WARNING: Failed to write \"%s\"!\n", szLumpFile );
+
+	ResetMapHack();
+
+	m_pEntityIndex->Purge();
+	delete[] m_pNewMapData;
+	m_pNewMapData = NULL;
+
 	return bSuccess;
 }
 
 //-----------------------------------------------------------------------------
-void CMapHackManager::ReloadMapHack()
+// Worker thread, reads the includes the same way LoadIncludes() does
+//-----------------------------------------------------------------------------
+static void MapHack_PreloadIncludes( MapHackPreload_t *pPreload, KeyValues *pKV )
 {
-	if ( !HasMapHack() )
+	KeyValues *pIncludes = pKV->FindKey( "includes" );
+	if ( !pIncludes )
 		return;
 
-	ResetMapHack( false );
+	for ( KeyValues *pValue = pIncludes->GetFirstValue(); pValue; pValue = pValue->GetNextValue() )
+	{
+		const char *pszFilename = pValue->GetString();
 
-	LoadIncludes( m_pMapHack->FindKey( "includes" ), MAPHACK_LOAD_POST_ENTITY );
-	RegisterVariables( m_pMapHack->FindKey( "vars" ) );
-	RegisterEvents( m_pMapHack->FindKey( "events" ), m_pMapHack );
-	RunEntities( m_pMapHack->FindKey( "entities" ) );
+		// Read already, or a cycle
+		if ( pPreload->m_dictIncludes.IsValidIndex( pPreload->m_dictIncludes.Find( pszFilename ) ) )
+			continue;
+
+		// Left to the level load, it will complain
+		if ( !filesystem->FileExists( pszFilename ) )
+			continue;
+
+		KeyValues *pInclude = MapHack_LoadFile( pszFilename, false );
+		if ( !pInclude )
+			continue;
+
+		MapHackFileStamp_t stamp;
+		MapHack_GetFileStamp( pszFilename, stamp );
+
+		pPreload->m_dictIncludes.Insert( pszFilename, pInclude );
+		pPreload->m_dictFileStamps.Insert( pszFilename, stamp );
+
+		MapHack_PreloadIncludes( pPreload, pInclude );
+	}
 }
 
 //-----------------------------------------------------------------------------
-void CMapHackManager::LoadIncludes( KeyValues *pKV, int loadFlags )
+static unsigned MapHack_PreloadThread( void *pParam )
 {
+	MapHackPreload_t *pPreload = (MapHackPreload_t *)pParam;
+
+	// KV parser requires that we allow escape characters
+	KeyValues *pKV = MapHack_LoadFile( pPreload->m_szFileName, true );
 	if ( !pKV )
-		return;
+		return 0;
+
+	MapHackFileStamp_t stamp;
+	MapHack_GetFileStamp( pPreload->m_szFileName, stamp );
+
+	pPreload->m_pKV = pKV;
+	pPreload->m_dictFileStamps.Insert( pPreload->m_szFileName, stamp );
+
+	MapHack_PreloadIncludes( pPreload, pKV );
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+bool CMapHackManager::PreloadMapHack( const char *pszMapName )
+{
+	// One at a time
+	PurgePreload();
 
-	KeyValues *pValue = pKV->GetFirstValue();
-	while ( pValue )
+	if ( !pszMapName || pszMapName[0] == '\0' )
+		return false;
+
+	m_pPreload = new MapHackPreload_t();
+	GetMapHackFileName( pszMapName, m_pPreload->m_szFileName, sizeof( m_pPreload->m_szFileName ) );
+
+	m_hPreloadThread = CreateSimpleThread( MapHack_PreloadThread, m_pPreload );
+	if ( !m_hPreloadThread )
 	{
-		const char *pszFilename = pValue->GetString();
+		PurgePreload();
+		return false;
+	}
 
-		if ( !filesystem->FileExists( pszFilename ) )
-		{
-			DevWarning( "MapHack WARNING: Missing include file \"%s\"\n", pszFilename );
-			pValue = pKV->GetNextValue();
-			continue;
-		}
+	MapHack_DebugMsg( "Preloading \"%s\"\n", m_pPreload->m_szFileName );
+	return true;
+}
 
-		KeyValues *pInclude = new KeyValues( "maphack" );
-		if ( pInclude->LoadFromFile( filesystem, pszFilename ) )
-		{
-			MapHack_DebugMsg( "Including \"%s\"\n", pszFilename );
-			loadFlags |= MAPHACK_INCLUDE;
-			LoadMapHack( pInclude, loadFlags );
-		}
+//-----------------------------------------------------------------------------
+// Returns the preloaded tree if it is for this file and nothing has changed
+// on disk since, it stays owned by the preload until a load adopts it
+//-----------------------------------------------------------------------------
+KeyValues *CMapHackManager::AdoptPreload( const char *pszFileName )
+{
+	if ( !m_pPreload )
+		return NULL;
+
+	// Still parsing is still faster than starting over
+	if ( m_hPreloadThread )
+	{
+		ThreadJoin( m_hPreloadThread );
+		ReleaseThreadHandle( m_hPreloadThread );
+		m_hPreloadThread = NULL;
+	}
+
+	bool bValid = ( m_pPreload->m_pKV != NULL ) && ( V_stricmp( m_pPreload->m_szFileName, pszFileName ) == 0 );
+
+	FOR_EACH_DICT_FAST( m_pPreload->m_dictFileStamps, i )
+	{
+		if ( !bValid )
+			break;
+
+		const MapHackFileStamp_t &recorded = m_pPreload->m_dictFileStamps[i];
+
+		MapHackFileStamp_t stamp;
+		bValid = MapHack_GetFileStamp( m_pPreload->m_dictFileStamps.GetElementName( i ), stamp ) &&
+			stamp.m_Time == recorded.m_Time && stamp.m_Size == recorded.m_Size;
+	}
+
+	if ( !bValid )
+	{
+		PurgePreload();
+		return NULL;
+	}
+
+	// Includes go through the cache like any other
+	FOR_EACH_DICT_FAST( m_pPreload->m_dictIncludes, i )
+	{
+		const char *pszFilename = m_pPreload->m_dictIncludes.GetElementName( i );
+		AddCachedInclude( pszFilename, m_pPreload->m_dictIncludes[i], m_pPreload->m_dictFileStamps[m_pPreload->m_dictFileStamps.Find( pszFilename )] );
+	}
+
+	m_pPreload->m_dictIncludes.RemoveAll();
 
-		pInclude->deleteThis();
+	MapHack_DebugMsg( "Using preloaded \"%s\"\n", pszFileName );
+	return m_pPreload->m_pKV;
+}
 
-		pValue = pValue->GetNextValue();
+//-----------------------------------------------------------------------------
+void CMapHackManager::PurgePreload()
+{
+	if ( m_hPreloadThread )
+	{
+		ThreadJoin( m_hPreloadThread );
+		ReleaseThreadHandle( m_hPreloadThread );
+		m_hPreloadThread = NULL;
 	}
+
+	delete m_pPreload;
+	m_pPreload = NULL;
 }
 
 //-----------------------------------------------------------------------------
@@ -993,6 +2649,15 @@ void CMapHackManager::RegisterVariables( KeyValues *pKV )
 					if ( sscanf( pszValue, "%d %d %d", &clr[0], &clr[1], &clr[2] ) == 3 )
 						pVar->SetColor( Color( clr[0], clr[1], clr[2] ) );
 					break;
+				case MAPHACK_TYPE_VECTOR:
+				{
+					pVar->m_Type = MAPHACK_TYPE_VECTOR;
+
+					Vector vec( 0, 0, 0 );
+					sscanf( pszValue, "%f %f %f", &vec.x, &vec.y, &vec.z );
+					pVar->SetVector( vec );
+					break;
+				}
 
 				default:
 					pVar->SetValue( pszValue );
@@ -1007,53 +2672,347 @@ void CMapHackManager::RegisterVariables( KeyValues *pKV )
 			continue;
 		}
 
+		pVar->m_nDefinitionHash = MapHack_HashKeyValues( pVariable );
+
 		// Insert it
 		m_dictVars.Insert( pVar->m_szName, pVar );
+		SnapshotVariable( pVar );
 
 		pVariable = pVariable->GetNextTrueSubKey();
 	}
+
+	// Names that used to be plain strings might be variables now
+	PurgeExpressions();
+}
+
+//-----------------------------------------------------------------------------
+static const char *g_pszMapHackPrecacheTypes[] =
+{
+	"model",
+	"material",
+	"sound",
+	"particle",
+	"entity",
+};
+
+COMPILE_TIME_ASSERT( ARRAYSIZE( g_pszMapHackPrecacheTypes ) == MAPHACK_PRECACHE_COUNT );
+
+//-----------------------------------------------------------------------------
+static MapHackPrecacheType_t MapHack_GetPrecacheType( const char *pszType )
+{
+	for ( int i = 0; i < MAPHACK_PRECACHE_COUNT; ++i )
+	{
+		if ( FStrEq( pszType, g_pszMapHackPrecacheTypes[i] ) )
+			return (MapHackPrecacheType_t)i;
+	}
+
+	return MAPHACK_PRECACHE_INVALID;
+}
+
+//-----------------------------------------------------------------------------
+static void MapHack_PrecacheByType( MapHackPrecacheType_t type, const char *pszName )
+{
+	switch ( type )
+	{
+		case MAPHACK_PRECACHE_MODEL:
+			CBaseEntity::PrecacheModel( pszName );
+			MapHack_DebugMsg( "Precached model \"%s\"\n", pszName );
+			break;
+
+		case MAPHACK_PRECACHE_MATERIAL:
+			PrecacheMaterial( pszName );
+			MapHack_DebugMsg( "Precached material \"%s\"\n", pszName );
+			break;
+
+		case MAPHACK_PRECACHE_SOUND:
+			CBaseEntity::PrecacheScriptSound( pszName );
+			MapHack_DebugMsg( "Precached sound \"%s\"\n", pszName );
+			break;
+
+		case MAPHACK_PRECACHE_PARTICLE:
+			PrecacheParticleSystem( pszName );
+			MapHack_DebugMsg( "Precached particle system \"%s\"\n", pszName );
+			break;
+
+		case MAPHACK_PRECACHE_ENTITY:
+			UTIL_PrecacheOther( pszName );
+			MapHack_DebugMsg( "Precached entity \"%s\"\n", pszName );
+			break;
+
+		default:
+			break;
+	}
 }
 
+//-----------------------------------------------------------------------------
+// Precache blocks are hoisted to load, this only catches what the scan missed
 //-----------------------------------------------------------------------------
 void CMapHackManager::Precache( KeyValues *pKV )
 {
 	if ( !pKV )
 		return;
 
-	KeyValues *pPrecacheVal = pKV->GetFirstValue();
-	while ( pPrecacheVal )
+	for ( KeyValues *pPrecacheVal = pKV->GetFirstValue(); pPrecacheVal; pPrecacheVal = pPrecacheVal->GetNextValue() )
+	{
+		const MapHackPrecacheType_t type = MapHack_GetPrecacheType( pPrecacheVal->GetName() );
+		if ( type != MAPHACK_PRECACHE_INVALID )
+			PrecacheOnce( type, pPrecacheVal->GetString() );
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::PrecacheOnce( MapHackPrecacheType_t type, const char *pszName )
+{
+	if ( !pszName || pszName[0] == '\0' )
+		return;
+
+	CUtlDict<bool> &dict = m_dictPrecache[type];
+
+	int idx = dict.Find( pszName );
+	if ( dict.IsValidIndex( idx ) && dict[idx] )
+		return;
+
+	if ( !dict.IsValidIndex( idx ) )
+		idx = dict.Insert( pszName, false );
+
+	dict[idx] = true;
+	MapHack_PrecacheByType( type, pszName );
+
+	if ( !IsPreEntity() )
+	{
+		++m_Stats.m_iLatePrecaches;
+		MapHack_DebugMsg( "Late precache of %s \"%s\"\n", g_pszMapHackPrecacheTypes[type], pszName );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Blocks that are only compared against existing entities, nothing spawns
+// with their keys
+//-----------------------------------------------------------------------------
+static bool MapHack_IsMatchBlock( const KeyValues *pParent, const char *pszName )
+{
+	if ( FStrEq( pszName, "$filter" ) || FStrEq( pszName, "$remove_all" ) )
+		return true;
+
+	// Only inserts and replacements of $modify end up on the entity
+	return FStrEq( pParent->GetName(), "$modify" ) && ( FStrEq( pszName, "match" ) || FStrEq( pszName, "delete" ) );
+}
+
+//-----------------------------------------------------------------------------
+// Gathers every constant asset name in the tree, variables can't be known
+// until they are used
+//-----------------------------------------------------------------------------
+void CMapHackManager::CollectPrecache( KeyValues *pKV, bool bPrecacheBlock, CUtlVector<MapHackPrecacheEntry_t> *pManifest )
+{
+	if ( !pKV )
+		return;
+
+	for ( KeyValues *pNode = pKV->GetFirstSubKey(); pNode; pNode = pNode->GetNextKey() )
 	{
-		const char *pszType = pPrecacheVal->GetName();
-		const char *pszName = pPrecacheVal->GetString();
+		const char *pszName = pNode->GetName();
 
-		if ( FStrEq( pszType, "model" ) )
+		if ( pNode->GetFirstSubKey() )
 		{
-			CBaseEntity::PrecacheModel( pszName );
-			MapHack_DebugMsg( "Precached model \"%s\"\n", pszName );
+			if ( MapHack_IsMatchBlock( pKV, pszName ) )
+				continue;
+
+			if ( FStrEq( pszName, "$playsound" ) )
+			{
+				const char *pszSound = pNode->GetString( "name" );
+				if ( pszSound[0] != '%' )
+					AddPrecache( MAPHACK_PRECACHE_SOUND, pszSound, pManifest );
+			}
+
+			// The root block and ":precache" events list type and name pairs
+			int dataType = -1;
+			MapHack_GetLabel( pszName, &dataType );
+			CollectPrecache( pNode, FStrEq( pszName, "precache" ) || dataType == 1, pManifest );
+			continue;
 		}
-		else if ( FStrEq( pszType, "material" ) )
+
+		const char *pszValue = pNode->GetString();
+		if ( pszValue[0] == '%' )
+			continue;
+
+		if ( bPrecacheBlock )
 		{
-			PrecacheMaterial( pszName );
-			MapHack_DebugMsg( "Precached material \"%s\"\n", pszName );
+			const MapHackPrecacheType_t type = MapHack_GetPrecacheType( pszName );
+			if ( type != MAPHACK_PRECACHE_INVALID )
+				AddPrecache( type, pszValue, pManifest );
 		}
-		else if ( FStrEq( pszType, "sound" ) )
+		else if ( FStrEq( pszName, "model" ) )
 		{
-			CBaseEntity::PrecacheScriptSound( pszName );
-			MapHack_DebugMsg( "Precached sound \"%s\"\n", pszName );
+			// Brush models are part of the map
+			if ( pszValue[0] != '*' )
+				AddPrecache( MAPHACK_PRECACHE_MODEL, pszValue, pManifest );
 		}
-		else if ( FStrEq( pszType, "particle" ) )
+		else if ( FStrEq( pszName, "effect_name" ) )
 		{
-			PrecacheParticleSystem( pszName );
-			MapHack_DebugMsg( "Precached particle system \"%s\"\n", pszName );
+			AddPrecache( MAPHACK_PRECACHE_PARTICLE, pszValue, pManifest );
 		}
-		else if ( FStrEq( pszType, "entity" ) )
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::AddPrecache( MapHackPrecacheType_t type, const char *pszName, CUtlVector<MapHackPrecacheEntry_t> *pManifest )
+{
+	if ( pszName[0] == '\0' )
+		return;
+
+	// Compiling, keep the same names the dictionary would
+	if ( pManifest )
+	{
+		FOR_EACH_VEC( *pManifest, i )
 		{
-			UTIL_PrecacheOther( pszName );
-			MapHack_DebugMsg( "Precached entity \"%s\"\n", pszName );
+			if ( pManifest->Element( i ).m_Type == type && V_stricmp( pManifest->Element( i ).m_Name.Get(), pszName ) == 0 )
+				return;
 		}
 
-		pPrecacheVal = pPrecacheVal->GetNextValue();
+		MapHackPrecacheEntry_t &entry = pManifest->Element( pManifest->AddToTail() );
+		entry.m_Type = type;
+		entry.m_Name = pszName;
+		return;
+	}
+
+	if ( !m_dictPrecache[type].IsValidIndex( m_dictPrecache[type].Find( pszName ) ) )
+		m_dictPrecache[type].Insert( pszName, false );
+}
+
+//-----------------------------------------------------------------------------
+// Files the engine will open for a precache, best guess
+//-----------------------------------------------------------------------------
+static void MapHack_AddWarmupFiles( MapHackPrecacheType_t type, const char *pszName, CUtlVector<CUtlString> &vecFiles )
+{
+	char szBase[MAX_PATH];
+
+	switch ( type )
+	{
+		case MAPHACK_PRECACHE_MODEL:
+		{
+			// Sprites are materials
+			const char *pszExt = V_GetFileExtension( pszName );
+			if ( pszExt && ( FStrEq( pszExt, "vmt" ) || FStrEq( pszExt, "spr" ) ) )
+			{
+				V_StripExtension( pszName, szBase, sizeof( szBase ) );
+				vecFiles.AddToTail( CUtlString( CFmtStr( "materials/%s.vmt", szBase ) ) );
+				vecFiles.AddToTail( CUtlString( CFmtStr( "materials/%s.vtf", szBase ) ) );
+				break;
+			}
+
+			V_StripExtension( pszName, szBase, sizeof( szBase ) );
+			vecFiles.AddToTail( CUtlString( CFmtStr( "%s.mdl", szBase ) ) );
+			vecFiles.AddToTail( CUtlString( CFmtStr( "%s.vvd", szBase ) ) );
+			vecFiles.AddToTail( CUtlString( CFmtStr( "%s.dx90.vtx", szBase ) ) );
+			vecFiles.AddToTail( CUtlString( CFmtStr( "%s.phy", szBase ) ) );
+			break;
+		}
+
+		case MAPHACK_PRECACHE_MATERIAL:
+			V_StripExtension( pszName, szBase, sizeof( szBase ) );
+			vecFiles.AddToTail( CUtlString( CFmtStr( "materials/%s.vmt", szBase ) ) );
+			vecFiles.AddToTail( CUtlString( CFmtStr( "materials/%s.vtf", szBase ) ) );
+			break;
+
+		case MAPHACK_PRECACHE_SOUND:
+		{
+			// Script sounds, every wave they might play
+			const int soundIndex = soundemitterbase->GetSoundIndex( pszName );
+			if ( !soundemitterbase->IsValidIndex( soundIndex ) )
+				break;
+
+			CSoundParametersInternal *pInternal = soundemitterbase->InternalGetParametersForSound( soundIndex );
+			if ( !pInternal )
+				break;
+
+			for ( int i = 0; i < pInternal->NumSoundNames(); ++i )
+			{
+				const char *pszWave = soundemitterbase->GetWaveName( pInternal->GetSoundNames()[i].symbol );
+				vecFiles.AddToTail( CUtlString( CFmtStr( "sound/%s", PSkipSoundChars( pszWave ) ) ) );
+			}
+			break;
+		}
+
+		// Particles come from the manifest, entities precache their own
+		default:
+			break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Reads everything that is about to be precached on the filesystem's async
+// thread, the data is thrown away but the files end up in the OS cache
+//-----------------------------------------------------------------------------
+void CMapHackManager::WarmPrecache()
+{
+	if ( !sv_maphack_precache_warmup.GetBool() )
+		return;
+
+	CUtlVector<CUtlString> vecFiles;
+
+	for ( int type = 0; type < MAPHACK_PRECACHE_COUNT; ++type )
+	{
+		const CUtlDict<bool> &dict = m_dictPrecache[type];
+		FOR_EACH_DICT_FAST( dict, i )
+		{
+			if ( !dict[i] )
+				MapHack_AddWarmupFiles( (MapHackPrecacheType_t)type, dict.GetElementName( i ), vecFiles );
+		}
+	}
+
+	if ( vecFiles.Count() == 0 )
+		return;
+
+	CUtlVector<FileAsyncRequest_t> vecRequests;
+	vecRequests.SetCount( vecFiles.Count() );
+
+	for ( int i = 0; i < vecFiles.Count(); ++i )
+	{
+		FileAsyncRequest_t &request = vecRequests[i];
+		request.pszFilename = vecFiles[i].Get();
+		request.pszPathID = "GAME";
+		request.flags = FSASYNC_FLAGS_FREEDATAPTR;
+		request.priority = -1;
+	}
+
+	// The filesystem copies the requests, no need to keep them around
+	filesystem->AsyncReadMultiple( vecRequests.Base(), vecRequests.Count() );
+
+	m_Stats.m_iWarmupFiles += vecRequests.Count();
+	MapHack_DebugMsg( "Warming up %d precache files\n", vecRequests.Count() );
+}
+
+//-----------------------------------------------------------------------------
+// One batch for the whole maphack and its includes
+//-----------------------------------------------------------------------------
+void CMapHackManager::FlushPrecache()
+{
+	int count = 0;
+
+	for ( int type = 0; type < MAPHACK_PRECACHE_COUNT; ++type )
+	{
+		CUtlDict<bool> &dict = m_dictPrecache[type];
+		FOR_EACH_DICT_FAST( dict, i )
+		{
+			if ( dict[i] )
+				continue;
+
+			MapHack_PrecacheByType( (MapHackPrecacheType_t)type, dict.GetElementName( i ) );
+			dict[i] = true;
+			++count;
+		}
 	}
+
+	m_Stats.m_iHoistedPrecaches += count;
+
+	if ( count > 0 )
+		MapHack_DebugMsg( "Precached %d assets in one batch\n", count );
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::PurgePrecache()
+{
+	for ( int type = 0; type < MAPHACK_PRECACHE_COUNT; ++type )
+		m_dictPrecache[type].Purge();
 }
 
 //-----------------------------------------------------------------------------
@@ -1077,6 +3036,7 @@ void CMapHackManager::RegisterEvents( KeyValues *pKV, KeyValues *pMapHack )
 			MapHackEvent_t *pEvent = new MapHackEvent_t();
 			V_strcpy_safe( pEvent->m_szName, pszName );
 			pEvent->m_Type = GetEventTypeByString( pKVEvent->GetString( "type", "EVENT_TRIGGER" ) );
+			pEvent->m_nDefinitionHash = MapHack_HashKeyValues( pKVEvent );
 
 			switch ( pEvent->m_Type )
 			{
@@ -1112,6 +3072,9 @@ void CMapHackManager::RegisterEvents( KeyValues *pKV, KeyValues *pMapHack )
 						pEnt = GetFirstEntityByClassName( pKVEvent->GetString( "classname" ) );
 					}
 
+					// Round restarts look it up again
+					V_strcpy_safe( pEvent->m_szOutputClassName, pKVEvent->GetString( "classname" ) );
+
 					if ( pEnt )
 					{
 						pEvent->m_hOutputEnt = pEnt;
@@ -1148,6 +3111,7 @@ void CMapHackManager::RegisterEvents( KeyValues *pKV, KeyValues *pMapHack )
 
 			MapHack_DebugMsg( "Registered event \"%s\"\n", pEvent->m_szName );
 			m_dictEvents.Insert( pEvent->m_szName, pEvent );
+			SnapshotEvent( pEvent );
 
 			pKVEvent = pKVEvent->GetNextTrueSubKey();
 		}
@@ -1171,6 +3135,7 @@ void CMapHackManager::RegisterEvents( KeyValues *pKV, KeyValues *pMapHack )
 
 				MapHack_DebugMsg( "Registered event \"%s\" (default properties)\n", pEvent->m_szName );
 				m_dictEvents.Insert( pEvent->m_szName, pEvent );
+				SnapshotEvent( pEvent );
 			}
 		}
 
@@ -1224,250 +3189,605 @@ void CMapHackManager::RegisterEvents( KeyValues *pKV, KeyValues *pMapHack )
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Runs the block and everything it nests to completion
 //-----------------------------------------------------------------------------
 void CMapHackManager::RunEntities( KeyValues *pKV )
 {
 	if ( !pKV )
 		return;
 
+	MapHackExecContext_t context;
+	PushEntities( &context, pKV );
+	ExecuteContext( &context );
+}
+
+//-----------------------------------------------------------------------------
+// Nested blocks continue on the running stack, anything else is an event body
+// and runs within the tick budget
+//-----------------------------------------------------------------------------
+void CMapHackManager::QueueEntities( KeyValues *pKV )
+{
+	if ( !pKV )
+		return;
+
+	if ( m_pExecContext )
+	{
+		PushEntities( m_pExecContext, pKV );
+		return;
+	}
+
+	MapHackExecContext_t context;
+	context.m_bBudgeted = !IsPreEntity();
+	PushEntities( &context, pKV );
+
+	if ( !ExecuteContext( &context ) )
+	{
+		// Out of budget, continue on the next tick
+		MapHackExecContext_t *pSuspended = new MapHackExecContext_t();
+		pSuspended->m_vecFrames.Swap( context.m_vecFrames );
+		pSuspended->m_bBudgeted = true;
+
+		m_vecSuspendedContexts.AddToTail( pSuspended );
+		++m_Stats.m_iDeferrals;
+
+		MapHack_DebugMsg( "Event body out of budget, deferred to the next tick\n" );
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::PushEntities( MapHackExecContext_t *pContext, KeyValues *pKV )
+{
 	// Safety net in case of infinite recursion by poorly written scripts
-	++g_iMapHackEntitiesRecursionLevel;
-	if ( g_iMapHackEntitiesRecursionLevel > MAPHACK_ENTITIES_MAX_RECURSION_LEVEL )
+	if ( pContext->m_vecFrames.Count() >= MAPHACK_ENTITIES_MAX_RECURSION_LEVEL )
 	{
 		Warning( "MapHack WARNING: Recursion level over the limit, terminating.\n" );
-		g_iMapHackEntitiesRecursionLevel = 0;
+		ReleaseFrameBatches( pContext->m_vecFrames, true );
 		return;
 	}
 
-	// Do a traverse here, key names are entity classnames
-	KeyValues *pKVEnt = pKV->GetFirstTrueSubKey();
-	while ( pKVEnt )
+	MapHackExecFrame_t &frame = pContext->m_vecFrames[pContext->m_vecFrames.AddToTail()];
+	frame.m_pBlock = pKV;
+	frame.m_pNextKey = pKV->GetFirstTrueSubKey();
+	frame.m_bQueueSpawns = !IsPreEntity() && ( sv_maphack_spawn_queue.GetBool() || pKV->GetBool( "spawn_queue" ) );
+	frame.m_pSpawnBatch = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Returns false if the budget ran out before the stack was empty
+//-----------------------------------------------------------------------------
+bool CMapHackManager::ExecuteContext( MapHackExecContext_t *pContext )
+{
+	pContext->m_pParent = m_pExecContext;
+	m_pExecContext = pContext;
+
+	const double flSliceStart = Plat_FloatTime();
+	int instructions = 0;
+	bool bFinished = true;
+
+	while ( pContext->m_vecFrames.Count() > 0 )
 	{
-		const char *pszName = pKVEnt->GetName();
-		const bool bIsFunction = ( pszName[0] == '$' );
+		MapHackExecFrame_t &frame = pContext->m_vecFrames.Tail();
 
-		// Pre-entities are always first!
-		if ( IsPreEntity() && !bIsFunction )
+		KeyValues *pKVEnt = frame.m_pNextKey;
+		if ( !pKVEnt )
 		{
-			// Insert new entity to ent data
-			KeyValues *pEntityKeyValues;
+			// Block has finished, spawn what it created
+			FlushPendingSpawns();
 
-			// First version of MapHack required the keyvalues field
-			KeyValues *pLegacyKeyValues = pKVEnt->FindKey( "keyvalues" );
-			if ( pLegacyKeyValues )
-			{
-				pEntityKeyValues = pLegacyKeyValues;
+			if ( frame.m_pSpawnBatch )
+				SealSpawnBatch( frame.m_pSpawnBatch );
 
-				// Set positions
-				pEntityKeyValues->SetString( "origin", pKVEnt->GetString( "origin" ) );
-				pEntityKeyValues->SetString( "angles", pKVEnt->GetString( "angles" ) );
-			}
-			else
-			{
-				pEntityKeyValues = pKVEnt;
-			}
+			pContext->m_vecFrames.RemoveMultipleFromTail( 1 );
+
+			if ( !IsPreEntity() )
+				UpdateOutputEvents();
+
+			continue;
+		}
+
+		// Always run at least one key, so deferred bodies make progress
+		if ( pContext->m_bBudgeted && instructions > 0 && IsExecBudgetExhausted( flSliceStart, instructions ) )
+		{
+			bFinished = false;
+			break;
+		}
+
+		// Advance first, the key may push a block of its own
+		frame.m_pNextKey = pKVEnt->GetNextTrueSubKey();
+		++instructions;
+
+		RunEntityKey( pKVEnt );
+	}
+
+	// Suspended or terminated mid-block
+	FlushPendingSpawns();
+
+	if ( pContext->m_bBudgeted )
+	{
+		m_flExecTimeUsed += Plat_FloatTime() - flSliceStart;
+		m_iExecInstructionsUsed += instructions;
+	}
+
+	m_Stats.m_iInstructions += instructions;
+
+	m_pExecContext = pContext->m_pParent;
+	pContext->m_pParent = NULL;
+
+	return bFinished;
+}
+
+//-----------------------------------------------------------------------------
+bool CMapHackManager::IsExecBudgetExhausted( const double flSliceStart, const int instructions ) const
+{
+	const int maxInstructions = sv_maphack_exec_budget_instructions.GetInt();
+	if ( maxInstructions > 0 && ( m_iExecInstructionsUsed + instructions ) >= maxInstructions )
+		return true;
+
+	const float flBudgetMs = sv_maphack_exec_budget_ms.GetFloat();
+	if ( flBudgetMs > 0.0f && ( m_flExecTimeUsed + Plat_FloatTime() - flSliceStart ) * 1000.0 >= flBudgetMs )
+		return true;
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::ResumeSuspendedContexts()
+{
+	// Oldest first
+	while ( m_vecSuspendedContexts.Count() > 0 )
+	{
+		// Take it off the list while running, a reset may purge the list
+		MapHackExecContext_t *pContext = m_vecSuspendedContexts[0];
+		m_vecSuspendedContexts.Remove( 0 );
+
+		if ( !ExecuteContext( pContext ) )
+		{
+			// Out of budget again, keep it first in line
+			m_vecSuspendedContexts.InsertBefore( 0, pContext );
+			++m_Stats.m_iDeferrals;
+			break;
+		}
+
+		delete pContext;
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::PurgeExecContexts()
+{
+	// Running blocks stop after the current key
+	for ( MapHackExecContext_t *pContext = m_pExecContext; pContext; pContext = pContext->m_pParent )
+		ReleaseFrameBatches( pContext->m_vecFrames, false );
+
+	FOR_EACH_VEC( m_vecSuspendedContexts, i )
+		ReleaseFrameBatches( m_vecSuspendedContexts[i]->m_vecFrames, false );
+
+	m_vecSuspendedContexts.PurgeAndDeleteElements();
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::RunEntityKey( KeyValues *pKVEnt )
+{
+	const char *pszName = pKVEnt->GetName();
+	const bool bIsFunction = ( pszName[0] == '$' );
+
+	// Pre-entities are always first!
+	if ( IsPreEntity() && !bIsFunction )
+	{
+		// Insert new entity to ent data
+		KeyValues *pEntityKeyValues;
+
+		// First version of MapHack required the keyvalues field
+		KeyValues *pLegacyKeyValues = pKVEnt->FindKey( "keyvalues" );
+		if ( pLegacyKeyValues )
+		{
+			pEntityKeyValues = pLegacyKeyValues;
+
+			// Set positions
+			pEntityKeyValues->SetString( "origin", pKVEnt->GetString( "origin" ) );
+			pEntityKeyValues->SetString( "angles", pKVEnt->GetString( "angles" ) );
+		}
+		else
+		{
+			pEntityKeyValues = pKVEnt;
+		}
 
-			// Set classname
-			pEntityKeyValues->SetString( "classname", pszName );
+		// Set classname
+		pEntityKeyValues->SetString( "classname", pszName );
 
-			// Handle connections
-			KeyValues *pConnections = pEntityKeyValues->FindKey( "connections" );
-			if ( pConnections )
+		// Handle connections
+		KeyValues *pConnections = pEntityKeyValues->FindKey( "connections" );
+		if ( pConnections )
+		{
+			// Clone keys and remove, we don't want this block in entdata!
+			for ( KeyValues *pSub = pConnections->GetFirstValue(); pSub; pSub = pSub->GetNextValue() )
 			{
-				// Clone keys and remove, we don't want this block in entdata!
-				for ( KeyValues *pSub = pConnections->GetFirstValue(); pSub; pSub = pSub->GetNextValue() )
+				KeyValues *pNewKey = pEntityKeyValues->CreateNewKey();
+				if ( pNewKey )
 				{
-					KeyValues *pNewKey = pEntityKeyValues->CreateNewKey();
-					if ( pNewKey )
-					{
-						pNewKey->SetName( pSub->GetName() );
-						pNewKey->SetStringValue( pSub->GetString() );
-					}
+					pNewKey->SetName( pSub->GetName() );
+					pNewKey->SetStringValue( pSub->GetString() );
 				}
-
-				pEntityKeyValues->RemoveSubKey( pConnections );
-				pConnections->deleteThis();
 			}
 
-			// Export keyvalues as text
-			CUtlBuffer buf = CUtlBuffer( 0, 0, CUtlBuffer::TEXT_BUFFER );
-			pEntityKeyValues->RecursiveSaveToFile( buf, 0, false, true );
+			pEntityKeyValues->RemoveSubKey( pConnections );
+			pConnections->deleteThis();
+		}
 
-			// Rid of the root key name to mimic BSP map lump, complete hack
-			const char *pszEntData = strchr( (char *)buf.Base(), '{' ) + 1;
+		// Export keyvalues as text
+		CUtlBuffer buf = CUtlBuffer( 0, 0, CUtlBuffer::TEXT_BUFFER );
+		pEntityKeyValues->RecursiveSaveToFile( buf, 0, false, true );
 
-			// List it
-			const int entBlockSize = V_strlen( pszEntData ) + MAPHACK_ENTDATA_BLOCK_PADDING;
-			MapHackEntityData_t *pEntData = ParseEntityData( pszEntData, entBlockSize );
-			if ( pEntData )
+		// Rid of the root key name to mimic BSP map lump, complete hack
+		const char *pszEntData = strchr( (char *)buf.Base(), '{' ) + 1;
+
+		// List it
+		const int entBlockSize = V_strlen( pszEntData ) + MAPHACK_ENTDATA_BLOCK_PADDING;
+		MapHackEntityData_t *pEntData = ParseEntityData( pszEntData, entBlockSize );
+		if ( pEntData )
+		{
+			m_vecEntData.AddToTail( pEntData );
+		}
+	}
+
+	// Look for function keys first, those start with '$'
+	if ( bIsFunction )
+	{
+		// Functions expect the entities above them to exist
+		FlushPendingSpawns();
+
+		const MapHackFunctionType_t type = GetFunctionTypeByString( pszName );
+		switch ( type )
+		{
+			// Variables
+			case MAPHACK_FUNCTION_IF:
+				KvIfCond( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_SET:
+				KvSetVariable( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_INCREMENT:
+				KvIncrement( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_DECREMENT:
+				KvDecrement( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_RAND:
+				KvRandVariable( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_ASSIGN:
+				KvAssign( pKVEnt );
+				break;
+
+			// Basic functions
+			case MAPHACK_FUNCTION_CONSOLE:
+				KvConsole( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_FIRE:
+				KvFireInput( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_EDIT:
+				KvEdit( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_EDIT_ALL:
+				KvEditAll( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_MODIFY:
+				KvModify( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_FILTER:
+				KvFilter( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_TRIGGER:
+				KvTriggerEvent( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_START:
+				KvStartEvent( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_STOP:
+				KvStopEvent( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_RESPAWN:
+				KvRespawnEntity( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_REMOVE:
+				KvRemoveEntity( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_REMOVE_ALL:
+				KvRemoveAllEntities( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_REMOVE_CONNECTIONS:
+				KvRemoveConnections( pKVEnt );
+				break;
+
+			// Entity positions
+			case MAPHACK_FUNCTION_GETPOS:
+				KvGetPos( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_SETPOS:
+				KvSetPos( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_GETANG:
+				KvGetAng( pKVEnt );
+				break;
+			case MAPHACK_FUNCTION_SETANG:
+				KvSetAng( pKVEnt );
+				break;
+
+			// Entity datadesc manipulation
+			case MAPHACK_FUNCTION_EDIT_FIELD:
+				KvEditField( pKVEnt );
+				break;
+
+			// Extra functions
+			case MAPHACK_FUNCTION_PLAYSOUND:
+				KvPlaySound( pKVEnt );
+				break;
+
+			case MAPHACK_FUNCTION_SCRIPT:
+#if 0 // If your mod has VScript, toggle this
+				KvScript( pKVEnt );
+#endif
+				break;
+
+			default:
+				Warning( "MapHack WARNING: Invalid function key \"%s\"!\n", pszName );
+				break;
+		}
+	}
+	else
+	{
+		if ( !IsPreEntity() )
+		{
+			MapHackExecFrame_t &frame = m_pExecContext->m_vecFrames.Tail();
+			if ( frame.m_bQueueSpawns )
+			{
+				QueueSpawn( frame, pKVEnt );
+			}
+			else
 			{
-				m_vecEntData.AddToTail( pEntData );
+				CreateEntity( pKVEnt );
 			}
 		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+CBaseEntity *CMapHackManager::CreateEntity( KeyValues *pKVEnt )
+{
+	CMapHackSpawnTemplate *pTemplate = GetSpawnTemplate( pKVEnt );
+
+	// Pooled instances have spawned already, they only need the keys again
+	CBaseEntity *pEntity = pTemplate->AcquirePooledEntity();
+	if ( pEntity )
+	{
+		m_dictSpawnedEnts.Insert( STRING( pEntity->GetEntityName() ), pEntity );
+
+		MapHack_FixCollisionBounds( pEntity, pTemplate->GetEntityKeyValues() );
+		MapHack_DebugMsg( "Reused pooled entity \"%s\" (targetname: %s)\n", pEntity->GetClassname(), STRING( pEntity->GetEntityName() ) );
+		return pEntity;
+	}
+
+	pEntity = pTemplate->CreateEntity( pKVEnt );
+	if ( !pEntity )
+		return NULL;
+
+	++m_Stats.m_iTemplateSpawns;
+
+	m_dictSpawnedEnts.Insert( STRING( pEntity->GetEntityName() ), pEntity );
+
+	// Spawned with the rest of the block
+	MapHackPendingSpawn_t &pending = m_vecPendingSpawns[m_vecPendingSpawns.AddToTail()];
+	pending.m_hEntity = pEntity;
+	pending.m_pKV = pTemplate->GetEntityKeyValues();
+
+	return pEntity;
+}
+
+//-----------------------------------------------------------------------------
+// Spawns everything created since the last flush the same way map load does,
+// parents before children and Activate() only after all of them have spawned
+//-----------------------------------------------------------------------------
+void CMapHackManager::FlushPendingSpawns()
+{
+	if ( m_vecPendingSpawns.Count() == 0 )
+		return;
+
+	// Spawning may fire outputs that create more entities
+	CUtlVector<MapHackPendingSpawn_t> vecPending;
+	vecPending.Swap( m_vecPendingSpawns );
+
+	CUtlVector<HierarchicalSpawn_t> vecSpawnList;
+	vecSpawnList.EnsureCapacity( vecPending.Count() );
+
+	for ( int i = 0; i < vecPending.Count(); ++i )
+	{
+		CBaseEntity *pEntity = vecPending[i].m_hEntity.Get();
+		if ( !pEntity )
+			continue;
+
+		HierarchicalSpawn_t &spawn = vecSpawnList[vecSpawnList.AddToTail()];
+		spawn.m_pEntity = pEntity;
+		spawn.m_nDepth = 0;
+		spawn.m_pDeferredParent = NULL;
+		spawn.m_pDeferredParentAttachment = NULL;
+	}
+
+	SpawnHierarchicalList( vecSpawnList.Count(), vecSpawnList.Base(), true );
+
+	for ( int i = 0; i < vecPending.Count(); ++i )
+	{
+		// Might have removed itself while spawning
+		CBaseEntity *pEntity = vecPending[i].m_hEntity.Get();
+		if ( !pEntity )
+			continue;
+
+		MapHack_FixCollisionBounds( pEntity, vecPending[i].m_pKV );
+		MapHack_DebugMsg( "Spawned entity \"%s\" (targetname: %s)\n", pEntity->GetClassname(), STRING( pEntity->GetEntityName() ) );
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::QueueSpawn( MapHackExecFrame_t &frame, KeyValues *pKVEnt )
+{
+	// One batch per block run
+	if ( !frame.m_pSpawnBatch )
+	{
+		frame.m_pSpawnBatch = new MapHackSpawnBatch_t();
+		V_strcpy_safe( frame.m_pSpawnBatch->m_szEvent, frame.m_pBlock->GetString( "spawn_queue_event" ) );
+
+		m_vecSpawnBatches.AddToTail( frame.m_pSpawnBatch );
+	}
+
+	MapHackQueuedSpawn_t &spawn = m_vecSpawnQueue[m_vecSpawnQueue.AddToTail()];
+	spawn.m_pKVEnt = pKVEnt;
+	spawn.m_pBatch = frame.m_pSpawnBatch;
+
+	++frame.m_pSpawnBatch->m_iPending;
+	++m_Stats.m_iQueuedSpawns;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::SealSpawnBatch( MapHackSpawnBatch_t *pBatch )
+{
+	pBatch->m_bSealed = true;
+	OnSpawnBatchProgress( pBatch );
+}
+
+//-----------------------------------------------------------------------------
+// Frames dropped before their block has finished still own a spawn batch.
+// With bComplete it's sealed like the block had run to the end, otherwise
+// it's deleted along with its queued spawns.
+//-----------------------------------------------------------------------------
+void CMapHackManager::ReleaseFrameBatches( CUtlVector<MapHackExecFrame_t> &vecFrames, const bool bComplete )
+{
+	// Completion events may run blocks of their own, the frames go first
+	CUtlVector<MapHackSpawnBatch_t*> vecBatches;
+	FOR_EACH_VEC_BACK( vecFrames, i )
+	{
+		if ( vecFrames[i].m_pSpawnBatch )
+			vecBatches.AddToTail( vecFrames[i].m_pSpawnBatch );
+	}
+
+	vecFrames.RemoveAll();
+
+	for ( int i = 0; i < vecBatches.Count(); ++i )
+	{
+		MapHackSpawnBatch_t *pBatch = vecBatches[i];
+
+		// A reset from an earlier completion event purges the batches
+		if ( !m_vecSpawnBatches.HasElement( pBatch ) )
+			continue;
+
+		if ( bComplete )
+		{
+			SealSpawnBatch( pBatch );
+			continue;
+		}
 
-		// Look for function keys first, those start with '$'
-		if ( bIsFunction )
+		FOR_EACH_VEC_BACK( m_vecSpawnQueue, j )
 		{
-			const MapHackFunctionType_t type = GetFunctionTypeByString( pszName );
-			switch ( type )
-			{
-				// Variables
-				case MAPHACK_FUNCTION_IF:
-					KvIfCond( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_SET:
-					KvSetVariable( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_INCREMENT:
-					KvIncrement( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_DECREMENT:
-					KvDecrement( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_RAND:
-					KvRandVariable( pKVEnt );
-					break;
+			if ( m_vecSpawnQueue[j].m_pBatch == pBatch )
+				m_vecSpawnQueue.Remove( j );
+		}
 
-				// Basic functions
-				case MAPHACK_FUNCTION_CONSOLE:
-					KvConsole( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_FIRE:
-					KvFireInput( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_EDIT:
-					KvEdit( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_EDIT_ALL:
-					KvEditAll( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_MODIFY:
-					KvModify( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_FILTER:
-					KvFilter( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_TRIGGER:
-					KvTriggerEvent( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_START:
-					KvStartEvent( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_STOP:
-					KvStopEvent( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_RESPAWN:
-					KvRespawnEntity( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_REMOVE:
-					KvRemoveEntity( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_REMOVE_ALL:
-					KvRemoveAllEntities( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_REMOVE_CONNECTIONS:
-					KvRemoveConnections( pKVEnt );
-					break;
+		m_vecSpawnBatches.FindAndFastRemove( pBatch );
+		delete pBatch;
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::OnSpawnBatchProgress( MapHackSpawnBatch_t *pBatch )
+{
+	if ( !pBatch->m_bSealed || pBatch->m_iPending > 0 )
+		return;
 
-				// Entity positions
-				case MAPHACK_FUNCTION_GETPOS:
-					KvGetPos( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_SETPOS:
-					KvSetPos( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_GETANG:
-					KvGetAng( pKVEnt );
-					break;
-				case MAPHACK_FUNCTION_SETANG:
-					KvSetAng( pKVEnt );
-					break;
+	m_vecSpawnBatches.FindAndFastRemove( pBatch );
 
-				// Entity datadesc manipulation
-				case MAPHACK_FUNCTION_EDIT_FIELD:
-					KvEditField( pKVEnt );
-					break;
+	// Copy the name, the event may queue a batch of its own
+	char szEvent[128];
+	V_strcpy_safe( szEvent, pBatch->m_szEvent );
+	delete pBatch;
 
-				// Extra functions
-				case MAPHACK_FUNCTION_PLAYSOUND:
-					KvPlaySound( pKVEnt );
-					break;
+	if ( szEvent[0] != '\0' )
+	{
+		MapHack_DebugMsg( "Spawn batch done, triggering \"%s\"\n", szEvent );
+		TriggerEventByName( szEvent );
+	}
+}
 
-				case MAPHACK_FUNCTION_SCRIPT:
-#if 0 // If your mod has VScript, toggle this
-					KvScript( pKVEnt );
-#endif
-					break;
+//-----------------------------------------------------------------------------
+void CMapHackManager::DrainSpawnQueue()
+{
+	const int count = Min( m_vecSpawnQueue.Count(), sv_maphack_spawn_budget.GetInt() );
 
-				default:
-					Warning( "MapHack WARNING: Invalid function key \"%s\"!\n", pszName );
-					break;
-			}
-		}
-		else
-		{
-			if ( !IsPreEntity() )
-			{
-				// Create new entity
-				// If invalid, CreateEntityByName() spews a warning for us
-				CBaseEntity *pEntity = CreateEntityByName( pszName );
-				if ( pEntity )
-				{
-					KeyValues *pEntityKeyValues;
+	// Take this tick's share off the queue first, completion events may add more
+	CUtlVector<MapHackQueuedSpawn_t> vecSpawns;
+	vecSpawns.CopyArray( m_vecSpawnQueue.Base(), count );
+	m_vecSpawnQueue.RemoveMultiple( 0, count );
 
-					// First version of MapHack required the keyvalues field
-					KeyValues *pLegacyKeyValues = pKVEnt->FindKey( "keyvalues" );
-					if ( pLegacyKeyValues )
-					{
-						// Parse the outer values first
-						MapHack_ParseEntKVBlockHelper( pEntity, pKVEnt );
+	for ( int i = 0; i < vecSpawns.Count(); ++i )
+		CreateEntity( vecSpawns[i].m_pKVEnt );
 
-						pEntityKeyValues = pLegacyKeyValues;
-					}
-					else
-					{
-						pEntityKeyValues = pKVEnt;
-					}
+	FlushPendingSpawns();
 
-					MapHack_ParseEntKVBlockHelper( pEntity, pEntityKeyValues );
+	// Queued entities might be the output targets of events
+	UpdateOutputEvents();
 
-					// Spawn!
-					DispatchSpawn( pEntity );
-					MapHack_FixCollisionBounds( pEntity, pEntityKeyValues );
-					m_dictSpawnedEnts.Insert( STRING( pEntity->GetEntityName() ), pEntity );
-					MapHack_DebugMsg( "Spawned entity \"%s\" (targetname: %s)\n", pszName, STRING( pEntity->GetEntityName() ) );
-				}
-			}
-		}
+	for ( int i = 0; i < vecSpawns.Count(); ++i )
+	{
+		MapHackSpawnBatch_t *pBatch = vecSpawns[i].m_pBatch;
+
+		// A reset from a spawn or completion event purges the batches
+		if ( !m_vecSpawnBatches.HasElement( pBatch ) )
+			continue;
 
-		pKVEnt = pKVEnt->GetNextTrueSubKey();
+		--pBatch->m_iPending;
+		OnSpawnBatchProgress( pBatch );
 	}
+}
 
-	if ( !IsPreEntity() )
+//-----------------------------------------------------------------------------
+void CMapHackManager::PurgeSpawnQueue()
+{
+	m_vecSpawnQueue.Purge();
+	m_vecSpawnBatches.PurgeAndDeleteElements();
+
+	// Created by the blocks that were just stopped, never spawned
+	for ( int i = 0; i < m_vecPendingSpawns.Count(); ++i )
 	{
-		// Now that we have run this entities field, update our output events
-		FOR_EACH_DICT( m_dictEvents, i )
-		{
-			MapHackEvent_t *pEvent = m_dictEvents[i];
-			if ( !pEvent || pEvent->m_Type != MAPHACK_EVENT_OUTPUT )
-				continue;
+		CBaseEntity *pEntity = m_vecPendingSpawns[i].m_hEntity.Get();
+		if ( pEntity )
+			UTIL_Remove( pEntity );
+	}
 
-			// No need if we got a valid handle
-			if ( pEvent->m_hOutputEnt.Get() )
-				continue;
+	m_vecPendingSpawns.Purge();
+}
 
-			CBaseEntity *pEnt = GetEntityByTargetName( pEvent->m_szOutputEntName );
-			if ( pEnt )
-			{
-				pEvent->m_hOutputEnt = pEnt;
+//-----------------------------------------------------------------------------
+void CMapHackManager::UpdateOutputEvents()
+{
+	// Entities block has finished, look up entities for our output events
+	FOR_EACH_DICT( m_dictEvents, i )
+	{
+		MapHackEvent_t *pEvent = m_dictEvents[i];
+		if ( !pEvent || pEvent->m_Type != MAPHACK_EVENT_OUTPUT )
+			continue;
 
-				// Register output callback for this entity
-				RegisterOutputCallback( pEnt, Fn_EntityOutputCallback );
-			}
+		// No need if we got a valid handle
+		if ( pEvent->m_hOutputEnt.Get() )
+			continue;
+
+		CBaseEntity *pEnt = GetEntityByTargetName( pEvent->m_szOutputEntName );
+		if ( pEnt )
+		{
+			pEvent->m_hOutputEnt = pEnt;
+
+			// Register output callback for this entity
+			RegisterOutputCallback( pEnt, Fn_EntityOutputCallback );
 		}
 	}
-
-	g_iMapHackEntitiesRecursionLevel = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -1488,10 +3808,10 @@ void CMapHackManager::KvIfCond( KeyValues *pKV )
 		return;
 	}
 
-	if ( TestIfCondBlock( pszCond ) )
+	if ( TestIfCondBlock( pKV, pszCond ) )
 	{
 		// Run entities and all function keys in this block
-		RunEntities( pEntities );
+		QueueEntities( pEntities );
 	}
 }
 
@@ -1535,6 +3855,13 @@ void CMapHackManager::KvSetVariable( KeyValues *pKV )
 			if ( sscanf( pszValue, "%d %d %d", &clr[0], &clr[1], &clr[2] ) == 3 )
 				pVar->SetColor( Color( clr[0], clr[1], clr[2] ) );
 			break;
+		case MAPHACK_TYPE_VECTOR:
+		{
+			Vector vec;
+			if ( sscanf( pszValue, "%f %f %f", &vec.x, &vec.y, &vec.z ) == 3 )
+				pVar->SetVector( vec );
+			break;
+		}
 
 		default:
 			pVar->SetValue( pszValue );
@@ -1638,6 +3965,75 @@ void CMapHackManager::KvRandVariable( KeyValues *pKV )
 	}
 }
 
+//-----------------------------------------------------------------------------
+void CMapHackManager::KvAssign( KeyValues *pKV )
+{
+	const char *pszVar = pKV->GetString( "var", NULL );
+	if ( !pszVar )
+	{
+		Warning( "MapHack WARNING: $assign block has no 'var'!\n" );
+		return;
+	}
+
+	const char *pszExpression = pKV->GetString( "expr", NULL );
+	if ( !pszExpression )
+	{
+		Warning( "MapHack WARNING: $assign block has no 'expr'!\n" );
+		return;
+	}
+
+	MapHackVariable_t *pVar = GetVariableByName( pszVar );
+	if ( !pVar )
+	{
+		Warning( "MapHack WARNING: $assign block 'var' value references a non-existent variable! (%s)\n", pszVar );
+		return;
+	}
+
+	const CMapHackExpression *pExpression = GetExpression( pKV, pszExpression );
+	if ( !pExpression || !pExpression->IsValid() )
+		return;
+
+	MapHackExprValue_t result;
+	pExpression->Evaluate( result );
+
+	// Convert the result to the variable type
+	switch ( pVar->m_Type )
+	{
+		case MapHackType_t::TYPE_INT:
+			if ( result.IsNumber() )
+			{
+				pVar->SetInt( ( result.m_Type == MapHackType_t::TYPE_INT ) ? result.m_iValue : (int)result.m_flValue );
+				return;
+			}
+			break;
+		case MapHackType_t::TYPE_FLOAT:
+			if ( result.IsNumber() )
+			{
+				pVar->SetFloat( result.AsFloat() );
+				return;
+			}
+			break;
+		case MapHackType_t::TYPE_STRING:
+			if ( result.m_Type == MapHackType_t::TYPE_STRING )
+			{
+				pVar->SetString( result.m_pszValue );
+				return;
+			}
+			break;
+		case MAPHACK_TYPE_VECTOR:
+			if ( result.IsVector() )
+			{
+				pVar->SetVector( Vector( result.m_vecValue[0], result.m_vecValue[1], result.m_vecValue[2] ) );
+				return;
+			}
+			break;
+		default:
+			break;
+	}
+
+	Warning( "MapHack WARNING: $assign result of \"%s\" doesn't fit variable \"%s\"!\n", pszExpression, pszVar );
+}
+
 //-----------------------------------------------------------------------------
 void CMapHackManager::KvConsole( KeyValues *pKV ) const
 {
@@ -2132,7 +4528,10 @@ void CMapHackManager::KvRemoveEntity( KeyValues *pKV )
 		if ( pEntity )
 		{
 			MapHack_DebugMsg( "Removed entity targetnamed \"%s\"\n", pEntity->GetDebugName() );
-			UTIL_Remove( pEntity );
+
+			// Pooled entities go dormant instead
+			if ( !ReleasePooledEntity( pEntity ) )
+				UTIL_Remove( pEntity );
 		}
 		else
 		{
@@ -2269,7 +4668,10 @@ void CMapHackManager::KvGetPos( KeyValues *pKV )
 	}
 
 	const Vector &vecOrigin = pEntity->GetAbsOrigin();
-	pVar->SetString( UTIL_VarArgs( "%f %f %f", vecOrigin.x, vecOrigin.y, vecOrigin.z ) );
+	if ( pVar->m_Type == MAPHACK_TYPE_VECTOR )
+		pVar->SetVector( vecOrigin );
+	else
+		pVar->SetString( UTIL_VarArgs( "%f %f %f", vecOrigin.x, vecOrigin.y, vecOrigin.z ) );
 }
 
 //-----------------------------------------------------------------------------
@@ -2327,7 +4729,10 @@ void CMapHackManager::KvGetAng( KeyValues *pKV )
 	}
 
 	const QAngle &angles = pEntity->GetAbsAngles();
-	pVar->SetString( UTIL_VarArgs( "%f %f %f", angles.x, angles.y, angles.z ) );
+	if ( pVar->m_Type == MAPHACK_TYPE_VECTOR )
+		pVar->SetVector( Vector( angles.x, angles.y, angles.z ) );
+	else
+		pVar->SetString( UTIL_VarArgs( "%f %f %f", angles.x, angles.y, angles.z ) );
 }
 
 //-----------------------------------------------------------------------------
@@ -2534,7 +4939,7 @@ void CMapHackManager::TriggerEvent( MapHackEvent_t *pEvent, const float flDelay
 
 	if ( pEvent->m_iDataType == 0 )
 	{
-		RunEntities( pEvent->m_pKVData );
+		QueueEntities( pEvent->m_pKVData );
 	}
 	else if ( pEvent->m_iDataType == 1 )
 	{
@@ -2640,12 +5045,15 @@ void CMapHackManager::DumpVariablesToConsole()
 				ConColorMsg( 0, CON_COLOR_MAPHACK, "%s = %f\n", m_dictVars[i]->m_szName, m_dictVars[i]->m_flValue );
 				break;
 			case MapHackType_t::TYPE_STRING:
-				ConColorMsg( 0, CON_COLOR_MAPHACK, "%s = %s\n", m_dictVars[i]->m_szName, m_dictVars[i]->m_pszValue );
+				ConColorMsg( 0, CON_COLOR_MAPHACK, "%s = %s\n", m_dictVars[i]->m_szName, m_dictVars[i]->GetString() );
 				break;
 			case MapHackType_t::TYPE_COLOR:
 				ConColorMsg( 0, CON_COLOR_MAPHACK, "%s = %d %d %d\n", m_dictVars[i]->m_szName,
 					m_dictVars[i]->m_Color[0], m_dictVars[i]->m_Color[1], m_dictVars[i]->m_Color[2] );
 				break;
+			case MAPHACK_TYPE_VECTOR:
+				ConColorMsg( 0, CON_COLOR_MAPHACK, "%s = %s\n", m_dictVars[i]->m_szName, m_dictVars[i]->GetValue() );
+				break;
 			default:
 				break;
 		}
@@ -2655,134 +5063,171 @@ void CMapHackManager::DumpVariablesToConsole()
 }
 
 //-----------------------------------------------------------------------------
-bool CMapHackManager::TestIfCondBlock( const char *psz )
+void CMapHackManager::DumpStatsToConsole()
 {
-	bool bResult = false;
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "MapHack: Stats\n\n" );
 
-	static const char *pszOps[]
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "Keys run: %d\n", m_Stats.m_iInstructions );
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "Deferred event bodies: %d (%d suspended)\n", m_Stats.m_iDeferrals, m_vecSuspendedContexts.Count() );
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "Deferred ticks: %d\n", m_Stats.m_iDeferredTicks );
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "Queued spawns: %d (%d pending)\n", m_Stats.m_iQueuedSpawns, m_vecSpawnQueue.Count() );
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "Template spawns: %d (%d templates)\n", m_Stats.m_iTemplateSpawns, m_mapSpawnTemplates.Count() );
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "Respawns: %d (%d from cached keys)\n", m_Stats.m_iRespawns, m_Stats.m_iCachedRespawns );
+
+	if ( m_pEntityIndex->IsCompressed() )
 	{
-		"==", "!=", ">=", ">", "<=", "<",
-	};
+		const int lumpSize = m_pEntityIndex->GetLumpSize();
+		const int compressedSize = m_pEntityIndex->GetCompressedSize();
+		ConColorMsg( 0, CON_COLOR_MAPHACK, "Compressed entities: %d KB in %d chunks, %d KB saved (%.1f%%), %d chunk decompressions in %.2f ms\n",
+			compressedSize / 1024, m_pEntityIndex->GetChunkCount(), ( lumpSize - compressedSize ) / 1024,
+			lumpSize > 0 ? 100.0f * ( lumpSize - compressedSize ) / lumpSize : 0.0f,
+			m_pEntityIndex->GetDecompressions(), m_pEntityIndex->GetDecompressTime() * 1000.0 );
+	}
 
-	const MapHackVariable_t *pLVal = NULL;
-	const MapHackVariable_t *pRVal = NULL;
+	const int includeLookups = m_Stats.m_iIncludeCacheHits + m_Stats.m_iIncludeCacheMisses;
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "Include cache: %d hits, %d misses (%d parsed in parallel, %.1f%% hit rate, %d files cached), %d cycles\n",
+		m_Stats.m_iIncludeCacheHits, m_Stats.m_iIncludeCacheMisses, m_Stats.m_iIncludeParallelParses,
+		includeLookups > 0 ? 100.0f * m_Stats.m_iIncludeCacheHits / includeLookups : 0.0f,
+		m_dictIncludeCache.Count(), m_Stats.m_iIncludeCycles );
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "Preloaded level loads: %d%s\n", m_Stats.m_iPreloadsAdopted, m_pPreload ? " (one pending)" : "" );
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "Patched lump level loads: %d\n", m_Stats.m_iPatchedLumps );
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "Fast round restarts: %d%s\n", m_Stats.m_iFastRestarts, m_pSnapshot ? "" : " (no snapshot)" );
+
+	if ( MapHack_IsSharedCacheEnabled() )
+	{
+		int sharedHits, sharedMisses, sharedStores, sharedEvictions, sharedCorrupt;
+		MapHack_GetSharedCacheStats( sharedHits, sharedMisses, sharedStores, sharedEvictions, sharedCorrupt );
+		ConColorMsg( 0, CON_COLOR_MAPHACK, "Disk cache \"%s\": %d hits, %d misses, %d entries stored, %d evicted, %d corrupt\n",
+			sv_maphack_shared_cache.GetString(), sharedHits, sharedMisses, sharedStores, sharedEvictions, sharedCorrupt );
+	}
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "Hot reloads: %d (%d vars/events changed, %d entity keys run, %d unchanged), %d files watched%s\n",
+		m_Stats.m_iHotReloads, m_Stats.m_iHotReloadChanges, m_Stats.m_iHotReloadEntities, m_Stats.m_iHotReloadEntitiesSkipped,
+		m_dictWatchedFiles.Count(), ( m_iWatchFd != -1 ) ? " (inotify)" : "" );
+	ConColorMsg( 0, CON_COLOR_MAPHACK, "Precaches: %d hoisted to load, %d late (%d files warmed up)\n", m_Stats.m_iHoistedPrecaches, m_Stats.m_iLatePrecaches, m_Stats.m_iWarmupFiles );
 
-	unsigned int op;
+	for ( int type = 0; type < MAPHACK_PRECACHE_COUNT; ++type )
+		ConColorMsg( 0, CON_COLOR_MAPHACK, "    %s: %d\n", g_pszMapHackPrecacheTypes[type], m_dictPrecache[type].Count() );
 
-	CUtlVector<char *> vecOutStrings;
-	for ( op = 0; op < ARRAYSIZE( pszOps ); ++op )
+	// How close the level is to the engine limits
+	static const char *s_pszPrecacheTables[] = { "modelprecache", "soundprecache", "Materials", "ParticleEffectNames" };
+	for ( unsigned int i = 0; i < ARRAYSIZE( s_pszPrecacheTables ); ++i )
 	{
-		if ( V_strstr( psz, pszOps[op] ) )
-		{
-			V_SplitString( psz, pszOps[op], vecOutStrings );
-			break;
-		}
+		INetworkStringTable *pTable = networkstringtable->FindTable( s_pszPrecacheTables[i] );
+		if ( pTable )
+			ConColorMsg( 0, CON_COLOR_MAPHACK, "Table \"%s\": %d / %d\n", s_pszPrecacheTables[i], pTable->GetNumStrings(), pTable->GetMaxStrings() );
 	}
 
-	// Clear the '%' chars, we don't have to explicitly reference a var here
-	for ( int i = 0; i < vecOutStrings.Count(); ++i )
+	FOR_EACH_MAP_FAST( m_mapSpawnTemplates, i )
 	{
-		if ( vecOutStrings[i][0] == '%' )
-			vecOutStrings[i][0] = ' ';
+		const CMapHackSpawnTemplate *pTemplate = m_mapSpawnTemplates[i];
+		if ( !pTemplate->IsPooled() )
+			continue;
+
+		ConColorMsg( 0, CON_COLOR_MAPHACK, "Pool \"%s\": size %d, %d dormant, %d active (high-water %d), %d hits, %d misses\n",
+			pTemplate->GetClassName(), pTemplate->GetPoolSize(), pTemplate->GetPoolDormantCount(), pTemplate->GetPoolActiveCount(),
+			pTemplate->GetPoolHighWater(), pTemplate->GetPoolHits(), pTemplate->GetPoolMisses() );
 	}
+}
+
+//-----------------------------------------------------------------------------
+bool CMapHackManager::TestIfCondBlock( KeyValues *pKV, const char *pszCond )
+{
+	const CMapHackExpression *pExpression = GetExpression( pKV, pszCond );
+	if ( !pExpression )
+		return false;
+
+	return pExpression->EvaluateBool();
+}
 
-	// Lazy strip...
-	for ( int i = 0; i < vecOutStrings.Count(); ++i )
-		Q_StripPrecedingAndTrailingWhitespace( vecOutStrings[i] );
+//-----------------------------------------------------------------------------
+// Conditions are compiled once per block, variables are bound at compile time
+//-----------------------------------------------------------------------------
+CMapHackExpression *CMapHackManager::GetExpression( KeyValues *pKV, const char *pszExpression )
+{
+	const unsigned short idx = m_mapExpressions.Find( pKV );
+	if ( m_mapExpressions.IsValidIndex( idx ) )
+		return m_mapExpressions[idx];
 
-	const MapHackType_t lType = GetTypeForString( vecOutStrings[0] );
-	const MapHackType_t rType = GetTypeForString( vecOutStrings[1] );
+	// Invalid expressions are cached too, they will warn only once
+	CMapHackExpression *pExpression = new CMapHackExpression();
+	pExpression->Compile( pszExpression, MapHack_LookupVariable );
 
-	MapHackVariable_t l, r;
-	l.m_Type = lType;
-	r.m_Type = rType;
+	m_mapExpressions.Insert( pKV, pExpression );
+	return pExpression;
+}
 
-	if ( lType == MapHackType_t::TYPE_STRING )
-	{
-		pLVal = GetVariableByName( vecOutStrings[0] );
-		if ( !pLVal )
-		{
-			l.SetString( vecOutStrings[0] );
-			pLVal = &l;
-		}
-	}
-	else if ( lType == MapHackType_t::TYPE_INT )
-	{
-		l.SetInt( V_atoi( vecOutStrings[0] ) );
-		pLVal = &l;
-	}
-	else if ( lType == MapHackType_t::TYPE_FLOAT )
-	{
-		l.SetFloat( V_atof( vecOutStrings[0] ) );
-		pLVal = &l;
-	}
+//-----------------------------------------------------------------------------
+void CMapHackManager::PurgeExpressions()
+{
+	m_mapExpressions.PurgeAndDeleteElements();
+}
 
-	if ( rType == MapHackType_t::TYPE_STRING )
-	{
-		pRVal = GetVariableByName( vecOutStrings[1] );
-		if ( !pRVal )
-		{
-			r.SetString( vecOutStrings[1] );
-			pRVal = &r;
-		}
-	}
-	else if ( rType == MapHackType_t::TYPE_INT )
+//-----------------------------------------------------------------------------
+// Expressions and spawn templates of one tree, a freed block's address can
+// come back as another block
+//-----------------------------------------------------------------------------
+void CMapHackManager::PurgeTreeCaches( KeyValues *pTree )
+{
+	unsigned short idx = m_mapExpressions.Find( pTree );
+	if ( m_mapExpressions.IsValidIndex( idx ) )
 	{
-		r.SetInt( V_atoi( vecOutStrings[1] ) );
-		pRVal = &r;
+		delete m_mapExpressions[idx];
+		m_mapExpressions.RemoveAt( idx );
 	}
-	else if ( rType == MapHackType_t::TYPE_FLOAT )
+
+	idx = m_mapSpawnTemplates.Find( pTree );
+	if ( m_mapSpawnTemplates.IsValidIndex( idx ) )
 	{
-		r.SetFloat( V_atof( vecOutStrings[1] ) );
-		pRVal = &r;
+		delete m_mapSpawnTemplates[idx];
+		m_mapSpawnTemplates.RemoveAt( idx );
 	}
 
-	// Test
-	if ( pLVal && pRVal )
+	for ( KeyValues *pSub = pTree->GetFirstSubKey(); pSub; pSub = pSub->GetNextKey() )
+		PurgeTreeCaches( pSub );
+}
+
+//-----------------------------------------------------------------------------
+// Entity blocks are compiled on their first spawn
+//-----------------------------------------------------------------------------
+CMapHackSpawnTemplate *CMapHackManager::GetSpawnTemplate( KeyValues *pKVEnt )
+{
+	const unsigned short idx = m_mapSpawnTemplates.Find( pKVEnt );
+	if ( m_mapSpawnTemplates.IsValidIndex( idx ) )
+		return m_mapSpawnTemplates[idx];
+
+	CMapHackSpawnTemplate *pTemplate = new CMapHackSpawnTemplate();
+	m_mapSpawnTemplates.Insert( pKVEnt, pTemplate );
+	return pTemplate;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackManager::PurgeSpawnTemplates()
+{
+	m_mapSpawnTemplates.PurgeAndDeleteElements();
+}
+
+//-----------------------------------------------------------------------------
+bool CMapHackManager::ReleasePooledEntity( CBaseEntity *pEntity )
+{
+	FOR_EACH_MAP_FAST( m_mapSpawnTemplates, i )
 	{
-		if ( pLVal->m_Type == MapHackType_t::TYPE_INT && pRVal->m_Type == MapHackType_t::TYPE_INT )
-		{
-			switch ( op )
-			{
-				case 0: bResult = ( pLVal->GetInt() == pRVal->GetInt() ); break;
-				case 1: bResult = ( pLVal->GetInt() != pRVal->GetInt() ); break;
-				case 2: bResult = ( pLVal->GetInt() >= pRVal->GetInt() ); break;
-				case 3: bResult = ( pLVal->GetInt() > pRVal->GetInt() ); break;
-				case 4: bResult = ( pLVal->GetInt() <= pRVal->GetInt() ); break;
-				case 5: bResult = ( pLVal->GetInt() < pRVal->GetInt() ); break;
-				default:
-					break;
-			}
-		}
-		else if ( pLVal->m_Type == MapHackType_t::TYPE_FLOAT && pRVal->m_Type == MapHackType_t::TYPE_FLOAT )
-		{
-			switch ( op )
-			{
-				case 0: bResult = ( pLVal->GetFloat() == pRVal->GetFloat() ); break;
-				case 1: bResult = ( pLVal->GetFloat() != pRVal->GetFloat() ); break;
-				case 2: bResult = ( pLVal->GetFloat() >= pRVal->GetFloat() ); break;
-				case 3: bResult = ( pLVal->GetFloat() > pRVal->GetFloat() ); break;
-				case 4: bResult = ( pLVal->GetFloat() <= pRVal->GetFloat() ); break;
-				case 5: bResult = ( pLVal->GetFloat() < pRVal->GetFloat() ); break;
-				default:
-					break;
-			}
-		}
-		else if ( pLVal->m_Type == MapHackType_t::TYPE_STRING && pRVal->m_Type == MapHackType_t::TYPE_STRING )
-		{
-			switch ( op )
-			{
-				case 0: bResult = ( FStrEq( pLVal->GetString(), pRVal->GetString() ) ); break;
-				case 1: bResult = ( !FStrEq( pLVal->GetString(), pRVal->GetString() ) ); break;
-				default:
-					break;
-			}
-		}
-	}
+		CMapHackSpawnTemplate *pTemplate = m_mapSpawnTemplates[i];
+		if ( !pTemplate->IsPooled() )
+			continue;
+
+		// The name is cleared when it goes dormant
+		const char *pszTargetName = STRING( pEntity->GetEntityName() );
+		if ( !pTemplate->ReleaseEntity( pEntity ) )
+			continue;
 
-	vecOutStrings.PurgeAndDeleteElements();
+		const int idx = m_dictSpawnedEnts.Find( pszTargetName );
+		if ( m_dictSpawnedEnts.IsValidIndex( idx ) && m_dictSpawnedEnts[idx] == pEntity )
+			m_dictSpawnedEnts.RemoveAt( idx );
 
-	return bResult;
+		return true;
+	}
+
+	return false;
 }
 
 //-----------------------------------------------------------------------------
@@ -2816,6 +5261,13 @@ void CMapHackManager::SendInput( CBaseEntity *pEntity, const char *pszInput, con
 			variant.SetFloat( V_atof( pszValue ) );
 			break;
 		}
+		case MAPHACK_TYPE_VECTOR:
+		{
+			Vector vec( 0, 0, 0 );
+			sscanf( pszValue, "%f %f %f", &vec.x, &vec.y, &vec.z );
+			variant.SetVector3D( vec );
+			break;
+		}
 		default:
 		{
 			variant.SetString( AllocPooledString( pszValue ) );
@@ -2920,54 +5372,55 @@ CBaseEntity *CMapHackManager::GetEntityHelper( KeyValues *pKV, const bool bRestr
 }
 
 //-----------------------------------------------------------------------------
-CBaseEntity *CMapHackManager::RespawnEntity( CBaseEntity *pEntity ) const
+CMapHackEntityIndex &CMapHackManager::GetEntityIndex()
 {
-	CBaseEntity *pNewEntity = NULL;
-
-	char szHammerID[16];
-	V_sprintf_safe( szHammerID, "%d", pEntity->m_iHammerID );
+	if ( !m_pEntityIndex->IsBuilt() )
+		m_pEntityIndex->Build( HasEntData() ? GetMapEntitiesString() : engine->GetMapEntitiesString() );
 
-	UTIL_Remove( pEntity );
+	return *m_pEntityIndex;
+}
 
-	// Respawn from entdata
-	char szTokenBuffer[MAPKEY_MAXLENGTH];
-	const char *pEntData = HasEntData() ? GetMapEntitiesString() : engine->GetMapEntitiesString();
-	for ( ; true; pEntData = MapEntity_SkipToNextEntity( pEntData, szTokenBuffer ) )
+//-----------------------------------------------------------------------------
+const char *CMapHackManager::GetMapEntitiesString()
+{
+	if ( m_bEntDataCompressed )
 	{
-		char szToken[MAPKEY_MAXLENGTH];
-		pEntData = MapEntity_ParseToken( pEntData, szToken );
-		if ( !pEntData )
-		{
-			break;
-		}
+		m_pNewMapData = m_pEntityIndex->Decompress();
+		m_bEntDataCompressed = false;
+	}
 
-		if ( szToken[0] != '{' )
-		{
-			continue;
-		}
+	return m_pNewMapData;
+}
 
-		CEntityMapData entData( const_cast<char *>( pEntData ) );
-		char szExtractedHammerID[16];
-		if ( !entData.ExtractValue( "hammerid", szExtractedHammerID ) )
-		{
-			continue;
-		}
+//-----------------------------------------------------------------------------
+void CMapHackManager::ParseAllEntities( IMapEntityFilter *pFilter, const bool bActivateEntities )
+{
+	MapHack_ParseAllEntities( GetEntityIndex(), pFilter, bActivateEntities );
+}
 
-		// Identify using HammerIDs
-		if ( !FStrEq( szHammerID, szExtractedHammerID ) )
-		{
-			continue;
-		}
+//-----------------------------------------------------------------------------
+CBaseEntity *CMapHackManager::RespawnEntity( CBaseEntity *pEntity )
+{
+	const int hammerID = pEntity->m_iHammerID;
 
-		// Parse and create as usual
-		MapEntity_ParseEntity( pNewEntity, pEntData, NULL );
-		break;
-	}
+	UTIL_Remove( pEntity );
 
-	if ( pNewEntity )
-	{
-		DispatchSpawn( pNewEntity );
-	}
+	// Respawn from entdata, identify using HammerIDs
+	CMapHackEntityIndex &index = GetEntityIndex();
+	const int idx = index.FindByHammerID( hammerID );
+	if ( idx == -1 )
+		return NULL;
+
+	bool bCached = false;
+	CBaseEntity *pNewEntity = index.RespawnEntity( idx, sv_maphack_respawn_cache.GetInt(), &bCached );
+	if ( !pNewEntity )
+		return NULL;
+
+	++m_Stats.m_iRespawns;
+	if ( bCached )
+		++m_Stats.m_iCachedRespawns;
+
+	DispatchSpawn( pNewEntity );
 
 	return pNewEntity;
 }
@@ -3067,6 +5520,8 @@ MapHackEntityData_t *CMapHackManager::ParseEntityData( const char *pszEntData, c
 //-----------------------------------------------------------------------------
 void CMapHackManager::FinalizeEntData()
 {
+	m_pEntityIndex->Purge();
+
 	if ( m_pNewMapData )
 	{
 		delete[] m_pNewMapData;
@@ -3267,11 +5722,34 @@ void CMapHackManager::ResetMapHack( const bool bDeleteKeyValues )
 
 	m_vecEventQueue.Purge();
 
+	// Suspended event bodies and queued spawns point to event data
+	PurgeExecContexts();
+	PurgeSpawnQueue();
+
 	// Delete everything
 	m_dictSpawnedEnts.Purge();
 	m_dictEvents.PurgeAndDeleteElements();
 	m_dictVars.PurgeAndDeleteElements();
 
+	// Compiled expressions point to variables and event data
+	PurgeExpressions();
+	PurgeSpawnTemplates();
+
+	m_vecEntityHashes.Purge();
+
+	// Points to what was just deleted
+	PurgeSnapshot();
+
+	for ( int i = 0; i < m_vecHotReloadEntities.Count(); ++i )
+		m_vecHotReloadEntities[i]->deleteThis();
+
+	m_vecHotReloadEntities.Purge();
+
+	for ( int i = 0; i < m_vecIncludeTrees.Count(); ++i )
+		m_vecIncludeTrees[i]->deleteThis();
+
+	m_vecIncludeTrees.Purge();
+
 	if ( bDeleteKeyValues )
 	{
 		if ( m_pMapHack )
@@ -3281,43 +5759,22 @@ void CMapHackManager::ResetMapHack( const bool bDeleteKeyValues )
 		}
 
 		m_pszIdentifier = "";
+
+		m_szFileName[0] = '\0';
+		PurgeWatchedFiles();
 	}
 }
 
 //-----------------------------------------------------------------------------
 MapHackFunctionType_t CMapHackManager::GetFunctionTypeByString( const char *pszString )
 {
-	const int idx = m_dictFunctions.Find( pszString );
-	if ( !m_dictFunctions.IsValidIndex( idx ) )
-		return MAPHACK_FUNCTION_INVALID;
-
-	return m_dictFunctions[idx];
+	return (MapHackFunctionType_t)g_MapHackFunctionHash.Find( pszString );
 }
 
 //-----------------------------------------------------------------------------
 MapHackEventType_t CMapHackManager::GetEventTypeByString( const char *pszString )
 {
-	if ( FStrEq( pszString, "EVENT_TRIGGER" ) )
-	{
-		return MAPHACK_EVENT_TRIGGER;
-	}
-
-	if ( FStrEq( pszString, "EVENT_TIMED" ) )
-	{
-		return MAPHACK_EVENT_TIMED;
-	}
-
-	if ( FStrEq( pszString, "EVENT_OUTPUT" ) )
-	{
-		return MAPHACK_EVENT_OUTPUT;
-	}
-
-	if ( FStrEq( pszString, "EVENT_GAMEEVENT" ) )
-	{
-		return MAPHACK_EVENT_GAMEEVENT;
-	}
-
-	return MAPHACK_EVENT_INVALID;
+	return (MapHackEventType_t)g_MapHackEventTypeHash.Find( pszString );
 }
 
 //-----------------------------------------------------------------------------
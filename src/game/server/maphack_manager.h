@@ -13,10 +13,109 @@
 #define MAPHACK_MANAGER_H
 
 #include "GameEventListener.h"
+#include "tier1/utlmap.h"
+#include "tier1/utlstring.h"
+#include "tier0/threadtools.h"
+
+class CMapHackExpression;
+class CMapHackSpawnTemplate;
+class CMapHackEntityIndex;
+class IMapEntityFilter;
 
 //-----------------------------------------------------------------------------
 #define MAPHACK_DEFAULT_IDENTIFIER "maphack"
 
+//-----------------------------------------------------------------------------
+// Case-insensitive FNV-1a
+//-----------------------------------------------------------------------------
+inline unsigned int MapHack_HashStringCaseless( const char *psz, const unsigned int seed )
+{
+	unsigned int hash = 2166136261u ^ ( seed * 2654435761u );
+	for ( ; *psz; ++psz )
+	{
+		const char c = ( *psz >= 'A' && *psz <= 'Z' ) ? (char)( *psz - 'A' + 'a' ) : *psz;
+		hash = ( hash ^ (unsigned char)c ) * 16777619u;
+	}
+
+	return hash;
+}
+
+//-----------------------------------------------------------------------------
+// Perfect hash over a constant string table. The seed is searched once at
+// static init until every entry gets a slot of its own, so a lookup is one
+// hash and one string compare.
+//-----------------------------------------------------------------------------
+template < int NUM_ENTRIES, int NUM_SLOTS >
+class CMapHackPerfectHash
+{
+public:
+	CMapHackPerfectHash( const char *const *pszTable )
+		: m_pszTable( pszTable ), m_Seed( 0 )
+	{
+		for ( unsigned int seed = 1; seed <= MAX_SEEDS; ++seed )
+		{
+			if ( TrySeed( seed ) )
+			{
+				m_Seed = seed;
+				break;
+			}
+		}
+
+		// Lookups fall back to scanning the table, debug builds should get more slots
+		AssertMsg( IsValid(), "MapHack: No perfect hash seed for the table, add slots\n" );
+	}
+
+	bool IsValid() const { return m_Seed != 0; }
+
+	// Returns the table index, -1 if not found
+	int Find( const char *psz ) const
+	{
+		if ( !IsValid() )
+		{
+			for ( int i = 0; i < NUM_ENTRIES; ++i )
+			{
+				if ( V_stricmp( psz, m_pszTable[i] ) == 0 )
+					return i;
+			}
+
+			return -1;
+		}
+
+		const int idx = m_Slots[MapHack_HashStringCaseless( psz, m_Seed ) & ( NUM_SLOTS - 1 )] - 1;
+		if ( idx < 0 || V_stricmp( psz, m_pszTable[idx] ) != 0 )
+			return -1;
+
+		return idx;
+	}
+
+private:
+	enum { MAX_SEEDS = 256 };
+
+	COMPILE_TIME_ASSERT( ( NUM_SLOTS & ( NUM_SLOTS - 1 ) ) == 0 );
+	COMPILE_TIME_ASSERT( NUM_ENTRIES < 255 && NUM_ENTRIES <= NUM_SLOTS );
+
+	bool TrySeed( const unsigned int seed )
+	{
+		V_memset( m_Slots, 0, sizeof( m_Slots ) );
+
+		for ( int i = 0; i < NUM_ENTRIES; ++i )
+		{
+			// Slots store index + 1, zero is empty
+			unsigned char &slot = m_Slots[MapHack_HashStringCaseless( m_pszTable[i], seed ) & ( NUM_SLOTS - 1 )];
+			if ( slot != 0 )
+				return false;
+
+			slot = (unsigned char)( i + 1 );
+		}
+
+		return true;
+	}
+
+	const char *const *m_pszTable;
+	unsigned int m_Seed;
+	unsigned char m_Slots[NUM_SLOTS];
+};
+
 //-----------------------------------------------------------------------------
 static const char *g_pszMapHackKeyWords[]
 {
@@ -38,6 +137,7 @@ enum MapHackFunctionType_t
 	MAPHACK_FUNCTION_INCREMENT,
 	MAPHACK_FUNCTION_DECREMENT,
 	MAPHACK_FUNCTION_RAND,
+	MAPHACK_FUNCTION_ASSIGN,
 
 	MAPHACK_FUNCTION_CONSOLE,
 	MAPHACK_FUNCTION_FIRE,
@@ -75,6 +175,7 @@ static const char *g_pszMapHackFunctionTable[]
 	"$increment",			// Increment variable
 	"$decrement",			// Decrement variable
 	"$rand",				// Set a variable to a random value
+	"$assign",				// Set a variable to the result of an expression
 
 	// Basic functions
 	"$console",				// Send a command to console, or debug spew
@@ -115,6 +216,41 @@ enum MapHackEventType_t
 	MAPHACK_EVENT_TIMED,
 	MAPHACK_EVENT_OUTPUT,
 	MAPHACK_EVENT_GAMEEVENT,
+
+	MAPHACK_EVENT_COUNT,
+};
+
+//-----------------------------------------------------------------------------
+static const char *g_pszMapHackEventTypes[]
+{
+	"EVENT_TRIGGER",
+	"EVENT_TIMED",
+	"EVENT_OUTPUT",
+	"EVENT_GAMEEVENT",
+};
+
+COMPILE_TIME_ASSERT( ARRAYSIZE( g_pszMapHackEventTypes ) == MAPHACK_EVENT_COUNT );
+
+//-----------------------------------------------------------------------------
+// Precache kinds, in "precache" block key order
+//-----------------------------------------------------------------------------
+enum MapHackPrecacheType_t
+{
+	MAPHACK_PRECACHE_INVALID = -1,
+
+	MAPHACK_PRECACHE_MODEL,
+	MAPHACK_PRECACHE_MATERIAL,
+	MAPHACK_PRECACHE_SOUND,
+	MAPHACK_PRECACHE_PARTICLE,
+	MAPHACK_PRECACHE_ENTITY,
+
+	MAPHACK_PRECACHE_COUNT
+};
+
+struct MapHackPrecacheEntry_t
+{
+	MapHackPrecacheType_t m_Type;
+	CUtlString m_Name;
 };
 
 //-----------------------------------------------------------------------------
@@ -129,6 +265,7 @@ enum
 	MAPHACK_LOAD_INCLUDES = 1 << 4, // Load includes (pre-entity)
 	MAPHACK_PRECACHE = 1 << 5, // Precache on load (pre-entity)
 	MAPHACK_COMPLAIN = 1 << 6, // Complain if something goes wrong
+	MAPHACK_ADOPT = 1 << 7, // Root maphack takes the keyvalues as is instead of a copy
 };
 
 #define MAPHACK_LOAD_PRE_ENTITY (MAPHACK_REGISTER_VARS | MAPHACK_LOAD_INCLUDES | MAPHACK_PRECACHE | MAPHACK_COMPLAIN)
@@ -203,66 +340,153 @@ private:
 };
 
 //-----------------------------------------------------------------------------
+// Variables are stored natively by type, the text form is only built when
+// something actually reads it as a string and is cached until the next write.
+// Short texts live in an inline buffer, so counters never touch the heap.
+//-----------------------------------------------------------------------------
+#define MAPHACK_VARIABLE_INLINE_TEXT 64
+#define MAPHACK_VARIABLE_NUMBER_TEXT 160 // Three of the widest "%f" with separators
+
 typedef KeyValues::types_t MapHackType_t;
+
+// Not a KeyValues type, only used by variables and expressions
+#define MAPHACK_TYPE_VECTOR ( (MapHackType_t)KeyValues::TYPE_NUMTYPES )
+
 struct MapHackVariable_t
 {
 	MapHackVariable_t()
 	{
 		m_szName[0] = '\0';
 		m_Type = MapHackType_t::TYPE_INT;
-		m_pszValue = NULL;
 		m_iValue = 0;
 		m_flValue = 0.0;
 		V_memset( m_Color, 0, 4 );
+
+		m_szInlineText[0] = '\0';
+		m_pszHeapText = NULL;
+		m_iHeapTextSize = 0;
+		m_bTextValid = false;
+
+		m_nDefinitionHash = 0;
 	}
 
 	~MapHackVariable_t()
 	{
-		delete[] m_pszValue;
+		delete[] m_pszHeapText;
 	}
 
 	char m_szName[128];
 	MapHackType_t m_Type;
 
-	char *m_pszValue;
+	// Hot reload keeps the value while the definition stays the same
+	unsigned int m_nDefinitionHash;
 
 	union
 	{
 		int m_iValue;
 		float m_flValue;
 		int m_Color[4];
+		float m_vecValue[3];
 	};
 
-	const char *GetValue() const { return m_pszValue; }
+	const char *GetValue() const
+	{
+		if ( !m_bTextValid )
+			UpdateText();
+
+		return GetTextBuffer();
+	}
+
 	bool GetBool() const { return ( m_Type == MapHackType_t::TYPE_INT ) ? ( m_iValue != 0 ) : false; }
 	int GetInt() const { return ( m_Type == MapHackType_t::TYPE_INT ) ? m_iValue : 0; }
 	float GetFloat() const { return ( m_Type == MapHackType_t::TYPE_FLOAT ) ? m_flValue : 0.0f; }
 	Color GetColor() const { return ( m_Type == MapHackType_t::TYPE_COLOR ) ? Color( m_Color[0], m_Color[1], m_Color[2] ) : Color( 0, 0, 0 ); }
-	const char *GetString() const { return ( m_Type == MapHackType_t::TYPE_STRING ) ? m_pszValue : ""; }
+	const char *GetString() const { return ( m_Type == MapHackType_t::TYPE_STRING ) ? GetValue() : ""; }
+	Vector GetVector() const { return ( m_Type == MAPHACK_TYPE_VECTOR ) ? Vector( m_vecValue[0], m_vecValue[1], m_vecValue[2] ) : vec3_origin; }
 
+	// Raw text, becomes the value itself for strings
 	void SetValue( const char *pszValue )
 	{
-		delete[] m_pszValue;
-
-		const int size = V_strlen( pszValue ) + 1;
-		m_pszValue = new char[size];
-		V_strncpy( m_pszValue, pszValue, size );
+		SetText( pszValue, V_strlen( pszValue ) );
+		m_bTextValid = true;
 	}
 
-	void SetInt( const int i ) { m_iValue = i; Convert(); }
-	void SetFloat( const float fl ) { m_flValue = fl; Convert(); }
-	void SetColor( const Color &clr ) { m_Color[0] = clr.r(); m_Color[1] = clr.g(); m_Color[2] = clr.b(); Convert(); }
+	void SetInt( const int i ) { m_iValue = i; m_bTextValid = false; }
+	void SetFloat( const float fl ) { m_flValue = fl; m_bTextValid = false; }
+	void SetColor( const Color &clr ) { m_Color[0] = clr.r(); m_Color[1] = clr.g(); m_Color[2] = clr.b(); m_bTextValid = false; }
 	void SetString( const char *pszString ) { SetValue( pszString ); }
+	void SetVector( const Vector &vec ) { m_vecValue[0] = vec.x; m_vecValue[1] = vec.y; m_vecValue[2] = vec.z; m_bTextValid = false; }
+
+	// Type and value of another variable, the name stays
+	void CopyValue( const MapHackVariable_t &other )
+	{
+		m_Type = other.m_Type;
+
+		switch ( m_Type )
+		{
+			case MapHackType_t::TYPE_INT:
+			case MapHackType_t::TYPE_FLOAT:
+			case MapHackType_t::TYPE_COLOR:
+			case MAPHACK_TYPE_VECTOR:
+				V_memcpy( m_Color, other.m_Color, sizeof( m_Color ) );
+				m_bTextValid = false;
+				break;
+
+			default:
+				SetValue( other.GetValue() );
+				break;
+		}
+	}
+
+private:
+	const char *GetTextBuffer() const { return m_pszHeapText ? m_pszHeapText : m_szInlineText; }
 
-	void Convert()
+	void UpdateText() const
 	{
+		// A single float can take 47 characters, a vector doesn't always fit the inline buffer
+		char szText[MAPHACK_VARIABLE_NUMBER_TEXT];
+		int len = 0;
+
 		if ( m_Type == MapHackType_t::TYPE_INT )
-			SetValue( UTIL_VarArgs( "%d", m_iValue ) );
+			len = V_snprintf( szText, sizeof( szText ), "%d", m_iValue );
 		else if ( m_Type == MapHackType_t::TYPE_FLOAT )
-			SetValue( UTIL_VarArgs( "%f", m_flValue ) );
+			len = V_snprintf( szText, sizeof( szText ), "%f", m_flValue );
 		else if ( m_Type == MapHackType_t::TYPE_COLOR )
-			SetValue( UTIL_VarArgs( "%d %d %d", m_Color[0], m_Color[1], m_Color[2] ) );
+			len = V_snprintf( szText, sizeof( szText ), "%d %d %d", m_Color[0], m_Color[1], m_Color[2] );
+		else if ( m_Type == MAPHACK_TYPE_VECTOR )
+			len = V_snprintf( szText, sizeof( szText ), "%f %f %f", m_vecValue[0], m_vecValue[1], m_vecValue[2] );
+		else
+			szText[0] = '\0';
+
+		SetText( szText, clamp( len, 0, (int)sizeof( szText ) - 1 ) );
+		m_bTextValid = true;
 	}
+
+	// Members it writes are mutable, the text is a cache of the value for numbers
+	void SetText( const char *pszText, const int len ) const
+	{
+		if ( len < (int)sizeof( m_szInlineText ) && !m_pszHeapText )
+		{
+			V_memcpy( m_szInlineText, pszText, len + 1 );
+			return;
+		}
+
+		// Only grow, the buffer is reused by later writes
+		if ( len >= m_iHeapTextSize )
+		{
+			delete[] m_pszHeapText;
+
+			m_iHeapTextSize = len + 1;
+			m_pszHeapText = new char[m_iHeapTextSize];
+		}
+
+		V_memcpy( m_pszHeapText, pszText, len + 1 );
+	}
+
+	mutable char m_szInlineText[MAPHACK_VARIABLE_INLINE_TEXT];
+	mutable char *m_pszHeapText;
+	mutable int m_iHeapTextSize;
+	mutable bool m_bTextValid;
 };
 
 //-----------------------------------------------------------------------------
@@ -284,9 +508,12 @@ struct MapHackEvent_t
 
 		m_hOutputEnt = NULL;
 		m_szOutputEntName[0] = '\0';
+		m_szOutputClassName[0] = '\0';
 		m_szOutputName[0] = '\0';
 
 		m_szGameEventName[0] = '\0';
+
+		m_nDefinitionHash = 0;
 	}
 
 	~MapHackEvent_t()
@@ -311,10 +538,14 @@ struct MapHackEvent_t
 	// MAPHACK_EVENT_OUTPUT
 	EHANDLE m_hOutputEnt;
 	char m_szOutputEntName[128];
+	char m_szOutputClassName[128];
 	char m_szOutputName[128];
 
 	// MAPHACK_EVENT_GAMEEVENT
 	char m_szGameEventName[128];
+
+	// Hot reload diff, 0 for events without a definition
+	unsigned int m_nDefinitionHash;
 };
 
 //-----------------------------------------------------------------------------
@@ -324,6 +555,222 @@ struct MapHackDelayedEvent_t
 	float m_flTriggerTime;
 };
 
+//-----------------------------------------------------------------------------
+// Entities blocks run on an explicit stack, nested blocks ($if, $trigger)
+// push a frame instead of recursing. Event bodies that run out of their
+// per-tick budget are suspended and continue on the next tick.
+//-----------------------------------------------------------------------------
+struct MapHackSpawnBatch_t;
+
+struct MapHackExecFrame_t
+{
+	KeyValues *m_pBlock;
+	KeyValues *m_pNextKey;
+
+	// Spawns of this block go through the spawn queue
+	bool m_bQueueSpawns;
+	MapHackSpawnBatch_t *m_pSpawnBatch;
+};
+
+struct MapHackExecContext_t
+{
+	MapHackExecContext_t()
+	{
+		m_pParent = NULL;
+		m_bBudgeted = false;
+	}
+
+	CUtlVector<MapHackExecFrame_t> m_vecFrames;
+
+	// Context that was running when this one started
+	MapHackExecContext_t *m_pParent;
+
+	bool m_bBudgeted;
+};
+
+//-----------------------------------------------------------------------------
+// Queued spawns are drained in Think() a few per tick. Entities queued by
+// one block run form a batch, which can trigger an event once all of them
+// have spawned.
+//-----------------------------------------------------------------------------
+struct MapHackSpawnBatch_t
+{
+	MapHackSpawnBatch_t()
+	{
+		m_szEvent[0] = '\0';
+		m_iPending = 0;
+		m_bSealed = false;
+	}
+
+	char m_szEvent[128];
+	int m_iPending;
+	bool m_bSealed; // Block has finished, no more spawns will be added
+};
+
+struct MapHackQueuedSpawn_t
+{
+	KeyValues *m_pKVEnt;
+	MapHackSpawnBatch_t *m_pBatch;
+};
+
+//-----------------------------------------------------------------------------
+// Created but not yet spawned, the whole block is spawned in one
+// hierarchical pass like map load does
+//-----------------------------------------------------------------------------
+struct MapHackPendingSpawn_t
+{
+	EHANDLE m_hEntity;
+	KeyValues *m_pKV;
+};
+
+//-----------------------------------------------------------------------------
+// Tells if a file has changed on disk
+//-----------------------------------------------------------------------------
+struct MapHackFileStamp_t
+{
+	long m_Time;
+	unsigned int m_Size;
+};
+
+//-----------------------------------------------------------------------------
+struct MapHackIncludeCacheEntry_t
+{
+	KeyValues *m_pKV;
+	MapHackFileStamp_t m_Stamp;
+	bool m_bPrefetched; // Parsed ahead, not looked up yet
+};
+
+//-----------------------------------------------------------------------------
+// Maphack parsed ahead of a map change, owned by the worker thread until it
+// has been joined
+//-----------------------------------------------------------------------------
+struct MapHackPreload_t
+{
+	MapHackPreload_t()
+	{
+		m_szFileName[0] = '\0';
+		m_pKV = NULL;
+	}
+
+	~MapHackPreload_t()
+	{
+		if ( m_pKV )
+			m_pKV->deleteThis();
+
+		FOR_EACH_DICT_FAST( m_dictIncludes, i )
+			m_dictIncludes[i]->deleteThis();
+	}
+
+	char m_szFileName[MAX_PATH];
+	KeyValues *m_pKV;
+
+	// Include trees by filename
+	CUtlDict<KeyValues*> m_dictIncludes;
+
+	// Every file read, stale preloads are thrown away
+	CUtlDict<MapHackFileStamp_t> m_dictFileStamps;
+};
+
+//-----------------------------------------------------------------------------
+// Maphack file or include that hot reload keeps an eye on
+//-----------------------------------------------------------------------------
+struct MapHackWatchedFile_t
+{
+	MapHackFileStamp_t m_Stamp;
+	int m_iWatch; // inotify watch, -1 if the file is polled
+};
+
+//-----------------------------------------------------------------------------
+// Hot reload staging, the new version is registered next to the running one
+//-----------------------------------------------------------------------------
+struct MapHackHotReload_t
+{
+	MapHackHotReload_t() : m_mapRunEntities( DefLessFunc( unsigned int ) )
+	{
+		m_pKVEntities = NULL;
+		m_iSkippedEntities = 0;
+	}
+
+	// Entity keys that have run, by content hash
+	CUtlMap<unsigned int, int> m_mapRunEntities;
+
+	// Keys that are new or changed, run once the new version is in place
+	KeyValues *m_pKVEntities;
+	int m_iSkippedEntities;
+};
+
+//-----------------------------------------------------------------------------
+// State right after registration, round restarts go back to it instead of
+// registering everything again
+//-----------------------------------------------------------------------------
+struct MapHackVariableState_t
+{
+	MapHackVariable_t *m_pVar;
+	MapHackVariable_t *m_pSaved; // Value only
+};
+
+struct MapHackEventState_t
+{
+	MapHackEvent_t *m_pEvent;
+	bool m_bTriggered;
+	float m_flTriggerTime;
+	bool m_bStopped;
+	float m_flDelayTime;
+};
+
+struct MapHackSnapshot_t
+{
+	~MapHackSnapshot_t()
+	{
+		for ( int i = 0; i < m_vecVars.Count(); ++i )
+			delete m_vecVars[i].m_pSaved;
+	}
+
+	CUtlVector<MapHackVariableState_t> m_vecVars;
+	CUtlVector<MapHackEventState_t> m_vecEvents;
+
+	// Include trees that ran their entities, in order
+	CUtlVector<KeyValues*> m_vecIncludes;
+};
+
+//-----------------------------------------------------------------------------
+struct MapHackStats_t
+{
+	MapHackStats_t()
+	{
+		V_memset( this, 0, sizeof( *this ) );
+	}
+
+	int m_iInstructions; // Entities and function keys run
+	int m_iDeferrals; // Event bodies that ran out of budget
+	int m_iDeferredTicks; // Ticks that ended with suspended event bodies
+
+	int m_iQueuedSpawns; // Entities that went through the spawn queue
+	int m_iTemplateSpawns; // Entities created from spawn templates
+	int m_iRespawns; // $respawn, found through the hammerid index
+	int m_iCachedRespawns; // Of those, ones that skipped the tokenizer
+
+	int m_iHoistedPrecaches; // Assets precached in the load-time batch
+	int m_iLatePrecaches; // Assets the load-time scan didn't see
+	int m_iWarmupFiles; // Files read ahead of the precache batch
+
+	int m_iPreloadsAdopted; // Level loads that used a preloaded maphack
+
+	int m_iIncludeCacheHits; // Includes that didn't have to be parsed again
+	int m_iIncludeCacheMisses;
+	int m_iIncludeCycles; // Includes skipped because they include themselves
+	int m_iIncludeParallelParses; // Includes parsed on the thread pool
+
+	int m_iHotReloads;
+	int m_iHotReloadChanges; // Variables and events registered again
+	int m_iHotReloadEntities; // Entity keys run again
+	int m_iHotReloadEntitiesSkipped; // Entity keys that hadn't changed
+
+	int m_iPatchedLumps; // Level loads that used a lump from maphack_patch
+
+	int m_iFastRestarts; // Round restarts that went back to the snapshot
+};
+
 //-----------------------------------------------------------------------------
 class CMapHackManager : public CGameEventListener
 {
@@ -351,11 +798,35 @@ public:
 
 	void ReloadMapHack();
 
+	// Round restarts, puts the state of the last reload back and runs the
+	// entities again. Reloads if there is nothing to go back to.
+	void RestartMapHack();
+
+	// Writes .mhc files for the maphack and its includes
+	bool CompileMapHack( const char *pszFileName );
+
+	// Root file, empty if the maphack didn't come from one
+	const char *GetFileName() const { return m_szFileName; }
+
+	// Applies changes of the maphack file and its includes to the running
+	// maphack, only what changed is registered or run again
+	bool HotReloadMapHack();
+
+	// Parses the maphack of an upcoming map on a worker thread
+	bool PreloadMapHack( const char *pszMapName );
+	static void GetMapHackFileName( const char *pszMapName, char *pszOut, int outSize );
+
+	// Runs static pre_entities of every map in the directory ahead of time
+	void PatchMaps( const char *pszDirectory );
+	static void GetPatchedLumpFileName( const char *pszMapName, char *pszOut, int outSize );
+
 	void LoadIncludes( KeyValues *pKV, int loadFlags = 0 );
 	void RegisterVariables( KeyValues *pKV );
-	static void Precache( KeyValues *pKV );
+	void Precache( KeyValues *pKV );
+	void PrecacheOnce( MapHackPrecacheType_t type, const char *pszName );
 	void RegisterEvents( KeyValues *pKV, KeyValues *pMapHack );
 	void RunEntities( KeyValues *pKV );
+	void QueueEntities( KeyValues *pKV );
 
 	void HandleEvents();
 	void TriggerEvent( MapHackEvent_t *pEvent, float flDelay = 0.0f );
@@ -368,6 +839,9 @@ public:
 	MapHackVariable_t *GetVariableByName( const char *pszName );
 	void DumpVariablesToConsole();
 
+	const MapHackStats_t &GetStats() const { return m_Stats; }
+	void DumpStatsToConsole();
+
 	MapHackFunctionType_t GetFunctionTypeByString( const char *pszString );
 	static MapHackEventType_t GetEventTypeByString( const char *pszString );
 
@@ -375,8 +849,17 @@ public:
 
 	bool HasMapHack() const { return ( m_pMapHack != NULL ); }
 
-	bool HasEntData() const { return ( m_pNewMapData != NULL ); }
-	const char *GetMapEntitiesString() const { return m_pNewMapData; }
+	bool HasEntData() const { return ( m_pNewMapData != NULL || m_bEntDataCompressed ); }
+
+	// Decompresses the hacked entities for good if they were compressed,
+	// the index reads them chunk by chunk instead
+	const char *GetMapEntitiesString();
+
+	// Index of the entity lump the level spawned from, hacked or not
+	CMapHackEntityIndex &GetEntityIndex();
+
+	// MapEntity_ParseAllEntities for round restarts, walks the index
+	void ParseAllEntities( IMapEntityFilter *pFilter, bool bActivateEntities = true );
 
 	bool IsPreEntity() const { return m_bPreEntity; }
 
@@ -389,11 +872,34 @@ public:
 	static void InvokeEntityOutputCallbacks( const MapHackOutputCallbackParams_t &params );
 
 private:
+	void PushEntities( MapHackExecContext_t *pContext, KeyValues *pKV );
+	bool ExecuteContext( MapHackExecContext_t *pContext );
+	void RunEntityKey( KeyValues *pKVEnt );
+	void UpdateOutputEvents();
+
+	CBaseEntity *CreateEntity( KeyValues *pKVEnt );
+	void FlushPendingSpawns();
+
+	CMapHackSpawnTemplate *GetSpawnTemplate( KeyValues *pKVEnt );
+	void PurgeSpawnTemplates();
+	bool ReleasePooledEntity( CBaseEntity *pEntity );
+	void QueueSpawn( MapHackExecFrame_t &frame, KeyValues *pKVEnt );
+	void SealSpawnBatch( MapHackSpawnBatch_t *pBatch );
+	void ReleaseFrameBatches( CUtlVector<MapHackExecFrame_t> &vecFrames, bool bComplete );
+	void OnSpawnBatchProgress( MapHackSpawnBatch_t *pBatch );
+	void DrainSpawnQueue();
+	void PurgeSpawnQueue();
+
+	bool IsExecBudgetExhausted( double flSliceStart, int instructions ) const;
+	void ResumeSuspendedContexts();
+	void PurgeExecContexts();
+
 	void KvIfCond( KeyValues *pKV );
 	void KvSetVariable( KeyValues *pKV );
 	void KvIncrement( KeyValues *pKV );
 	void KvDecrement( KeyValues *pKV );
 	void KvRandVariable( KeyValues *pKV );
+	void KvAssign( KeyValues *pKV );
 
 	void KvConsole( KeyValues *pKV ) const;
 	void KvFireInput( KeyValues *pKV );
@@ -419,7 +925,11 @@ private:
 	void KvPlaySound( KeyValues *pKV );
 	void KvScript( KeyValues *pKV ) const;
 
-	bool TestIfCondBlock( const char *psz );
+	bool TestIfCondBlock( KeyValues *pKV, const char *pszCond );
+
+	CMapHackExpression *GetExpression( KeyValues *pKV, const char *pszExpression );
+	void PurgeExpressions();
+	void PurgeTreeCaches( KeyValues *pTree );
 
 	static void SendInput( CBaseEntity *pEntity, const char *pszInput, const char *pszValue, MapHackType_t typeOverride = MapHackType_t::TYPE_NONE );
 
@@ -428,7 +938,7 @@ private:
 	static CBaseEntity *GetEntityByHammerID( int hammerID );
 	static CBaseEntity *GetFirstEntityByClassName( const char *pszClassName );
 	CBaseEntity *GetEntityHelper( KeyValues *pKV, bool bRestrict = false );
-	CBaseEntity *RespawnEntity( CBaseEntity *pEntity ) const;
+	CBaseEntity *RespawnEntity( CBaseEntity *pEntity );
 
 	// For $modify and $filter functions
 	// Templated for both entity variants (pre/post)
@@ -444,9 +954,41 @@ private:
 	int GetEntDataIndexByTargetName( const char *pszTargetName );
 	int GetEntDataIndexByHammerID( int id );
 
-	KeyValues *m_pMapHack;
+	void CollectPrecache( KeyValues *pKV, bool bPrecacheBlock, CUtlVector<MapHackPrecacheEntry_t> *pManifest = NULL );
+	void AddPrecache( MapHackPrecacheType_t type, const char *pszName, CUtlVector<MapHackPrecacheEntry_t> *pManifest = NULL );
+	bool IsIncludeLoading( const char *pszFilename ) const;
+	bool CompileFile( const char *pszFilename, bool bEscapeSequences, CUtlDict<bool> &dictCompiled );
+	bool PatchMap( const char *pszMapName, const char *pszEntData, KeyValues *pKV );
+	bool LoadPatchedLump( const char *pszEntData, KeyValues *pPreEntities );
+	unsigned int GetPreEntityHash( KeyValues *pPreEntities ) const;
+	KeyValues *GetCachedInclude( const char *pszFilename );
+	void AddCachedInclude( const char *pszFilename, KeyValues *pKV, const MapHackFileStamp_t &stamp );
+	void PrefetchIncludes( KeyValues *pKV );
+	void ReleaseIncludeTree( KeyValues *pKV );
+	void PurgeIncludeCache();
+
+	void SnapshotVariable( MapHackVariable_t *pVar );
+	void SnapshotEvent( MapHackEvent_t *pEvent );
+	void PurgeSnapshot();
+	void PurgeSnapshot( const KeyValues *pInclude );
+
+	KeyValues *AdoptPreload( const char *pszFileName );
+	void PurgePreload();
+
+	void WarmPrecache();
+	void FlushPrecache();
+	void PurgePrecache();
+
+	void SetMapHackFile( const char *pszFileName, int loadFlags );
+	void RunFileEntities( KeyValues *pKV );
+	void PurgeBlockReferences( const CUtlVector<KeyValues*> &vecTrees, bool bOutside );
+	void AddWatchedFile( const char *pszFilename );
+	void UpdateFileWatches();
+	bool CheckWatchedFiles();
+	void RefreshWatchedFiles();
+	void PurgeWatchedFiles();
 
-	CUtlDict<MapHackFunctionType_t> m_dictFunctions;
+	KeyValues *m_pMapHack;
 
 	CUtlDict<EHANDLE> m_dictSpawnedEnts;
 	CUtlDict<MapHackEvent_t*> m_dictEvents;
@@ -454,9 +996,59 @@ private:
 
 	CUtlVector<MapHackDelayedEvent_t> m_vecEventQueue;
 
+	// Interpreter state
+	MapHackExecContext_t *m_pExecContext;
+	CUtlVector<MapHackExecContext_t*> m_vecSuspendedContexts;
+	double m_flExecTimeUsed; // This tick
+	int m_iExecInstructionsUsed; // This tick
+
+	// Spawn templates, keyed by the entity block
+	CUtlMap<KeyValues*, CMapHackSpawnTemplate*> m_mapSpawnTemplates;
+
+	// Deferred spawns
+	CUtlVector<MapHackPendingSpawn_t> m_vecPendingSpawns;
+	CUtlVector<MapHackQueuedSpawn_t> m_vecSpawnQueue;
+	CUtlVector<MapHackSpawnBatch_t*> m_vecSpawnBatches;
+
+	MapHackStats_t m_Stats;
+
+	// Parsed includes by filename, kept across levels
+	CUtlDict<MapHackIncludeCacheEntry_t> m_dictIncludeCache;
+	CUtlVector<const char*> m_vecIncludeStack; // Files being loaded right now
+
+	// Background preload
+	MapHackPreload_t *m_pPreload;
+	ThreadHandle_t m_hPreloadThread;
+
+	// Everything this level's maphacks precache, true once it has been
+	CUtlDict<bool> m_dictPrecache[MAPHACK_PRECACHE_COUNT];
+
+	// Precaches of the compiled root file being loaded, saves the scan
+	const CUtlVector<MapHackPrecacheEntry_t> *m_pPrecacheManifest;
+
+	// Hot reload
+	char m_szFileName[MAX_PATH]; // Root file, empty if the maphack didn't come from one
+	int m_iFileLoadFlags;
+	CUtlDict<MapHackWatchedFile_t> m_dictWatchedFiles;
+	bool m_bWatchesDirty;
+	int m_iWatchFd; // inotify instance, -1 if files are polled
+	double m_flNextWatchCheck;
+	CUtlVector<unsigned int> m_vecEntityHashes; // Entity keys run from files
+	CUtlVector<KeyValues*> m_vecHotReloadEntities; // Changed keys that have run, templates point into them
+	CUtlVector<KeyValues*> m_vecIncludeTrees; // maphack_include files, queued spawns point into them
+	MapHackHotReload_t *m_pHotReload; // Set while staging
+
+	// Round restarts
+	MapHackSnapshot_t *m_pSnapshot;
+
+	// Compiled expressions, keyed by the block that owns them
+	CUtlMap<KeyValues*, CMapHackExpression*> m_mapExpressions;
+
 	// Entity data
 	CUtlVector<MapHackEntityData_t*> m_vecEntData;
 	char *m_pNewMapData;
+	CMapHackEntityIndex *m_pEntityIndex; // Built once per level
+	bool m_bEntDataCompressed; // m_pNewMapData only lives in the index
 
 	bool m_bPreEntity;
 
@@ -466,6 +1058,14 @@ private:
 //-----------------------------------------------------------------------------
 const char *MapHack_VariableValueHelper( const char *pszValue, MapHackType_t *pType = NULL );
 
+//-----------------------------------------------------------------------------
+bool MapHack_IsSettableFieldType( fieldtype_t fieldType );
+bool MapHack_SetEntityField( CBaseEntity *pEntity, fieldtype_t fieldType, unsigned int fieldOffset, const char *pszValue );
+bool MapHack_RemoveEntityConnections( CBaseEntity *pEntity );
+void MapHack_FixCollisionBounds( CBaseEntity *pEntity, KeyValues *pKV );
+bool MapHack_GetFileStamp( const char *pszFilename, MapHackFileStamp_t &stamp );
+void MapHack_DebugMsg( const char *pszMsg, ... );
+
 //-----------------------------------------------------------------------------
 template <class T>
 bool CMapHackManager::HasMatches( KeyValues *pParentNode, T *pEntity )
@@ -0,0 +1,451 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Zero-copy maphack text parser. Files are mapped into memory and
+//			tokenized in place, the keyvalues tree is built straight from
+//			the token views.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "maphack_manager.h"
+#include "maphack_parser.h"
+#include "filesystem.h"
+
+#ifdef POSIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+//-----------------------------------------------------------------------------
+// Same limit as the KeyValues tokenizer, longer tokens are left to it
+#define MAPHACK_PARSER_TOKEN_SIZE 4096
+#define MAPHACK_PARSER_MAX_DEPTH 256
+
+//-----------------------------------------------------------------------------
+enum MapHackTokenType_t
+{
+	MAPHACK_TOKEN_EOF,
+	MAPHACK_TOKEN_STRING,
+	MAPHACK_TOKEN_OPEN,
+	MAPHACK_TOKEN_CLOSE,
+	MAPHACK_TOKEN_UNSUPPORTED, // Conditionals, directives and broken syntax
+};
+
+//-----------------------------------------------------------------------------
+// View into the file, quotes aren't included
+//-----------------------------------------------------------------------------
+struct MapHackToken_t
+{
+	MapHackTokenType_t m_Type;
+	const char *m_pText;
+	int m_iLength;
+	bool m_bEscaped; // Has escape sequences to resolve
+};
+
+//-----------------------------------------------------------------------------
+CMapHackFileView::CMapHackFileView()
+{
+	m_pBase = NULL;
+	m_iSize = 0;
+	m_bMapped = false;
+}
+
+//-----------------------------------------------------------------------------
+CMapHackFileView::~CMapHackFileView()
+{
+#ifdef POSIX
+	if ( m_bMapped )
+		munmap( (void *)m_pBase, m_iSize );
+#endif
+}
+
+//-----------------------------------------------------------------------------
+bool CMapHackFileView::Open( const char *pszFilename )
+{
+#ifdef POSIX
+	char szFullPath[MAX_PATH];
+	if ( filesystem->RelativePathToFullPath( pszFilename, NULL, szFullPath, sizeof( szFullPath ), FILTER_CULLPACK ) )
+	{
+		const int fd = open( szFullPath, O_RDONLY | O_CLOEXEC );
+		if ( fd != -1 )
+		{
+			struct stat st;
+			if ( fstat( fd, &st ) == 0 && st.st_size > 0 && st.st_size < INT_MAX )
+			{
+				void *pMapping = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+				if ( pMapping != MAP_FAILED )
+				{
+					madvise( pMapping, st.st_size, MADV_SEQUENTIAL );
+
+					m_pBase = (const char *)pMapping;
+					m_iSize = (int)st.st_size;
+					m_bMapped = true;
+				}
+			}
+
+			// The mapping outlives the descriptor
+			close( fd );
+
+			if ( m_bMapped )
+				return true;
+		}
+	}
+#endif
+
+	if ( !filesystem->ReadFile( pszFilename, NULL, m_Buffer ) )
+		return false;
+
+	m_pBase = (const char *)m_Buffer.Base();
+	m_iSize = m_Buffer.TellPut();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Values get the types KeyValues would give them, GetString() of a number
+// is the formatted number either way
+//-----------------------------------------------------------------------------
+static void MapHack_SetParsedValue( KeyValues *pKV, const char *pszValue, const int length )
+{
+	if ( length == 0 )
+	{
+		pKV->SetStringValue( pszValue );
+		return;
+	}
+
+	// "0x" and 16 hex digits
+	if ( length == 18 && pszValue[0] == '0' && pszValue[1] == 'x' )
+	{
+		uint64 value = 0;
+		for ( int i = 2; i < length; ++i )
+		{
+			const char c = pszValue[i];
+
+			int digit = 0;
+			if ( c >= '0' && c <= '9' )
+				digit = c - '0';
+			else if ( c >= 'a' && c <= 'f' )
+				digit = c - 'a' + 10;
+			else if ( c >= 'A' && c <= 'F' )
+				digit = c - 'A' + 10;
+
+			value = value * 16 + digit;
+		}
+
+		pKV->SetUint64( NULL, value );
+		return;
+	}
+
+	const char *pszEnd = pszValue + length;
+
+	char *pszIntEnd;
+	char *pszFloatEnd;
+
+	errno = 0;
+	const long intValue = strtol( pszValue, &pszIntEnd, 10 );
+	const bool bOverflow = ( errno == ERANGE );
+
+	float flValue = (float)strtod( pszValue, &pszFloatEnd );
+
+#ifdef POSIX
+	// strtod takes hex here, KeyValues doesn't
+	if ( length > 1 && ( pszValue[1] == 'x' || pszValue[1] == 'X' ) )
+	{
+		flValue = 0.0f;
+		pszFloatEnd = (char *)pszValue;
+	}
+#endif
+
+	if ( pszFloatEnd > pszIntEnd && pszFloatEnd == pszEnd )
+		pKV->SetFloat( NULL, flValue );
+	else if ( pszIntEnd == pszEnd && !bOverflow )
+		pKV->SetInt( NULL, (int)intValue );
+	else
+		pKV->SetStringValue( pszValue );
+}
+
+//-----------------------------------------------------------------------------
+class CMapHackTextParser
+{
+public:
+	CMapHackTextParser( const char *pBase, int size, bool bEscapeSequences );
+
+	// NULL if the KeyValues parser has to take over
+	KeyValues *Parse();
+
+private:
+	MapHackToken_t NextToken();
+	bool ParseBlock( KeyValues *pParent, int depth );
+
+	// Null terminated copy of the token, the view itself isn't
+	const char *GetText( const MapHackToken_t &token, int *pLength = NULL );
+
+	const char *m_pCur;
+	const char *m_pEnd;
+	bool m_bEscapeSequences;
+
+	char m_szText[MAPHACK_PARSER_TOKEN_SIZE];
+};
+
+//-----------------------------------------------------------------------------
+CMapHackTextParser::CMapHackTextParser( const char *pBase, const int size, const bool bEscapeSequences )
+{
+	m_pCur = pBase;
+	m_pEnd = pBase + size;
+	m_bEscapeSequences = bEscapeSequences;
+	m_szText[0] = '\0';
+}
+
+//-----------------------------------------------------------------------------
+KeyValues *CMapHackTextParser::Parse()
+{
+	// Byte order marks confuse the KeyValues tokenizer, let it do what it does
+	if ( m_pEnd - m_pCur >= 3 && (unsigned char)m_pCur[0] == 0xEF && (unsigned char)m_pCur[1] == 0xBB && (unsigned char)m_pCur[2] == 0xBF )
+		return NULL;
+
+	const MapHackToken_t name = NextToken();
+	if ( name.m_Type != MAPHACK_TOKEN_STRING || NextToken().m_Type != MAPHACK_TOKEN_OPEN )
+		return NULL;
+
+	KeyValues *pKV = new KeyValues( GetText( name ) );
+	pKV->UsesEscapeSequences( m_bEscapeSequences );
+
+	// Peer roots are rare enough to leave to KeyValues
+	if ( !ParseBlock( pKV, 0 ) || NextToken().m_Type != MAPHACK_TOKEN_EOF )
+	{
+		pKV->deleteThis();
+		return NULL;
+	}
+
+	return pKV;
+}
+
+//-----------------------------------------------------------------------------
+MapHackToken_t CMapHackTextParser::NextToken()
+{
+	MapHackToken_t token;
+	token.m_Type = MAPHACK_TOKEN_EOF;
+	token.m_pText = NULL;
+	token.m_iLength = 0;
+	token.m_bEscaped = false;
+
+	// Whitespace and comments
+	for ( ;; )
+	{
+		while ( m_pCur < m_pEnd && V_isspace( *m_pCur ) )
+			++m_pCur;
+
+		if ( m_pEnd - m_pCur >= 2 && m_pCur[0] == '/' && m_pCur[1] == '/' )
+		{
+			while ( m_pCur < m_pEnd && *m_pCur != '\n' )
+				++m_pCur;
+
+			continue;
+		}
+
+		break;
+	}
+
+	if ( m_pCur >= m_pEnd )
+		return token;
+
+	if ( *m_pCur == '{' || *m_pCur == '}' )
+	{
+		token.m_Type = ( *m_pCur == '{' ) ? MAPHACK_TOKEN_OPEN : MAPHACK_TOKEN_CLOSE;
+		++m_pCur;
+		return token;
+	}
+
+	token.m_Type = MAPHACK_TOKEN_STRING;
+
+	if ( *m_pCur == '"' )
+	{
+		token.m_pText = ++m_pCur;
+
+		while ( m_pCur < m_pEnd && *m_pCur != '"' )
+		{
+			if ( m_bEscapeSequences && *m_pCur == '\\' )
+			{
+				// Only the ones KeyValues knows
+				if ( m_pCur + 1 >= m_pEnd || !V_strchr( "ntvbrfa\\?'\"", m_pCur[1] ) )
+				{
+					token.m_Type = MAPHACK_TOKEN_UNSUPPORTED;
+					return token;
+				}
+
+				token.m_bEscaped = true;
+				++m_pCur;
+			}
+
+			++m_pCur;
+		}
+
+		// Unterminated
+		if ( m_pCur >= m_pEnd )
+		{
+			token.m_Type = MAPHACK_TOKEN_UNSUPPORTED;
+			return token;
+		}
+
+		token.m_iLength = m_pCur - token.m_pText;
+		++m_pCur;
+	}
+	else
+	{
+		// Unquoted, up to whitespace or a control character
+		token.m_pText = m_pCur;
+
+		while ( m_pCur < m_pEnd && !V_isspace( *m_pCur ) && *m_pCur != '"' && *m_pCur != '{' && *m_pCur != '}' )
+		{
+			// Conditionals
+			if ( *m_pCur == '[' )
+			{
+				token.m_Type = MAPHACK_TOKEN_UNSUPPORTED;
+				return token;
+			}
+
+			++m_pCur;
+		}
+
+		token.m_iLength = m_pCur - token.m_pText;
+
+		// Directives
+		if ( token.m_pText[0] == '#' )
+		{
+			token.m_Type = MAPHACK_TOKEN_UNSUPPORTED;
+			return token;
+		}
+	}
+
+	if ( token.m_iLength >= MAPHACK_PARSER_TOKEN_SIZE )
+		token.m_Type = MAPHACK_TOKEN_UNSUPPORTED;
+
+	return token;
+}
+
+//-----------------------------------------------------------------------------
+bool CMapHackTextParser::ParseBlock( KeyValues *pParent, const int depth )
+{
+	if ( depth >= MAPHACK_PARSER_MAX_DEPTH )
+		return false;
+
+	// Appending through the last key, AddSubKey() walks the whole list
+	KeyValues *pLast = NULL;
+
+	for ( ;; )
+	{
+		const MapHackToken_t name = NextToken();
+		if ( name.m_Type == MAPHACK_TOKEN_CLOSE )
+			return true;
+
+		if ( name.m_Type != MAPHACK_TOKEN_STRING )
+			return false;
+
+		KeyValues *pKey = new KeyValues( GetText( name ) );
+		pKey->UsesEscapeSequences( m_bEscapeSequences );
+
+		if ( pLast )
+			pLast->SetNextKey( pKey );
+		else
+			pParent->AddSubKey( pKey );
+
+		pLast = pKey;
+
+		const MapHackToken_t value = NextToken();
+		if ( value.m_Type == MAPHACK_TOKEN_OPEN )
+		{
+			if ( !ParseBlock( pKey, depth + 1 ) )
+				return false;
+
+			continue;
+		}
+
+		if ( value.m_Type != MAPHACK_TOKEN_STRING )
+			return false;
+
+		int length;
+		const char *pszValue = GetText( value, &length );
+		MapHack_SetParsedValue( pKey, pszValue, length );
+	}
+}
+
+//-----------------------------------------------------------------------------
+const char *CMapHackTextParser::GetText( const MapHackToken_t &token, int *pLength )
+{
+	int length = token.m_iLength;
+
+	if ( !token.m_bEscaped )
+	{
+		V_memcpy( m_szText, token.m_pText, length );
+	}
+	else
+	{
+		char *pOut = m_szText;
+		for ( const char *pIn = token.m_pText; pIn < token.m_pText + token.m_iLength; ++pIn )
+		{
+			if ( *pIn != '\\' )
+			{
+				*pOut++ = *pIn;
+				continue;
+			}
+
+			switch ( *++pIn )
+			{
+				case 'n': *pOut++ = '\n'; break;
+				case 't': *pOut++ = '\t'; break;
+				case 'v': *pOut++ = '\v'; break;
+				case 'b': *pOut++ = '\b'; break;
+				case 'r': *pOut++ = '\r'; break;
+				case 'f': *pOut++ = '\f'; break;
+				case 'a': *pOut++ = '\a'; break;
+				default: *pOut++ = *pIn; break; // \\ \? \' \"
+			}
+		}
+
+		length = pOut - m_szText;
+	}
+
+	m_szText[length] = '\0';
+
+	if ( pLength )
+		*pLength = length;
+
+	return m_szText;
+}
+
+//-----------------------------------------------------------------------------
+KeyValues *MapHack_ParseFile( const char *pszFilename, const bool bEscapeSequences )
+{
+	KeyValues *pKV = NULL;
+
+	{
+		CMapHackFileView file;
+		if ( !file.Open( pszFilename ) )
+			return NULL;
+
+		CMapHackTextParser parser( file.Base(), file.Size(), bEscapeSequences );
+		pKV = parser.Parse();
+	}
+
+	if ( !pKV )
+	{
+		MapHack_DebugMsg( "Using the KeyValues parser for \"%s\"\n", pszFilename );
+
+		pKV = new KeyValues( "maphack" );
+		pKV->UsesEscapeSequences( bEscapeSequences );
+
+		if ( !pKV->LoadFromFile( filesystem, pszFilename ) )
+		{
+			pKV->deleteThis();
+			return NULL;
+		}
+	}
+
+	return pKV;
+}
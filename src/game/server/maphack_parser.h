@@ -0,0 +1,46 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Zero-copy maphack text parser. Files are mapped into memory and
+//			tokenized in place, the keyvalues tree is built straight from
+//			the token views.
+//
+//=============================================================================//
+
+#ifndef MAPHACK_PARSER_H
+#define MAPHACK_PARSER_H
+
+#include "tier1/utlbuffer.h"
+
+class KeyValues;
+
+//-----------------------------------------------------------------------------
+// File contents, mapped when it is a loose file
+//-----------------------------------------------------------------------------
+class CMapHackFileView
+{
+public:
+	CMapHackFileView();
+	~CMapHackFileView();
+
+	bool Open( const char *pszFilename );
+
+	const char *Base() const { return m_pBase; }
+	int Size() const { return m_iSize; }
+
+private:
+	const char *m_pBase;
+	int m_iSize;
+	bool m_bMapped;
+
+	// Files in packs are read through the filesystem
+	CUtlBuffer m_Buffer;
+};
+
+//-----------------------------------------------------------------------------
+// Same result as KeyValues::LoadFromFile(), NULL if the file can't be read.
+// Syntax the parser doesn't take (conditionals, #include and #base, errors)
+// is left to the KeyValues parser. Safe to call from worker threads.
+//-----------------------------------------------------------------------------
+KeyValues *MapHack_ParseFile( const char *pszFilename, bool bEscapeSequences );
+
+#endif
@@ -0,0 +1,141 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Cached datamap reflection. Every datamap is flattened once into
+//			hashed field and keyfield tables, so name lookups don't walk
+//			the class hierarchy.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "maphack_manager.h"
+#include "maphack_reflection.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+//-----------------------------------------------------------------------------
+// Datamaps are static, entries live until shutdown
+//-----------------------------------------------------------------------------
+static CUtlMap<const datamap_t *, CMapHackReflection *> g_mapMapHackReflection( DefLessFunc( const datamap_t * ) );
+
+//-----------------------------------------------------------------------------
+const CMapHackReflection *CMapHackReflection::Get( const datamap_t *pMap )
+{
+	if ( !pMap )
+		return NULL;
+
+	const unsigned short idx = g_mapMapHackReflection.Find( pMap );
+	if ( g_mapMapHackReflection.IsValidIndex( idx ) )
+		return g_mapMapHackReflection[idx];
+
+	CMapHackReflection *pReflection = new CMapHackReflection();
+	pReflection->AddFields( pMap, 0, true, true );
+	pReflection->m_Fields.Build();
+	pReflection->m_KeyFields.Build();
+
+	g_mapMapHackReflection.Insert( pMap, pReflection );
+	return pReflection;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackReflection::PurgeAll()
+{
+	g_mapMapHackReflection.PurgeAndDeleteElements();
+}
+
+//-----------------------------------------------------------------------------
+const MapHackReflectedField_t *CMapHackReflection::FindField( const char *pszName ) const
+{
+	return m_Fields.Find( pszName );
+}
+
+//-----------------------------------------------------------------------------
+const MapHackReflectedField_t *CMapHackReflection::FindKeyField( const char *pszKeyName ) const
+{
+	return m_KeyFields.Find( pszKeyName );
+}
+
+//-----------------------------------------------------------------------------
+// Flattens in the order the old recursive searches visited the fields
+//-----------------------------------------------------------------------------
+void CMapHackReflection::AddFields( const datamap_t *pMap, unsigned int baseOffset, bool bKeys, bool bOutputs )
+{
+	for ( ; pMap; pMap = pMap->baseMap )
+	{
+		for ( int i = 0; i < pMap->dataNumFields; ++i )
+		{
+			const typedescription_t *pField = &pMap->dataDesc[i];
+			const unsigned int offset = baseOffset + pField->fieldOffset[TD_OFFSET_NORMAL];
+
+			if ( pField->fieldName )
+				m_Fields.Insert( pField, pField->fieldName, offset );
+
+			// Nested classes, keys only if they aren't in array form
+			if ( pField->fieldType == FIELD_EMBEDDED && pField->td )
+			{
+				AddFields( pField->td, offset, bKeys && pField->fieldSize == 1, false );
+				continue;
+			}
+
+			if ( !pField->externalName )
+				continue;
+
+			if ( bKeys && ( pField->flags & FTYPEDESC_KEY ) )
+				m_KeyFields.Insert( pField, pField->externalName, offset );
+
+			if ( bOutputs && pField->fieldType == FIELD_CUSTOM && ( pField->flags & FTYPEDESC_OUTPUT ) )
+			{
+				MapHackReflectedField_t &output = m_vecOutputs[m_vecOutputs.AddToTail()];
+				output.m_pField = pField;
+				output.m_pszName = pField->externalName;
+				output.m_Offset = offset;
+				output.m_iNext = -1;
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackReflection::HashTable_t::Insert( const typedescription_t *pField, const char *pszName, unsigned int offset )
+{
+	MapHackReflectedField_t &entry = m_vecEntries[m_vecEntries.AddToTail()];
+	entry.m_pField = pField;
+	entry.m_pszName = pszName;
+	entry.m_Offset = offset;
+	entry.m_iNext = -1;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackReflection::HashTable_t::Build()
+{
+	int buckets = 1;
+	while ( buckets < m_vecEntries.Count() * 2 )
+		buckets <<= 1;
+
+	m_vecBuckets.SetCount( buckets );
+	m_vecBuckets.FillWithValue( -1 );
+
+	// Backwards, so chains keep the insertion order and the most derived field comes first
+	for ( int i = m_vecEntries.Count() - 1; i >= 0; --i )
+	{
+		int &head = m_vecBuckets[MapHack_HashStringCaseless( m_vecEntries[i].m_pszName, 0 ) & ( buckets - 1 )];
+		m_vecEntries[i].m_iNext = head;
+		head = i;
+	}
+}
+
+//-----------------------------------------------------------------------------
+const MapHackReflectedField_t *CMapHackReflection::HashTable_t::Find( const char *pszName ) const
+{
+	if ( m_vecBuckets.Count() == 0 )
+		return NULL;
+
+	int i = m_vecBuckets[MapHack_HashStringCaseless( pszName, 0 ) & ( m_vecBuckets.Count() - 1 )];
+	for ( ; i != -1; i = m_vecEntries[i].m_iNext )
+	{
+		if ( V_stricmp( pszName, m_vecEntries[i].m_pszName ) == 0 )
+			return &m_vecEntries[i];
+	}
+
+	return NULL;
+}
@@ -0,0 +1,61 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Cached datamap reflection. Every datamap is flattened once into
+//			hashed field and keyfield tables, so name lookups don't walk
+//			the class hierarchy.
+//
+//=============================================================================//
+
+#ifndef MAPHACK_REFLECTION_H
+#define MAPHACK_REFLECTION_H
+
+#include "tier1/utlvector.h"
+
+//-----------------------------------------------------------------------------
+struct MapHackReflectedField_t
+{
+	const typedescription_t *m_pField;
+	const char *m_pszName; // fieldName or externalName, depending on the table
+
+	// Accumulated through embedded datamaps
+	unsigned int m_Offset;
+
+	// Next field in the same bucket
+	int m_iNext;
+};
+
+//-----------------------------------------------------------------------------
+class CMapHackReflection
+{
+public:
+	// Built on the first call for each datamap
+	static const CMapHackReflection *Get( const datamap_t *pMap );
+	static void PurgeAll();
+
+	// Case-insensitive, most derived class wins
+	const MapHackReflectedField_t *FindField( const char *pszName ) const;
+	const MapHackReflectedField_t *FindKeyField( const char *pszKeyName ) const;
+
+	// Output fields of the class, m_pszName is the output name
+	int GetOutputCount() const { return m_vecOutputs.Count(); }
+	const MapHackReflectedField_t &GetOutput( int i ) const { return m_vecOutputs[i]; }
+
+private:
+	struct HashTable_t
+	{
+		CUtlVector<MapHackReflectedField_t> m_vecEntries;
+		CUtlVector<int> m_vecBuckets;
+
+		void Insert( const typedescription_t *pField, const char *pszName, unsigned int offset );
+		void Build();
+		const MapHackReflectedField_t *Find( const char *pszName ) const;
+	};
+
+	void AddFields( const datamap_t *pMap, unsigned int baseOffset, bool bKeys, bool bOutputs );
+
+	HashTable_t m_Fields;
+	HashTable_t m_KeyFields;
+	CUtlVector<MapHackReflectedField_t> m_vecOutputs;
+};
+
+#endif
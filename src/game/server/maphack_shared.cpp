@@ -0,0 +1,307 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Disk cache of compiled maphacks and patched entity lumps that
+//			servers on the same machine can point at one directory (tmpfs is
+//			the intended home), entries are named by the content they came
+//			from. It saves the parse and pre_entities work only, no memory is
+//			shared: every process reads an entry into a tree and lump copy of
+//			its own. The directory is kept under a size cap, oldest go first.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "maphack_manager.h"
+#include "maphack_shared.h"
+#include "maphack_compiled.h"
+#include "maphack_lump.h"
+#include "maphack_parser.h"
+#include "filesystem.h"
+#include "checksum_crc.h"
+#include "tier1/fmtstr.h"
+#include "tier0/threadtools.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+extern ConVar sv_maphack_shared_cache;
+extern ConVar sv_maphack_shared_cache_max_mb;
+
+//-----------------------------------------------------------------------------
+#define MAPHACK_SHARED_MAGIC ( ( 'M' << 0 ) | ( 'H' << 8 ) | ( 'S' << 16 ) | ( '1' << 24 ) )
+
+//-----------------------------------------------------------------------------
+// Ends every entry, the .mhc or .mhl before it keeps its own offsets
+//-----------------------------------------------------------------------------
+struct MapHackSharedTrailer_t
+{
+	unsigned int m_nMagic;
+	unsigned int m_nSize; // Of the entry before the trailer
+	unsigned int m_nCRC;
+};
+
+//-----------------------------------------------------------------------------
+struct MapHackSharedEntry_t
+{
+	CUtlString m_Name;
+	long m_Time;
+	unsigned int m_nSize;
+};
+
+static CInterlockedInt s_iSharedHits;
+static CInterlockedInt s_iSharedMisses;
+static CInterlockedInt s_iSharedStores;
+static CInterlockedInt s_iSharedEvictions;
+static CInterlockedInt s_iSharedCorrupt;
+
+//-----------------------------------------------------------------------------
+bool MapHack_IsSharedCacheEnabled()
+{
+	return sv_maphack_shared_cache.GetString()[0] != '\0';
+}
+
+//-----------------------------------------------------------------------------
+bool MapHack_GetContentKey( const char *pszFilename, MapHackContentKey_t &key )
+{
+	CMapHackFileView file;
+	if ( !file.Open( pszFilename ) )
+		return false;
+
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	CRC32_ProcessBuffer( &crc, file.Base(), file.Size() );
+	CRC32_Final( &crc );
+
+	key.m_nCRC = crc;
+	key.m_nSize = file.Size();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+static void MapHack_GetSharedFileName( const char *pszName, char *pszOut, int outSize )
+{
+	V_snprintf( pszOut, outSize, "%s/%s", sv_maphack_shared_cache.GetString(), pszName );
+	V_FixSlashes( pszOut );
+}
+
+//-----------------------------------------------------------------------------
+// Includes parse differently, the same text can have two entries
+//-----------------------------------------------------------------------------
+static void MapHack_GetSharedCompiledFileName( const MapHackContentKey_t &key, bool bEscapeSequences, char *pszOut, int outSize )
+{
+	MapHack_GetSharedFileName( CFmtStr( "%08x%08x%s" MAPHACK_COMPILED_EXTENSION, key.m_nCRC, key.m_nSize, bEscapeSequences ? "" : "_inc" ), pszOut, outSize );
+}
+
+//-----------------------------------------------------------------------------
+static int MapHack_CompareSharedEntries( const MapHackSharedEntry_t *pA, const MapHackSharedEntry_t *pB )
+{
+	if ( pA->m_Time != pB->m_Time )
+		return ( pA->m_Time < pB->m_Time ) ? -1 : 1;
+
+	return V_strcmp( pA->m_Name.Get(), pB->m_Name.Get() );
+}
+
+//-----------------------------------------------------------------------------
+// Oldest entries go first once the directory is over the cap. A process
+// that has one open keeps reading it, removing only unlinks the name.
+//-----------------------------------------------------------------------------
+void MapHack_EvictSharedEntries()
+{
+	const int64 maxSize = (int64)sv_maphack_shared_cache_max_mb.GetInt() * 1024 * 1024;
+	if ( maxSize <= 0 )
+		return;
+
+	char szWildcard[MAX_PATH];
+	MapHack_GetSharedFileName( "*", szWildcard, sizeof( szWildcard ) );
+
+	CUtlVector<MapHackSharedEntry_t> vecEntries;
+	int64 totalSize = 0;
+
+	FileFindHandle_t hFind;
+	for ( const char *pszName = filesystem->FindFirst( szWildcard, &hFind ); pszName; pszName = filesystem->FindNext( hFind ) )
+	{
+		if ( filesystem->FindIsDirectory( hFind ) )
+			continue;
+
+		char szFile[MAX_PATH];
+		MapHack_GetSharedFileName( pszName, szFile, sizeof( szFile ) );
+
+		MapHackSharedEntry_t &entry = vecEntries[vecEntries.AddToTail()];
+		entry.m_Name = szFile;
+		entry.m_Time = filesystem->GetFileTime( szFile );
+		entry.m_nSize = filesystem->Size( szFile );
+
+		totalSize += entry.m_nSize;
+	}
+
+	filesystem->FindClose( hFind );
+
+	if ( totalSize <= maxSize )
+		return;
+
+	vecEntries.Sort( MapHack_CompareSharedEntries );
+
+	for ( int i = 0; i < vecEntries.Count() && totalSize > maxSize; ++i )
+	{
+		// Someone else may be evicting too
+		filesystem->RemoveFile( vecEntries[i].m_Name.Get(), NULL );
+		totalSize -= vecEntries[i].m_nSize;
+		++s_iSharedEvictions;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Size and CRC are checked before anything reads the entry, a bad one is
+// removed so the next store replaces it
+//-----------------------------------------------------------------------------
+static bool MapHack_OpenSharedEntry( const char *pszFilename, CMapHackFileView &file )
+{
+	if ( !filesystem->FileExists( pszFilename ) || !file.Open( pszFilename ) )
+		return false;
+
+	bool bValid = ( file.Size() >= (int)sizeof( MapHackSharedTrailer_t ) );
+	if ( bValid )
+	{
+		const int size = file.Size() - sizeof( MapHackSharedTrailer_t );
+
+		MapHackSharedTrailer_t trailer;
+		V_memcpy( &trailer, file.Base() + size, sizeof( trailer ) );
+
+		CRC32_t crc;
+		CRC32_Init( &crc );
+		CRC32_ProcessBuffer( &crc, file.Base(), size );
+		CRC32_Final( &crc );
+
+		bValid = ( trailer.m_nMagic == MAPHACK_SHARED_MAGIC && trailer.m_nSize == (unsigned int)size && trailer.m_nCRC == crc );
+	}
+
+	if ( !bValid )
+	{
+		Warning( "MapHack WARNING: Disk cache entry \"%s\" is corrupt, removing it!\n", pszFilename );
+		filesystem->RemoveFile( pszFilename, NULL );
+		++s_iSharedCorrupt;
+	}
+
+	return bValid;
+}
+
+//-----------------------------------------------------------------------------
+// Written aside and renamed into place, readers never see half a file
+//-----------------------------------------------------------------------------
+static void MapHack_StoreSharedEntry( const char *pszFilename, CUtlBuffer &buf )
+{
+	MapHackSharedTrailer_t trailer;
+	trailer.m_nMagic = MAPHACK_SHARED_MAGIC;
+	trailer.m_nSize = buf.TellPut();
+
+	CRC32_Init( &trailer.m_nCRC );
+	CRC32_ProcessBuffer( &trailer.m_nCRC, buf.Base(), buf.TellPut() );
+	CRC32_Final( &trailer.m_nCRC );
+
+	buf.Put( &trailer, sizeof( trailer ) );
+
+	char szDirectory[MAX_PATH];
+	V_ExtractFilePath( pszFilename, szDirectory, sizeof( szDirectory ) );
+	filesystem->CreateDirHierarchy( szDirectory, NULL );
+
+	char szTemp[MAX_PATH];
+	V_snprintf( szTemp, sizeof( szTemp ), "%s.%u.%u.tmp", pszFilename, ThreadGetCurrentProcessId(), ThreadGetCurrentId() );
+
+	if ( !filesystem->WriteFile( szTemp, NULL, buf ) )
+	{
+		Warning( "MapHack WARNING: Can't write to the disk cache \"%s\"!\n", szDirectory );
+		return;
+	}
+
+	// Someone else may have stored the same entry first, theirs is as good
+	if ( !filesystem->RenameFile( szTemp, pszFilename, NULL ) )
+	{
+		filesystem->RemoveFile( szTemp, NULL );
+		return;
+	}
+
+	++s_iSharedStores;
+
+	// Stores from worker threads wait for the next level load
+	if ( ThreadInMainThread() )
+		MapHack_EvictSharedEntries();
+}
+
+//-----------------------------------------------------------------------------
+KeyValues *MapHack_LoadSharedFile( const MapHackContentKey_t &key, bool bEscapeSequences, CUtlVector<MapHackPrecacheEntry_t> *pManifest )
+{
+	char szFile[MAX_PATH];
+	MapHack_GetSharedCompiledFileName( key, bEscapeSequences, szFile, sizeof( szFile ) );
+
+	// Stored with the size of the text as its source
+	MapHackFileStamp_t stamp;
+	stamp.m_Time = 0;
+	stamp.m_Size = key.m_nSize;
+
+	KeyValues *pKV = NULL;
+	CMapHackFileView file;
+	if ( MapHack_OpenSharedEntry( szFile, file ) )
+		pKV = MapHack_ReadCompiledFile( file, szFile, bEscapeSequences, &stamp, pManifest );
+
+	if ( pKV )
+		++s_iSharedHits;
+	else
+		++s_iSharedMisses;
+
+	return pKV;
+}
+
+//-----------------------------------------------------------------------------
+void MapHack_StoreSharedFile( const MapHackContentKey_t &key, KeyValues *pKV, const CUtlVector<MapHackPrecacheEntry_t> *pManifest, bool bEscapeSequences )
+{
+	char szFile[MAX_PATH];
+	MapHack_GetSharedCompiledFileName( key, bEscapeSequences, szFile, sizeof( szFile ) );
+
+	// The key is the content, not the file on disk
+	MapHackFileStamp_t stamp;
+	stamp.m_Time = 0;
+	stamp.m_Size = key.m_nSize;
+
+	CUtlBuffer buf;
+	MapHack_BuildCompiledFile( buf, pKV, pManifest, stamp, bEscapeSequences );
+	MapHack_StoreSharedEntry( szFile, buf );
+}
+
+//-----------------------------------------------------------------------------
+char *MapHack_LoadSharedLump( unsigned int lumpCRC, unsigned int mapHackHash )
+{
+	char szFile[MAX_PATH];
+	MapHack_GetSharedFileName( CFmtStr( "%08x%08x" MAPHACK_LUMP_EXTENSION, lumpCRC, mapHackHash ), szFile, sizeof( szFile ) );
+
+	char *pszEntData = NULL;
+	CMapHackFileView file;
+	if ( MapHack_OpenSharedEntry( szFile, file ) )
+		pszEntData = MapHack_ReadLumpFile( file, szFile, lumpCRC, mapHackHash );
+
+	if ( pszEntData )
+		++s_iSharedHits;
+	else
+		++s_iSharedMisses;
+
+	return pszEntData;
+}
+
+//-----------------------------------------------------------------------------
+void MapHack_StoreSharedLump( unsigned int lumpCRC, unsigned int mapHackHash, const char *pszEntData )
+{
+	char szFile[MAX_PATH];
+	MapHack_GetSharedFileName( CFmtStr( "%08x%08x" MAPHACK_LUMP_EXTENSION, lumpCRC, mapHackHash ), szFile, sizeof( szFile ) );
+
+	CUtlBuffer buf;
+	MapHack_BuildLumpFile( buf, pszEntData, lumpCRC, mapHackHash );
+	MapHack_StoreSharedEntry( szFile, buf );
+}
+
+//-----------------------------------------------------------------------------
+void MapHack_GetSharedCacheStats( int &hits, int &misses, int &stores, int &evictions, int &corrupt )
+{
+	hits = s_iSharedHits;
+	misses = s_iSharedMisses;
+	stores = s_iSharedStores;
+	evictions = s_iSharedEvictions;
+	corrupt = s_iSharedCorrupt;
+}
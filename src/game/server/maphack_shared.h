@@ -0,0 +1,47 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Disk cache of compiled maphacks and patched entity lumps that
+//			servers on the same machine can point at one directory (tmpfs is
+//			the intended home), entries are named by the content they came
+//			from. It saves the parse and pre_entities work only, no memory is
+//			shared: every process reads an entry into a tree and lump copy of
+//			its own. The directory is kept under a size cap, oldest go first.
+//
+//=============================================================================//
+
+#ifndef MAPHACK_SHARED_H
+#define MAPHACK_SHARED_H
+
+#include "tier1/utlvector.h"
+
+class KeyValues;
+struct MapHackPrecacheEntry_t;
+
+//-----------------------------------------------------------------------------
+struct MapHackContentKey_t
+{
+	unsigned int m_nCRC;
+	unsigned int m_nSize;
+};
+
+//-----------------------------------------------------------------------------
+bool MapHack_IsSharedCacheEnabled();
+
+// Key of a text file's contents, false if it can't be read
+bool MapHack_GetContentKey( const char *pszFilename, MapHackContentKey_t &key );
+
+// Compiled maphacks. Asking for the manifest of an entry stored without one
+// is a miss. Safe to call from worker threads.
+KeyValues *MapHack_LoadSharedFile( const MapHackContentKey_t &key, bool bEscapeSequences, CUtlVector<MapHackPrecacheEntry_t> *pManifest = NULL );
+void MapHack_StoreSharedFile( const MapHackContentKey_t &key, KeyValues *pKV, const CUtlVector<MapHackPrecacheEntry_t> *pManifest, bool bEscapeSequences );
+
+// Patched entity lumps, keyed like the ones of maphack_patch
+char *MapHack_LoadSharedLump( unsigned int lumpCRC, unsigned int mapHackHash );
+void MapHack_StoreSharedLump( unsigned int lumpCRC, unsigned int mapHackHash, const char *pszEntData );
+
+// Keeps the directory under sv_maphack_shared_cache_max_mb, main thread only
+void MapHack_EvictSharedEntries();
+
+void MapHack_GetSharedCacheStats( int &hits, int &misses, int &stores, int &evictions, int &corrupt );
+
+#endif
@@ -0,0 +1,478 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Precompiled spawn templates. An entity block is resolved once
+//			into a factory and per-key field setters, so repeated spawns
+//			from the same block skip all string-based reflection.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "maphack_manager.h"
+#include "maphack_template.h"
+#include "maphack_reflection.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+//-----------------------------------------------------------------------------
+// Keys CBaseEntity::KeyValue() handles before it looks at the datamap, or
+// that need more than a field write
+//-----------------------------------------------------------------------------
+static const char *g_pszMapHackSpecialKeys[]
+{
+	"classname",
+	"model",
+	"origin",
+	"angles",
+	"angle",
+	"rendercolor",
+	"rendercolor32",
+	"renderamt",
+	"mins",
+	"maxs",
+	"disableshadows",
+	"disablereceiveshadows",
+	"nodamageforces",
+};
+
+//-----------------------------------------------------------------------------
+static bool MapHack_IsSpecialKey( const char *pszKeyName )
+{
+	// Hammer duplicate key markers are stripped by KeyValue()
+	if ( strchr( pszKeyName, '#' ) )
+		return true;
+
+	for ( unsigned int i = 0; i < ARRAYSIZE( g_pszMapHackSpecialKeys ); ++i )
+	{
+		if ( FStrEq( pszKeyName, g_pszMapHackSpecialKeys[i] ) )
+			return true;
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Bytes MapHack_SetEntityField() writes for a settable field type
+//-----------------------------------------------------------------------------
+static int MapHack_GetSettableFieldSize( const fieldtype_t fieldType )
+{
+	switch ( fieldType )
+	{
+		case FIELD_MODELNAME:
+		case FIELD_SOUNDNAME:
+		case FIELD_STRING:
+			return sizeof( string_t );
+
+		case FIELD_TIME:
+		case FIELD_FLOAT:
+			return sizeof( float );
+
+		case FIELD_BOOLEAN:
+			return sizeof( bool );
+
+		case FIELD_CHARACTER:
+			return sizeof( char );
+
+		case FIELD_SHORT:
+			return sizeof( short );
+
+		case FIELD_INTEGER:
+		case FIELD_TICK:
+			return sizeof( int );
+
+		case FIELD_POSITION_VECTOR:
+		case FIELD_VECTOR:
+			return 3 * sizeof( float );
+
+		case FIELD_VMATRIX:
+		case FIELD_VMATRIX_WORLDSPACE:
+			return 16 * sizeof( float );
+
+		case FIELD_MATRIX3X4_WORLDSPACE:
+			return 12 * sizeof( float );
+
+		case FIELD_COLOR32:
+			return sizeof( color32 );
+
+		default:
+			return 0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+CMapHackSpawnTemplate::CMapHackSpawnTemplate()
+{
+	m_bCompiled = false;
+	m_pFactory = NULL;
+	m_pszClassName = "";
+	m_pEntityKeyValues = NULL;
+
+	m_iPoolSize = 0;
+	m_iPoolHits = 0;
+	m_iPoolMisses = 0;
+	m_iPoolHighWater = 0;
+}
+
+//-----------------------------------------------------------------------------
+CMapHackSpawnTemplate::~CMapHackSpawnTemplate()
+{
+	// Dormant instances are invisible to the map, don't leave them around
+	for ( int i = 0; i < m_vecDormant.Count(); ++i )
+	{
+		CBaseEntity *pEntity = m_vecDormant[i].m_hEntity.Get();
+		if ( pEntity )
+			UTIL_Remove( pEntity );
+	}
+}
+
+//-----------------------------------------------------------------------------
+CBaseEntity *CMapHackSpawnTemplate::CreateEntity( KeyValues *pKVEnt )
+{
+	if ( !m_bCompiled )
+	{
+		m_pszClassName = pKVEnt->GetName();
+		m_pFactory = EntityFactoryDictionary()->FindFactory( m_pszClassName );
+		if ( !m_pFactory )
+		{
+			// Only complain once per block
+			Warning( "MapHack WARNING: Can't create entity of unknown class \"%s\"!\n", m_pszClassName );
+			m_bCompiled = true;
+			return NULL;
+		}
+	}
+	else if ( !m_pFactory )
+	{
+		return NULL;
+	}
+
+	IServerNetworkable *pNetwork = m_pFactory->Create( m_pszClassName );
+	CBaseEntity *pEntity = pNetwork ? pNetwork->GetBaseEntity() : NULL;
+	if ( !pEntity )
+		return NULL;
+
+	// Datamap comes from the first instance
+	const bool bFirst = !m_bCompiled;
+	if ( bFirst )
+	{
+		Compile( pKVEnt, pEntity );
+		VerifyKeys( pEntity );
+
+		if ( IsPooled() )
+			FillPool();
+	}
+	else
+	{
+		ApplyKeys( pEntity );
+	}
+
+	if ( IsPooled() )
+	{
+		// Pool ran dry, this one can still come back to it
+		if ( !bFirst )
+			++m_iPoolMisses;
+
+		TrackActive( pEntity );
+	}
+
+	return pEntity;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackSpawnTemplate::Compile( KeyValues *pKVEnt, CBaseEntity *pEntity )
+{
+	const CMapHackReflection *pReflection = CMapHackReflection::Get( pEntity->GetDataDescMap() );
+
+	m_vecKeys.Purge();
+
+	// First version of MapHack required the keyvalues field, outer values go first
+	KeyValues *pLegacyKeyValues = pKVEnt->FindKey( "keyvalues" );
+	if ( pLegacyKeyValues )
+	{
+		AddKeys( pKVEnt, pReflection );
+		m_pEntityKeyValues = pLegacyKeyValues;
+	}
+	else
+	{
+		m_pEntityKeyValues = pKVEnt;
+	}
+
+	AddKeys( m_pEntityKeyValues, pReflection );
+
+	m_iPoolSize = Max( pKVEnt->GetInt( "pool" ), 0 );
+
+	m_bCompiled = true;
+
+	MapHack_DebugMsg( "Compiled spawn template for \"%s\" (%d keys)\n", m_pszClassName, m_vecKeys.Count() );
+}
+
+//-----------------------------------------------------------------------------
+// Applies the keys to the first instance through KeyValue(), and keeps a
+// resolved field only if writing it directly gives the same bytes. Classes
+// that override KeyValue() for a keyfield parse it their own way or store it
+// elsewhere, those keys stay on KeyValue() for good.
+//-----------------------------------------------------------------------------
+void CMapHackSpawnTemplate::VerifyKeys( CBaseEntity *pEntity )
+{
+	int fallbacks = 0;
+
+	for ( int i = 0; i < m_vecKeys.Count(); ++i )
+	{
+		MapHackTemplateKey_t &key = m_vecKeys[i];
+		if ( key.m_FieldOffset == 0 )
+		{
+			ApplyKey( pEntity, key );
+			continue;
+		}
+
+		const char *pszValue = key.m_bVariable ? MapHack_VariableValueHelper( key.m_pszValue ) : key.m_pszValue;
+
+		unsigned char *pField = (unsigned char *)pEntity + key.m_FieldOffset;
+		const int size = MapHack_GetSettableFieldSize( key.m_FieldType );
+
+		unsigned char defaultValue[64], keyValue[64];
+		V_memcpy( defaultValue, pField, size );
+
+		// Poisoned first, a KeyValue() that never reaches the field leaves it as is
+		V_memset( pField, 0xA5, size );
+		pEntity->KeyValue( key.m_pszName, pszValue );
+		V_memcpy( keyValue, pField, size );
+
+		bool bWritten = false;
+		for ( int j = 0; j < size && !bWritten; ++j )
+			bWritten = ( keyValue[j] != 0xA5 );
+
+		bool bSame = false;
+		if ( bWritten )
+		{
+			MapHack_SetEntityField( pEntity, key.m_FieldType, key.m_FieldOffset, pszValue );
+			bSame = ( V_memcmp( keyValue, pField, size ) == 0 );
+		}
+
+		if ( bSame )
+			continue;
+
+		// The class handles the key itself, keep what KeyValue() did
+		V_memcpy( pField, bWritten ? keyValue : defaultValue, size );
+
+		key.m_FieldType = FIELD_VOID;
+		key.m_FieldOffset = 0;
+		key.m_iszValue = NULL_STRING;
+		++fallbacks;
+	}
+
+	if ( fallbacks > 0 )
+		MapHack_DebugMsg( "Spawn template for \"%s\": %d keys are handled by KeyValue()\n", m_pszClassName, fallbacks );
+}
+
+//-----------------------------------------------------------------------------
+// Flattens the block in the same order MapHack_ParseEntKVBlockHelper() uses
+//-----------------------------------------------------------------------------
+void CMapHackSpawnTemplate::AddKeys( KeyValues *pNode, const CMapHackReflection *pReflection )
+{
+	for ( KeyValues *pNodeData = pNode->GetFirstSubKey(); pNodeData; pNodeData = pNodeData->GetNextKey() )
+	{
+		if ( FStrEq( pNodeData->GetName(), "keyvalues" ) || FStrEq( pNodeData->GetName(), "pool" ) )
+			continue;
+
+		// Handle the connections block, outputs always go through KeyValue()
+		if ( FStrEq( pNodeData->GetName(), "connections" ) )
+		{
+			AddKeys( pNodeData, NULL );
+			continue;
+		}
+
+		MapHackTemplateKey_t &key = m_vecKeys[m_vecKeys.AddToTail()];
+		key.m_pszName = pNodeData->GetName();
+		key.m_pszValue = pNodeData->GetString();
+		key.m_bVariable = ( key.m_pszValue[0] == '%' );
+		key.m_FieldType = FIELD_VOID;
+		key.m_FieldOffset = 0;
+		key.m_iszValue = NULL_STRING;
+		key.m_bModel = FStrEq( key.m_pszName, "model" );
+
+		// Constant models only need the precache once, load usually did it already
+		if ( key.m_bModel && !key.m_bVariable )
+			GetMapHackManager()->PrecacheOnce( MAPHACK_PRECACHE_MODEL, key.m_pszValue );
+
+		if ( !pReflection || MapHack_IsSpecialKey( key.m_pszName ) )
+			continue;
+
+		const MapHackReflectedField_t *pField = pReflection->FindKeyField( key.m_pszName );
+		if ( !pField || !MapHack_IsSettableFieldType( pField->m_pField->fieldType ) )
+			continue;
+
+		key.m_FieldType = pField->m_pField->fieldType;
+		key.m_FieldOffset = pField->m_Offset;
+
+		// Pool constant strings now
+		if ( !key.m_bVariable && ( key.m_FieldType == FIELD_STRING || key.m_FieldType == FIELD_MODELNAME || key.m_FieldType == FIELD_SOUNDNAME ) )
+			key.m_iszValue = AllocPooledString( key.m_pszValue );
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackSpawnTemplate::ApplyKeys( CBaseEntity *pEntity ) const
+{
+	for ( int i = 0; i < m_vecKeys.Count(); ++i )
+		ApplyKey( pEntity, m_vecKeys[i] );
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackSpawnTemplate::ApplyKey( CBaseEntity *pEntity, const MapHackTemplateKey_t &key ) const
+{
+	if ( key.m_iszValue != NULL_STRING )
+	{
+		( *(string_t *)( (intp)pEntity + key.m_FieldOffset ) ) = key.m_iszValue;
+		return;
+	}
+
+	const char *pszValue = key.m_bVariable ? MapHack_VariableValueHelper( key.m_pszValue ) : key.m_pszValue;
+
+	if ( key.m_FieldOffset != 0 )
+	{
+		MapHack_SetEntityField( pEntity, key.m_FieldType, key.m_FieldOffset, pszValue );
+		return;
+	}
+
+	if ( key.m_bModel )
+	{
+		if ( key.m_bVariable )
+			GetMapHackManager()->PrecacheOnce( MAPHACK_PRECACHE_MODEL, pszValue );
+
+		pEntity->SetModel( pszValue );
+	}
+
+	pEntity->KeyValue( key.m_pszName, pszValue );
+}
+
+//-----------------------------------------------------------------------------
+// Pre-spawns the dormant instances
+//-----------------------------------------------------------------------------
+void CMapHackSpawnTemplate::FillPool()
+{
+	while ( m_vecDormant.Count() < m_iPoolSize )
+	{
+		IServerNetworkable *pNetwork = m_pFactory->Create( m_pszClassName );
+		CBaseEntity *pEntity = pNetwork ? pNetwork->GetBaseEntity() : NULL;
+		if ( !pEntity )
+			break;
+
+		ApplyKeys( pEntity );
+
+		if ( DispatchSpawn( pEntity ) < 0 )
+		{
+			UTIL_Remove( pEntity );
+			break;
+		}
+
+		pEntity->Activate();
+		MapHack_FixCollisionBounds( pEntity, m_pEntityKeyValues );
+
+		MakeDormant( pEntity );
+	}
+
+	MapHack_DebugMsg( "Filled pool for \"%s\" (%d instances)\n", m_pszClassName, m_vecDormant.Count() );
+}
+
+//-----------------------------------------------------------------------------
+CBaseEntity *CMapHackSpawnTemplate::AcquirePooledEntity()
+{
+	while ( m_vecDormant.Count() > 0 )
+	{
+		const MapHackPooledEntity_t pooled = m_vecDormant.Tail();
+		m_vecDormant.RemoveMultipleFromTail( 1 );
+
+		// Something else might have removed it
+		CBaseEntity *pEntity = pooled.m_hEntity.Get();
+		if ( !pEntity )
+			continue;
+
+		// Name, outputs and position come back with the keys
+		ApplyKeys( pEntity );
+
+		pEntity->SetEffects( pooled.m_fEffects );
+		pEntity->SetSolidFlags( pooled.m_usSolidFlags );
+		if ( !pooled.m_bNoThink )
+			pEntity->RemoveEFlags( EFL_NO_THINK_FUNCTION );
+
+		IPhysicsObject *pPhysics = pEntity->VPhysicsGetObject();
+		if ( pPhysics )
+		{
+			pPhysics->EnableCollisions( true );
+			pPhysics->EnableMotion( pooled.m_bMotionEnabled );
+			pPhysics->Wake();
+		}
+
+		// Keys only moved the entity, bring physics and interpolation along
+		const Vector vecOrigin = pEntity->GetAbsOrigin();
+		const QAngle angAngles = pEntity->GetAbsAngles();
+		pEntity->Teleport( &vecOrigin, &angAngles, &vec3_origin );
+
+		++m_iPoolHits;
+		TrackActive( pEntity );
+		return pEntity;
+	}
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Returns false if the entity isn't ours or the pool is full, it should be
+// removed in that case
+//-----------------------------------------------------------------------------
+bool CMapHackSpawnTemplate::ReleaseEntity( CBaseEntity *pEntity )
+{
+	if ( !m_vecActive.FindAndFastRemove( pEntity ) )
+		return false;
+
+	if ( m_vecDormant.Count() >= m_iPoolSize )
+		return false;
+
+	MakeDormant( pEntity );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackSpawnTemplate::MakeDormant( CBaseEntity *pEntity )
+{
+	MapHackPooledEntity_t &pooled = m_vecDormant[m_vecDormant.AddToTail()];
+	pooled.m_hEntity = pEntity;
+	pooled.m_fEffects = pEntity->GetEffects();
+	pooled.m_usSolidFlags = pEntity->GetSolidFlags();
+	pooled.m_bNoThink = pEntity->IsEFlagSet( EFL_NO_THINK_FUNCTION );
+	pooled.m_bMotionEnabled = false;
+
+	// Re-keying adds the connections again
+	MapHack_RemoveEntityConnections( pEntity );
+
+	// Keep targetname lookups from finding it
+	pEntity->SetName( NULL_STRING );
+
+	pEntity->AddEffects( EF_NODRAW );
+	pEntity->AddSolidFlags( FSOLID_NOT_SOLID );
+	pEntity->AddEFlags( EFL_NO_THINK_FUNCTION );
+	pEntity->SetAbsVelocity( vec3_origin );
+	pEntity->SetLocalAngularVelocity( vec3_angle );
+
+	IPhysicsObject *pPhysics = pEntity->VPhysicsGetObject();
+	if ( pPhysics )
+	{
+		pooled.m_bMotionEnabled = pPhysics->IsMotionEnabled();
+		pPhysics->EnableMotion( false );
+		pPhysics->EnableCollisions( false );
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CMapHackSpawnTemplate::TrackActive( CBaseEntity *pEntity )
+{
+	// Drop instances that were removed some other way
+	for ( int i = m_vecActive.Count() - 1; i >= 0; --i )
+	{
+		if ( !m_vecActive[i].Get() )
+			m_vecActive.FastRemove( i );
+	}
+
+	m_vecActive.AddToTail( pEntity );
+	m_iPoolHighWater = Max( m_iPoolHighWater, m_vecActive.Count() );
+}
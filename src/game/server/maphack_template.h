@@ -0,0 +1,99 @@
+//========= Copyright Felis, Licensed under 0BSD. =============================//
+//
+// Purpose: Precompiled spawn templates. An entity block is resolved once
+//			into a factory and per-key field setters, so repeated spawns
+//			from the same block skip all string-based reflection.
+//
+//=============================================================================//
+
+#ifndef MAPHACK_TEMPLATE_H
+#define MAPHACK_TEMPLATE_H
+
+#include "tier1/utlvector.h"
+
+class IEntityFactory;
+class CMapHackReflection;
+
+//-----------------------------------------------------------------------------
+struct MapHackTemplateKey_t
+{
+	const char *m_pszName;
+	const char *m_pszValue; // Raw value, variables are resolved on spawn
+	bool m_bVariable;
+
+	// Resolved keyfield, offset 0 means the key goes through KeyValue()
+	fieldtype_t m_FieldType;
+	unsigned int m_FieldOffset;
+
+	// Pooled constant for string fields
+	string_t m_iszValue;
+
+	bool m_bModel;
+};
+
+//-----------------------------------------------------------------------------
+// Dormant pool instance, with the state it had before it was put away
+//-----------------------------------------------------------------------------
+struct MapHackPooledEntity_t
+{
+	EHANDLE m_hEntity;
+	int m_fEffects;
+	int m_usSolidFlags;
+	bool m_bNoThink;
+	bool m_bMotionEnabled;
+};
+
+//-----------------------------------------------------------------------------
+class CMapHackSpawnTemplate
+{
+public:
+	CMapHackSpawnTemplate();
+	~CMapHackSpawnTemplate();
+
+	// Creates the entity and applies the keys, but doesn't spawn it
+	CBaseEntity *CreateEntity( KeyValues *pKVEnt );
+
+	// The block collision bounds are read from
+	KeyValues *GetEntityKeyValues() const { return m_pEntityKeyValues; }
+
+	// Object pool, blocks opt in with the "pool" key
+	bool IsPooled() const { return m_iPoolSize > 0; }
+	CBaseEntity *AcquirePooledEntity();
+	bool ReleaseEntity( CBaseEntity *pEntity );
+
+	int GetPoolSize() const { return m_iPoolSize; }
+	int GetPoolDormantCount() const { return m_vecDormant.Count(); }
+	int GetPoolActiveCount() const { return m_vecActive.Count(); }
+	int GetPoolHits() const { return m_iPoolHits; }
+	int GetPoolMisses() const { return m_iPoolMisses; }
+	int GetPoolHighWater() const { return m_iPoolHighWater; }
+	const char *GetClassName() const { return m_pszClassName; }
+
+private:
+	void Compile( KeyValues *pKVEnt, CBaseEntity *pEntity );
+	void AddKeys( KeyValues *pNode, const CMapHackReflection *pReflection );
+	void VerifyKeys( CBaseEntity *pEntity );
+	void ApplyKeys( CBaseEntity *pEntity ) const;
+	void ApplyKey( CBaseEntity *pEntity, const MapHackTemplateKey_t &key ) const;
+
+	void FillPool();
+	void MakeDormant( CBaseEntity *pEntity );
+	void TrackActive( CBaseEntity *pEntity );
+
+	bool m_bCompiled;
+	IEntityFactory *m_pFactory;
+	const char *m_pszClassName;
+	KeyValues *m_pEntityKeyValues;
+
+	CUtlVector<MapHackTemplateKey_t> m_vecKeys;
+
+	// Pool
+	int m_iPoolSize;
+	CUtlVector<MapHackPooledEntity_t> m_vecDormant;
+	CUtlVector<EHANDLE> m_vecActive; // Handed out, can come back with $remove
+	int m_iPoolHits;
+	int m_iPoolMisses;
+	int m_iPoolHighWater;
+};
+
+#endif